@@ -0,0 +1,57 @@
+/*
+
+module: agent.c
+
+purpose: library to submit fetch jobs to the client agent (clientd)
+
+author: Luigi Ferrettino (S254300)
+
+*/
+
+#include <string.h>
+#include <errno.h>
+
+#include "errlib.h"
+#include "agent.h"
+
+/* connect to the agent listening on the Unix socket "path", -1 if it is not running */
+int agent_connect(const char *path)
+{
+    return unix_connect(path);
+}
+
+/*******************************************************************
+ * ask the agent to fetch "filename" from host:port into "outfd";
+ * returns 0 when the file is stored, -1 if the server (or the agent)
+ * refused it, -2 if the agent went away.
+ *******************************************************************/
+int agent_fetch(int agentfd, const char *host, const char *port, const char *filename, int outfd,
+                uint32_t *dim, uint32_t *timestamp)
+{
+    char buf[AGENT_LINELEN];
+    int n;
+
+    n = snprintf(buf, sizeof(buf), "FETCH %s %s %s\r\n", host, port, filename);
+    if (n < 0 || (size_t)n >= sizeof(buf))
+        return -1;
+
+    if (write_fd(agentfd, buf, n, outfd) != n)
+        return -2;
+
+    if (readn(agentfd, buf, 5) != 5)
+        return -2;
+
+    if (strncmp(buf, "+OK\r\n", 5) == 0)
+    {
+        if (readn(agentfd, dim, 4) != 4 || readn(agentfd, timestamp, 4) != 4)
+            return -2;
+        *dim = ntohl(*dim);
+        *timestamp = ntohl(*timestamp);
+        return 0;
+    }
+
+    if (strncmp(buf, "-ERR\r", 5) == 0 && readn(agentfd, buf, 1) == 1)
+        return -1;
+
+    return -2;
+}
@@ -0,0 +1,36 @@
+/*
+ 
+ module: agent.h
+ 
+ purpose: definitions of functions in agent.c
+ 
+ reference: Luigi Ferrettino (S254300)
+ 
+ */
+
+#ifndef _AGENT_H
+
+#define _AGENT_H
+
+#include <stdint.h>
+
+#include "sockwrap.h"
+
+/*******************************************************************************
+ * a local program submits a job to the client agent (clientd) by sending:
+ * 
+ * |F|E|T|C|H| |host| |port| |...filename...|CR|LF|
+ * 
+ * with the descriptor of the destination file attached (SCM_RIGHTS). When
+ * the file is stored, the agent replies like a server: "+OK\r\n" followed by
+ * the dimension and the timestamp (network byte order), or "-ERR\r\n".
+ * More jobs can be sent on the same connection, one after the other.
+ *******************************************************************************/
+#define AGENT_LINELEN 1024
+
+int agent_connect(const char *path);
+
+int agent_fetch(int agentfd, const char *host, const char *port, const char *filename, int outfd,
+                uint32_t *dim, uint32_t *timestamp);
+
+#endif
@@ -0,0 +1,682 @@
+/*********************************************************************************************************************
+  *                                                   BENCHMARK
+  *
+  * Load generator for the servers of this repo (or any server of the same protocol). With -g it creates the files
+  * of a workload in a directory, with sizes drawn from a distribution, and prints their names:
+  *
+  *   bench -g <directory> [-N <files>] [-s <size distribution>] > <file list>
+  *
+  * where the distribution is fixed:<size>, uniform:<min>:<max> or pareto:<min>:<alpha>[:<max>] (sizes with an
+  * optional k, m or g suffix). A server started in that directory then serves the names of the list.
+  *
+  * Without -g it opens -c connections to every target in turn, with non-blocking sockets in a single epoll loop,
+  * and keeps them busy for -d seconds with GETs of names drawn at random from the list: up to -p requests
+  * pipelined on a connection, -t milliseconds of think time after every response, a new connection after -r
+  * responses (0: never). Every target gets the same workload, so the result lines compare them head-to-head:
+  *
+  *   bench [-c <connections>] [-d <seconds>] [-p <depth>] [-t <think ms>] [-r <requests>] -f <file list>
+  *         <host:port> [<host:port>...]
+  *
+  * For each target: completed requests per second, MB/s of content, percentiles 50, 99 and 99.9 of the time to
+  * the first byte of the response and of the time to its last byte (both from the moment the GET was sent), and
+  * the errors ("-ERR", connections refused or broken). The requests in flight when the time is up are not counted.
+  *
+  *
+  * [ author: Luigi Ferrettino (S254300) ]
+  *********************************************************************************************************************/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "../errlib.h"
+#include "../sockwrap.h"
+#include "../timewheel.h"
+
+#define BENCH_CONN 64                  /* connections */
+#define BENCH_SECONDS 10               /* duration of the run of a target */
+#define BENCH_FILES 1000               /* files created by -g */
+#define BENCH_SIZES "pareto:4k:1.2:64m" /* their sizes: mostly small, a few big ones */
+#define RETRY_DELAY 100                /* ms before connecting again after a failed connect() */
+#define SCRATCH 262144                 /* content read at once, and thrown away */
+#define EVENTS 1024
+
+/* GLOBAL VARIABLES */
+char *prog_name;
+
+/* a connection of the load */
+struct bconn
+{
+  int fd;                /* -1 while waiting to reconnect */
+  int connecting;        /* connect() in progress */
+  unsigned long done;    /* responses received on this connection */
+  int inflight;          /* GETs sent, response not completed */
+  int head;              /* oldest of them in sent[] */
+  uint64_t *sent;        /* time (us) each GET in flight was sent, a ring of depth entries */
+  unsigned char hdr[13]; /* "+OK", dimension, timestamp */
+  int hdrlen;
+  uint64_t left;         /* bytes of content still to come */
+  uint64_t first;        /* time (us) of the first byte of the current response, 0 before */
+  char *out;             /* GETs not written yet */
+  size_t outlen;
+  int pollout;           /* EPOLLOUT asked for */
+  int waiting;           /* think time (or reconnection delay) running */
+  struct tw_timer wake;
+};
+
+/* latencies of a run, in microseconds */
+struct samples
+{
+  uint32_t *v;
+  size_t n, cap;
+};
+
+/* workload */
+static char **names;
+static size_t nnames, maxname;
+static int nconn = BENCH_CONN, duration = BENCH_SECONDS, depth = 1, think = 0;
+static unsigned long per_conn = 0;
+
+/* state of the run of a target */
+static struct bconn *conns;
+static struct addrinfo *target;
+static struct timewheel tw;
+static int epfd;
+static uint64_t end_us;
+static unsigned short seed[3];
+static unsigned long completed, errors;
+static uint64_t received;
+static struct samples ttfb, full;
+
+/* PROTOTYPES */
+void usage(void);
+int generate(const char *dir, long nfiles, const char *dist);
+void load_list(const char *path);
+void run(const char *spec);
+void conn_open(struct bconn *c);
+void conn_fail(struct bconn *c, int error);
+void conn_wake(struct tw_timer *t, void *arg);
+void conn_event(struct bconn *c, uint32_t events);
+void submit(struct bconn *c);
+void flush_out(struct bconn *c);
+void consume(struct bconn *c, const unsigned char *buf, size_t n);
+
+static uint64_t now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* "4096", "4k", "64m", "1g" */
+static uint64_t parse_size(const char *s, char **endp)
+{
+  uint64_t v = strtoull(s, endp, 10);
+
+  switch (**endp)
+  {
+  case 'k':
+  case 'K':
+    v <<= 10;
+    (*endp)++;
+    break;
+  case 'm':
+  case 'M':
+    v <<= 20;
+    (*endp)++;
+    break;
+  case 'g':
+  case 'G':
+    v <<= 30;
+    (*endp)++;
+    break;
+  }
+
+  return v;
+}
+
+static void add_sample(struct samples *s, uint64_t us)
+{
+  if (s->n == s->cap)
+  {
+    s->cap = s->cap ? s->cap * 2 : 65536;
+    if ((s->v = realloc(s->v, s->cap * sizeof(*s->v))) == NULL)
+      err_quit("(%s) error - out of memory", prog_name);
+  }
+  s->v[s->n++] = us > UINT32_MAX ? UINT32_MAX : us;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* per mille of the sorted samples, in milliseconds */
+static double permille(const struct samples *s, int p)
+{
+  return s->n == 0 ? 0 : s->v[(s->n - 1) * p / 1000] / 1000.0;
+}
+
+int main(int argc, char *argv[])
+{
+  char *gen_dir = NULL, *list = NULL, *dist = BENCH_SIZES;
+  long nfiles = BENCH_FILES;
+  struct rlimit rl;
+  int opt, k;
+
+  /* store the program name from argv */
+  prog_name = argv[0];
+
+  while ((opt = getopt(argc, argv, "g:N:s:f:c:d:p:t:r:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'g':
+      gen_dir = optarg;
+      break;
+    case 'N':
+      if ((nfiles = atol(optarg)) < 1)
+        usage();
+      break;
+    case 's':
+      dist = optarg;
+      break;
+    case 'f':
+      list = optarg;
+      break;
+    case 'c':
+      if ((nconn = atoi(optarg)) < 1)
+        usage();
+      break;
+    case 'd':
+      if ((duration = atoi(optarg)) < 1)
+        usage();
+      break;
+    case 'p':
+      if ((depth = atoi(optarg)) < 1)
+        usage();
+      break;
+    case 't':
+      if ((think = atoi(optarg)) < 0)
+        usage();
+      break;
+    case 'r':
+      per_conn = strtoul(optarg, NULL, 10);
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if (gen_dir != NULL)
+  {
+    if (argc != optind)
+      usage();
+    exit(generate(gen_dir, nfiles, dist));
+  }
+
+  if (list == NULL || argc - optind < 1)
+    usage();
+  load_list(list);
+
+  /* thousands of connections need as many descriptors */
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+  {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && (rlim_t)nconn + 16 > rl.rlim_cur)
+  {
+    nconn = rl.rlim_cur - 16;
+    err_msg("(%s) warning - only %d connections allowed by RLIMIT_NOFILE", prog_name, nconn);
+  }
+
+  /* a server that closes must not kill the benchmark */
+  Signal(SIGPIPE, SIG_IGN);
+
+  printf("%d connections, %d s, depth %d, think %d ms, %lu requests per connection, %lu files\n\n", nconn, duration,
+         depth, think, per_conn, (unsigned long)nnames);
+  printf("%-24s %9s %9s %26s %26s %8s\n", "target", "req/s", "MB/s", "first byte p50/p99/p999", "last byte p50/p99/p999",
+         "errors");
+  fflush(stdout);
+
+  for (k = optind; k < argc; k++)
+    run(argv[k]);
+
+  exit(0);
+}
+
+void usage(void)
+{
+  err_quit("Usage: %s -g <directory> [-N <files>] [-s <size distribution>]\n"
+           "       %s [-c <connections>] [-d <seconds>] [-p <depth>] [-t <think ms>] [-r <requests>] -f <file list> "
+           "<host:port> [<host:port>...]\n"
+           "size distribution: fixed:<size> | uniform:<min>:<max> | pareto:<min>:<alpha>[:<max>] (default " BENCH_SIZES
+           ")",
+           prog_name, prog_name);
+}
+
+/**************************************************************************************
+ * create "nfiles" files named f000000, f000001... in "dir", sizes drawn from "dist",
+ * and print their names; the content is random, so no layer can compress or skip it
+ **************************************************************************************/
+int generate(const char *dir, long nfiles, const char *dist)
+{
+  unsigned short xs[3] = {1, 2, 3};
+  char path[PATH_MAX], *p, buf[65536];
+  uint64_t min = 0, max = UINT32_MAX, size, total = 0, left;
+  double alpha = 0;
+  long k;
+  int fd, kind = 0;
+  size_t i;
+
+  if (strncmp(dist, "fixed:", 6) == 0 && (min = max = parse_size(dist + 6, &p)) > 0 && *p == '\0')
+    kind = 0;
+  else if (strncmp(dist, "uniform:", 8) == 0 && (min = parse_size(dist + 8, &p)) > 0 && *p == ':' &&
+           (max = parse_size(p + 1, &p)) >= min && *p == '\0')
+    kind = 1;
+  else if (strncmp(dist, "pareto:", 7) == 0 && (min = parse_size(dist + 7, &p)) > 0 && *p == ':' &&
+           (alpha = strtod(p + 1, &p)) > 0 && (*p == '\0' || (*p == ':' && (max = parse_size(p + 1, &p)) >= min && *p == '\0')))
+    kind = 2;
+  else
+    err_quit("(%s) error - invalid size distribution %s", prog_name, dist);
+  if (max > UINT32_MAX)
+    err_quit("(%s) error - the protocol has 32 bit sizes", prog_name);
+
+  if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    err_sys("(%s) error - cannot create %s", prog_name, dir);
+
+  for (i = 0; i < sizeof(buf); i++)
+    buf[i] = nrand48(xs);
+
+  for (k = 0; k < nfiles; k++)
+  {
+    if (kind == 0)
+      size = min;
+    else if (kind == 1)
+      size = min + (uint64_t)(erand48(xs) * (max - min + 1));
+    else
+    {
+      double s = min / pow(1 - erand48(xs), 1 / alpha);
+      size = s > max ? max : (uint64_t)s;
+    }
+
+    snprintf(path, sizeof(path), "%s/f%06ld", dir, k);
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+      err_sys("(%s) error - cannot create %s", prog_name, path);
+    for (left = size; left > 0; left -= left < sizeof(buf) ? left : sizeof(buf))
+      if (writen(fd, buf, left < sizeof(buf) ? left : sizeof(buf)) < 0)
+        err_sys("(%s) error - cannot write %s", prog_name, path);
+    Close(fd);
+
+    printf("f%06ld\n", k);
+    total += size;
+  }
+
+  fprintf(stderr, "%ld files, %.1f MB, mean %.1f kB\n", nfiles, total / 1048576.0, total / 1024.0 / nfiles);
+
+  return 0;
+}
+
+/* the names to request, one per line ("-" for stdin) */
+void load_list(const char *path)
+{
+  FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+  char line[PATH_MAX];
+  size_t cap = 0, len;
+
+  if (fp == NULL)
+    err_sys("(%s) error - cannot open %s", prog_name, path);
+
+  while (fgets(line, sizeof(line), fp) != NULL)
+  {
+    len = strcspn(line, "\r\n");
+    line[len] = '\0';
+    if (len == 0)
+      continue;
+
+    if (nnames == cap)
+    {
+      cap = cap ? cap * 2 : 1024;
+      if ((names = realloc(names, cap * sizeof(*names))) == NULL)
+        err_quit("(%s) error - out of memory", prog_name);
+    }
+    if ((names[nnames++] = strdup(line)) == NULL)
+      err_quit("(%s) error - out of memory", prog_name);
+    if (len > maxname)
+      maxname = len;
+  }
+
+  if (fp != stdin)
+    fclose(fp);
+  if (nnames == 0)
+    err_quit("(%s) error - no file names in %s", prog_name, path);
+}
+
+/* the whole workload against "spec" (host:port, [IPv6]:port), then its result line */
+void run(const char *spec)
+{
+  struct addrinfo hints, *res;
+  struct epoll_event ev[EVENTS];
+  char host[NI_MAXHOST], *colon;
+  static unsigned char scratch[SCRATCH];
+  uint64_t start;
+  double secs;
+  int n, i, timeout;
+
+  /* host and port */
+  snprintf(host, sizeof(host), "%s", spec);
+  if ((colon = strrchr(host, ':')) == NULL)
+    err_quit("(%s) error - %s is not host:port", prog_name, spec);
+  *colon = '\0';
+  if (host[0] == '[' && colon[-1] == ']')
+  {
+    colon[-1] = '\0';
+    memmove(host, host + 1, strlen(host));
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  Getaddrinfo(host, colon + 1, &hints, &res);
+  target = res;
+
+  /* every target gets the same sequence of names */
+  seed[0] = 1;
+  seed[1] = 2;
+  seed[2] = 3;
+  completed = errors = received = 0;
+  ttfb.n = full.n = 0;
+
+  if ((epfd = epoll_create1(0)) < 0)
+    err_sys("(%s) error - epoll_create1() failed", prog_name);
+  tw_init(&tw, tw_now_ms());
+
+  if ((conns = calloc(nconn, sizeof(*conns))) == NULL)
+    err_quit("(%s) error - out of memory", prog_name);
+  start = now_us();
+  end_us = start + (uint64_t)duration * 1000000;
+  for (i = 0; i < nconn; i++)
+  {
+    if ((conns[i].sent = malloc(depth * sizeof(uint64_t))) == NULL ||
+        (conns[i].out = malloc(depth * (maxname + 6) + 6)) == NULL)
+      err_quit("(%s) error - out of memory", prog_name);
+    tw_timer_init(&conns[i].wake, conn_wake, &conns[i]);
+    conns[i].fd = -1;
+    conn_open(&conns[i]);
+  }
+
+  while (now_us() < end_us)
+  {
+    timeout = tw_next_timeout(&tw, tw_now_ms());
+    if (timeout < 0 || timeout > (int)((end_us - now_us()) / 1000) + 1)
+      timeout = (end_us - now_us()) / 1000 + 1;
+
+    if ((n = epoll_wait(epfd, ev, EVENTS, timeout)) < 0 && errno != EINTR)
+      err_sys("(%s) error - epoll_wait() failed", prog_name);
+
+    for (i = 0; i < n; i++)
+    {
+      struct bconn *c = ev[i].data.ptr;
+      ssize_t r = -1;
+
+      if (c->connecting || (ev[i].events & EPOLLOUT))
+        conn_event(c, ev[i].events);
+      if (c->fd < 0 || c->connecting || !(ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+        continue;
+
+      /* everything that is there: the content is only counted */
+      while (c->fd >= 0 && !c->connecting && (r = recv(c->fd, scratch, sizeof(scratch), MSG_DONTWAIT)) != 0)
+      {
+        if (r < 0)
+        {
+          if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            conn_fail(c, 1);
+          break;
+        }
+        consume(c, scratch, r);
+      }
+      if (r == 0 && c->fd >= 0 && !c->connecting)
+        conn_fail(c, c->inflight > 0); /* closed by the server */
+    }
+
+    tw_advance(&tw, tw_now_ms());
+  }
+  secs = (now_us() - start) / 1e6;
+
+  for (i = 0; i < nconn; i++)
+  {
+    if (conns[i].fd >= 0)
+      close(conns[i].fd);
+    tw_del(&tw, &conns[i].wake);
+    free(conns[i].sent);
+    free(conns[i].out);
+  }
+  free(conns);
+  close(epfd);
+  freeaddrinfo(res);
+
+  qsort(ttfb.v, ttfb.n, sizeof(uint32_t), cmp_u32);
+  qsort(full.v, full.n, sizeof(uint32_t), cmp_u32);
+
+  printf("%-24s %9.0f %9.1f %8.2f/%7.2f/%8.2f %8.2f/%7.2f/%8.2f %8lu\n", spec, completed / secs,
+         received / secs / 1048576, permille(&ttfb, 500), permille(&ttfb, 990), permille(&ttfb, 999),
+         permille(&full, 500), permille(&full, 990), permille(&full, 999), errors);
+  fflush(stdout);
+}
+
+/* non-blocking connect() to the target; on failure, again after RETRY_DELAY */
+void conn_open(struct bconn *c)
+{
+  struct epoll_event ev;
+
+  c->connecting = 1;
+  c->pollout = 1;
+  c->done = 0;
+  c->inflight = c->head = c->hdrlen = 0;
+  c->first = 0;
+  c->outlen = 0;
+
+  if ((c->fd = socket(target->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0 ||
+      (connect(c->fd, target->ai_addr, target->ai_addrlen) < 0 && errno != EINPROGRESS))
+  {
+    conn_fail(c, 1);
+    return;
+  }
+
+  ev.events = EPOLLIN | EPOLLOUT;
+  ev.data.ptr = c;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0)
+    err_sys("(%s) error - epoll_ctl() failed", prog_name);
+}
+
+/* the connection is over (broken, "-ERR", or done with -r): a new one, after a while if it never connected */
+void conn_fail(struct bconn *c, int error)
+{
+  int retry = c->connecting;
+
+  if (error)
+    errors++;
+  tw_del(&tw, &c->wake);
+  c->waiting = 0;
+  if (c->fd >= 0)
+    close(c->fd);
+  c->fd = -1;
+  c->connecting = 0;
+
+  if (retry)
+  {
+    c->waiting = 1;
+    tw_add(&tw, &c->wake, tw_now_ms() + RETRY_DELAY);
+  }
+  else
+    conn_open(c);
+}
+
+/* end of the think time (or of the reconnection delay) */
+void conn_wake(struct tw_timer *t, void *arg)
+{
+  struct bconn *c = arg;
+
+  c->waiting = 0;
+  if (c->fd < 0)
+    conn_open(c);
+  else
+    submit(c);
+}
+
+/* connected, or room in the socket buffer */
+void conn_event(struct bconn *c, uint32_t events)
+{
+  socklen_t len = sizeof(int);
+  int err = 0;
+
+  if (c->connecting)
+  {
+    if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+      return;
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+    {
+      conn_fail(c, 1);
+      return;
+    }
+    c->connecting = 0;
+    submit(c);
+    return;
+  }
+
+  flush_out(c);
+}
+
+/* GETs up to the pipelining depth, unless thinking, done with this connection or out of time */
+void submit(struct bconn *c)
+{
+  const char *name;
+  uint64_t now = now_us();
+
+  while (!c->waiting && c->inflight < depth && (per_conn == 0 || c->done + c->inflight < per_conn) && now < end_us)
+  {
+    name = names[nrand48(seed) % nnames];
+    c->outlen += sprintf(c->out + c->outlen, "GET %s\r\n", name);
+    c->sent[(c->head + c->inflight) % depth] = now;
+    c->inflight++;
+  }
+
+  flush_out(c);
+}
+
+/* write what the socket takes, wait for EPOLLOUT for the rest */
+void flush_out(struct bconn *c)
+{
+  struct epoll_event ev;
+  ssize_t n;
+
+  while (c->outlen > 0)
+  {
+    if ((n = send(c->fd, c->out, c->outlen, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0)
+    {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      {
+        conn_fail(c, 1);
+        return;
+      }
+      break;
+    }
+    memmove(c->out, c->out + n, c->outlen - n);
+    c->outlen -= n;
+  }
+
+  if (c->pollout != (c->outlen > 0))
+  {
+    c->pollout = c->outlen > 0;
+    ev.events = EPOLLIN | (c->pollout ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+  }
+}
+
+/* bytes of the responses: "+OK", dimension and timestamp, the content */
+void consume(struct bconn *c, const unsigned char *buf, size_t n)
+{
+  uint64_t now = now_us();
+  uint32_t dim;
+  size_t take;
+
+  while (n > 0 && c->fd >= 0)
+  {
+    if (c->inflight == 0)
+    {
+      conn_fail(c, 1); /* nothing was asked */
+      return;
+    }
+    if (c->first == 0)
+      c->first = now;
+
+    if (c->hdrlen < 13)
+    {
+      take = (c->hdrlen < 5 ? 5 : 13) - c->hdrlen;
+      take = take < n ? take : n;
+      memcpy(c->hdr + c->hdrlen, buf, take);
+      c->hdrlen += take;
+      buf += take;
+      n -= take;
+
+      if (c->hdrlen == 5 && memcmp(c->hdr, "+OK\r\n", 5) != 0)
+      {
+        conn_fail(c, 1); /* "-ERR", and the server closes */
+        return;
+      }
+      if (c->hdrlen < 13)
+        continue;
+      memcpy(&dim, c->hdr + 5, 4);
+      c->left = ntohl(dim);
+    }
+    else
+    {
+      take = c->left < n ? c->left : n;
+      c->left -= take;
+      received += take;
+      buf += take;
+      n -= take;
+    }
+
+    if (c->hdrlen == 13 && c->left == 0)
+    {
+      /* response completed */
+      add_sample(&ttfb, c->first - c->sent[c->head]);
+      add_sample(&full, now - c->sent[c->head]);
+      completed++;
+      c->head = (c->head + 1) % depth;
+      c->inflight--;
+      c->hdrlen = 0;
+      c->first = 0;
+      c->done++;
+
+      if (per_conn != 0 && c->done == per_conn)
+      {
+        writen(c->fd, "QUIT\r\n", 6);
+        conn_fail(c, 0);
+        return;
+      }
+      if (think > 0)
+      {
+        c->waiting = 1;
+        tw_add(&tw, &c->wake, tw_now_ms() + think);
+      }
+    }
+  }
+
+  if (c->fd >= 0)
+    submit(c);
+}
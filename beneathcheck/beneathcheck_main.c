@@ -0,0 +1,189 @@
+/*********************************************************************************************************************
+  *                                                  BENEATH CHECK
+  *
+  * Runs serve() of serve.c on one end of a socket pair, in a scratch tree built under a temporary directory:
+  *
+  *   <tmp>/root/a             served
+  *   <tmp>/root/sub/b         served
+  *   <tmp>/root/sub/up        symbolic link to ".." (still beneath the root, but not to be walked twice)
+  *   <tmp>/root/link          symbolic link to <tmp>/secret, a directory outside the working directory
+  *   <tmp>/secret/passwd      never to be listed nor sent
+  *
+  * then asks for listings and files through the symbolic links and checks that nothing outside the working
+  * directory is told or sent, while the files beneath it still are:
+  *
+  *   beneathcheck
+  *
+  * The first failure is printed with the request, and the exit status is 1.
+  *
+  *
+  * [ author: Luigi Ferrettino (S254300) ]
+  *********************************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "../errlib.h"
+#include "../sockwrap.h"
+#include "../serve.h"
+
+/* GLOBAL VARIABLES */
+char *prog_name;
+
+static char tmp[] = "/tmp/beneathcheck-XXXXXX";
+
+/* PROTOTYPES */
+void make_tree(void);
+void remove_tree(void);
+int ask(const char *request, char *content, size_t size);
+void expect_list(const char *dir, const char *must, const char *must_not);
+void expect_refused(const char *request);
+
+void make_tree(void)
+{
+  char path[PATH_MAX];
+  int fd;
+
+  if (mkdtemp(tmp) == NULL)
+    err_sys("(%s) error - mkdtemp() failed", prog_name);
+
+  snprintf(path, sizeof(path), "%s/root", tmp);
+  if (mkdir(path, 0755) < 0 || chdir(path) < 0 || mkdir("sub", 0755) < 0)
+    err_sys("(%s) error - cannot make the tree in %s", prog_name, tmp);
+  if ((fd = open("a", O_WRONLY | O_CREAT, 0644)) < 0 || write(fd, "a\n", 2) != 2 || close(fd) < 0 ||
+      (fd = open("sub/b", O_WRONLY | O_CREAT, 0644)) < 0 || write(fd, "b\n", 2) != 2 || close(fd) < 0 ||
+      symlink("..", "sub/up") < 0)
+    err_sys("(%s) error - cannot make the files in %s", prog_name, tmp);
+
+  snprintf(path, sizeof(path), "%s/secret", tmp);
+  if (mkdir(path, 0755) < 0 || symlink(path, "link") < 0)
+    err_sys("(%s) error - cannot make the outside directory in %s", prog_name, tmp);
+  snprintf(path, sizeof(path), "%s/secret/passwd", tmp);
+  if ((fd = open(path, O_WRONLY | O_CREAT, 0644)) < 0 || write(fd, "secret\n", 7) != 7 || close(fd) < 0)
+    err_sys("(%s) error - cannot make the outside file in %s", prog_name, tmp);
+}
+
+void remove_tree(void)
+{
+  char cmd[PATH_MAX + 16];
+
+  snprintf(cmd, sizeof(cmd), "rm -rf %s", tmp);
+  if (system(cmd) != 0)
+    err_msg("(%s) warning - %s not removed", prog_name, tmp);
+}
+
+/* one request on a new connection to serve(): 1 and the content (NUL terminated) if "+OK", 0 if refused */
+int ask(const char *request, char *content, size_t size)
+{
+  int sv[2], ok, fd;
+  uint32_t dim;
+  char hdr[13];
+  pid_t pid;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    err_sys("(%s) error - socketpair() failed", prog_name);
+
+  if ((pid = fork()) < 0)
+    err_sys("(%s) error - fork() failed", prog_name);
+  if (pid == 0)
+  {
+    /* its messages are not part of the check; _exit() leaves the tree to the parent */
+    close(sv[0]);
+    if ((fd = open("/dev/null", O_WRONLY)) >= 0)
+    {
+      dup2(fd, STDOUT_FILENO);
+      dup2(fd, STDERR_FILENO);
+    }
+    serve(sv[1], "beneathcheck");
+    _exit(0);
+  }
+  close(sv[1]);
+
+  if (writen(sv[0], (void *)request, strlen(request)) != (ssize_t)strlen(request))
+    err_sys("(%s) error - cannot send %s", prog_name, request);
+
+  ok = readn(sv[0], hdr, 5) == 5 && memcmp(hdr, "+OK\r\n", 5) == 0;
+  if (ok)
+  {
+    if (readn(sv[0], hdr + 5, 8) != 8)
+      err_quit("(%s) error - truncated header for %s", prog_name, request);
+    memcpy(&dim, hdr + 5, 4);
+    dim = ntohl(dim);
+    if (dim >= size || readn(sv[0], content, dim) != (ssize_t)dim)
+      err_quit("(%s) error - unexpected content for %s", prog_name, request);
+    content[dim] = '\0';
+  }
+
+  close(sv[0]);
+  waitpid(pid, NULL, 0);
+  return ok;
+}
+
+/* the listing of "dir" must have the line ending in "must", and no line with "must_not" */
+void expect_list(const char *dir, const char *must, const char *must_not)
+{
+  char request[PATH_MAX], content[65536], line[PATH_MAX];
+
+  snprintf(request, sizeof(request), "LIST %s\r\n", dir);
+  if (!ask(request, content, sizeof(content)))
+  {
+    printf("FAIL LIST %s: refused\n", dir);
+    exit(1);
+  }
+
+  snprintf(line, sizeof(line), " %s\n", must);
+  if (strstr(content, line) == NULL)
+  {
+    printf("FAIL LIST %s: %s not listed in\n%s", dir, must, content);
+    exit(1);
+  }
+  if (must_not != NULL && strstr(content, must_not) != NULL)
+  {
+    printf("FAIL LIST %s: %s listed in\n%s", dir, must_not, content);
+    exit(1);
+  }
+}
+
+void expect_refused(const char *request)
+{
+  char content[65536];
+
+  if (ask(request, content, sizeof(content)))
+  {
+    printf("FAIL %.*s: answered with\n%s\n", (int)strcspn(request, "\r"), request, content);
+    exit(1);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  prog_name = argv[0];
+  if (argc != 1)
+    err_quit("Usage: %s", prog_name);
+
+  signal(SIGPIPE, SIG_IGN);
+  make_tree();
+  atexit(remove_tree);
+
+  /* beneath the root: listed, and through "up" only once */
+  expect_list(".", "a", "passwd");
+  expect_list(".", "sub/b", "up/");
+  expect_list("sub", "sub/b", "sub/up");
+
+  /* through the link to the outside directory: neither listed nor sent */
+  expect_refused("LIST link\r\n");
+  expect_refused("LIST link/.\r\n");
+  expect_refused("LIST link/..\r\n");
+  expect_refused("LIST sub/../link/.\r\n");
+  expect_refused("GET link/passwd\r\n");
+  expect_refused("GET sub/../link/passwd\r\n");
+
+  printf("OK\n");
+  return 0;
+}
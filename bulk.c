@@ -0,0 +1,416 @@
+/*
+
+module: bulk.c
+
+purpose: download of many files over a pool of connections with work stealing
+
+author: Luigi Ferrettino (S254300)
+
+*/
+
+#define _GNU_SOURCE /* getline() */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "errlib.h"
+#include "sockwrap.h"
+#include "recvfile.h"
+#include "bulk.h"
+
+extern char *prog_name;
+
+struct bulk_ctx;
+
+/************************************************************************
+ * every connection has its own worker, owning a range [head, tail) of
+ * the jobs: it takes them from the head, while an idle worker steals
+ * the second half of the biggest range from its tail. A slow big file
+ * therefore keeps busy only its own connection.
+ ************************************************************************/
+struct worker
+{
+    pthread_t tid;
+    pthread_mutex_t lock;
+    int head, tail;
+    struct bulk_ctx *ctx;
+};
+
+struct bulk_ctx
+{
+    const char *host, *port;
+    struct bulk_job *jobs;
+    int retries;
+    struct worker *workers;
+    int nworkers;
+
+    int nokeep;           /* the server does not know KEEP, atomic */
+
+    pthread_mutex_t lock; /* protects everything below */
+    int *retry;           /* failed jobs waiting for another attempt */
+    int nretry;
+    int pending;          /* jobs not finished yet (done or given up) */
+    struct bulk_stats st;
+};
+
+/* where a job is stored: like recvfile(), by default only the last component of the path is kept */
+static const char *out_name(const struct bulk_job *job)
+{
+    if (job->dest != NULL)
+        return job->dest;
+    return strrchr(job->name, '/') != NULL ? strrchr(job->name, '/') + 1 : job->name;
+}
+
+static int cmp_name(const void *a, const void *b)
+{
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/**************************************************************************
+ * read one filename per line; empty lines and lines starting with '#' are
+ * skipped. Two lines stored under the same name (as a/x and b/x) would be
+ * written by two workers at once: the manifest is refused.
+ **************************************************************************/
+struct bulk_job *read_manifest(FILE *fp, int *njobs)
+{
+    struct bulk_job *jobs = NULL;
+    const char **names;
+    int n = 0, size = 0, i;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+
+    while ((len = getline(&line, &cap, fp)) > 0)
+    {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len == 0 || line[0] == '#')
+            continue;
+
+        if (n == size)
+        {
+            size = size ? size * 2 : 1024;
+            if ((jobs = realloc(jobs, size * sizeof(*jobs))) == NULL)
+                err_quit("(%s) error - out of memory reading the manifest", prog_name);
+        }
+        if ((jobs[n].name = strdup(line)) == NULL)
+            err_quit("(%s) error - out of memory reading the manifest", prog_name);
+        jobs[n].dest = NULL;
+        jobs[n].final = NULL;
+        jobs[n].attempts = 0;
+        jobs[n].status = GETFILE_BROKEN;
+        n++;
+    }
+
+    free(line);
+
+    if (n > 1)
+    {
+        if ((names = malloc(n * sizeof(*names))) == NULL)
+            err_quit("(%s) error - out of memory reading the manifest", prog_name);
+        for (i = 0; i < n; i++)
+            names[i] = out_name(&jobs[i]);
+        qsort(names, n, sizeof(*names), cmp_name);
+        for (i = 1; i < n; i++)
+            if (strcmp(names[i - 1], names[i]) == 0)
+                err_quit("(%s) error - two files of the manifest would be stored as %s", prog_name, names[i]);
+        free(names);
+    }
+
+    *njobs = n;
+    return jobs;
+}
+
+/* next job for the worker: its own range, then the retries, then stolen work; -1 if none */
+static int next_job(struct worker *w)
+{
+    struct bulk_ctx *ctx = w->ctx;
+    struct worker *victim;
+    int i, j, left, most, head, tail;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&w->lock);
+        j = w->head < w->tail ? w->head++ : -1;
+        pthread_mutex_unlock(&w->lock);
+        if (j >= 0)
+            return j;
+
+        pthread_mutex_lock(&ctx->lock);
+        j = ctx->nretry > 0 ? ctx->retry[--ctx->nretry] : -1;
+        pthread_mutex_unlock(&ctx->lock);
+        if (j >= 0)
+            return j;
+
+        /* the victim is the worker with more work left (read without locks, it is only a hint) */
+        victim = NULL;
+        most = 0;
+        for (i = 0; i < ctx->nworkers; i++)
+        {
+            left = ctx->workers[i].tail - ctx->workers[i].head;
+            if (&ctx->workers[i] != w && left > most)
+            {
+                most = left;
+                victim = &ctx->workers[i];
+            }
+        }
+        if (victim == NULL)
+            return -1;
+
+        /* only one lock at a time, two workers stealing from each other cannot deadlock */
+        pthread_mutex_lock(&victim->lock);
+        left = victim->tail - victim->head;
+        tail = victim->tail;
+        head = victim->tail -= left > 1 ? left / 2 : left;
+        pthread_mutex_unlock(&victim->lock);
+
+        if (head == tail)
+            continue; /* emptied meanwhile, look again */
+
+        pthread_mutex_lock(&w->lock);
+        w->head = head;
+        w->tail = tail;
+        pthread_mutex_unlock(&w->lock);
+
+        pthread_mutex_lock(&ctx->lock);
+        ctx->st.steals++;
+        pthread_mutex_unlock(&ctx->lock);
+    }
+}
+
+/* account the result of a job, queueing it again if it failed and can be retried */
+static void finish_job(struct bulk_ctx *ctx, int j, int result, uint32_t dim)
+{
+    struct bulk_job *job = &ctx->jobs[j];
+
+    pthread_mutex_lock(&ctx->lock);
+    job->attempts++;
+    job->status = result;
+    if (result == GETFILE_OK)
+    {
+        ctx->st.files++;
+        ctx->st.bytes += dim;
+        ctx->pending--;
+    }
+    else if (job->attempts <= ctx->retries)
+    {
+        ctx->retry[ctx->nretry++] = j;
+        ctx->st.retries++;
+    }
+    else
+    {
+        ctx->st.failures++;
+        ctx->pending--;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/****************************************************************************
+ * a connection for a worker, with the timeout of the single file mode and
+ * KEEP, so that a "-ERR" does not cost a new connection; *keep is 0 if the
+ * server refused it (then remembered, the other workers do not ask again).
+ * Returns the socket, -1 on error.
+ ****************************************************************************/
+static int bulk_connect(struct bulk_ctx *ctx, int *keep)
+{
+    struct timeval tval;
+    int s, r;
+
+    *keep = 0;
+    if ((s = tcp_connect_race(ctx->host, ctx->port, NULL)) < 0)
+        return -1;
+
+    tval.tv_sec = 6;
+    tval.tv_usec = 0;
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tval, sizeof(tval));
+
+    if (__atomic_load_n(&ctx->nokeep, __ATOMIC_RELAXED))
+        return s;
+    if ((r = sendkeep(s)) == GETFILE_OK)
+    {
+        *keep = 1;
+        return s;
+    }
+    close(s);
+    if (r != GETFILE_ERR)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+
+    /* refused: the server closed the connection, open another one without */
+    __atomic_store_n(&ctx->nokeep, 1, __ATOMIC_RELAXED);
+    if ((s = tcp_connect_race(ctx->host, ctx->port, NULL)) >= 0)
+        setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tval, sizeof(tval));
+    return s;
+}
+
+static void *bulk_worker(void *arg)
+{
+    struct worker *w = arg;
+    struct bulk_ctx *ctx = w->ctx;
+    struct bulk_job *job;
+    char buf[MAXBUFLEN];
+    const char *dest;
+    int j, s = -1, keep = 0, outfd, r, pending;
+    uint32_t dim, timestamp, code;
+
+    for (;;)
+    {
+        if ((j = next_job(w)) < 0)
+        {
+            /* nothing to take, but a job in progress elsewhere may still come back for a retry */
+            pthread_mutex_lock(&ctx->lock);
+            pending = ctx->pending;
+            pthread_mutex_unlock(&ctx->lock);
+            if (pending == 0)
+                break;
+            usleep(10000);
+            continue;
+        }
+        job = &ctx->jobs[j];
+
+        if (s < 0 && (s = bulk_connect(ctx, &keep)) < 0)
+        {
+            err_ret("(%s) error - connect to %s %s failed", prog_name, ctx->host, ctx->port);
+            finish_job(ctx, j, GETFILE_BROKEN, 0);
+            sleep(1);
+            continue;
+        }
+
+        dest = out_name(job);
+
+        if ((outfd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+        {
+            err_ret("(%s) error - open() failed for %s", prog_name, dest);
+            finish_job(ctx, j, GETFILE_ERR, 0);
+            continue;
+        }
+
+        r = getfile(s, job->name, outfd, buf, &dim, &timestamp);
+
+        /* a temporary file takes the place of the final one only when complete */
+        if (r == GETFILE_OK && job->final != NULL)
+        {
+            struct timespec times[2];
+
+            times[0].tv_sec = times[1].tv_sec = timestamp;
+            times[0].tv_nsec = times[1].tv_nsec = 0;
+            futimens(outfd, times);
+            if (rename(dest, job->final) < 0)
+            {
+                /* a local problem, the connection is still good */
+                err_ret("(%s) error - rename() failed for %s", prog_name, job->final);
+                remove(dest);
+                close(outfd);
+                finish_job(ctx, j, GETFILE_ERR, 0);
+                continue;
+            }
+        }
+        close(outfd);
+
+        /* after -ERR the server goes on with KEEP (the error code follows), otherwise it closes the connection;
+         * after a failure the stream is out of sync */
+        if (r != GETFILE_OK)
+            remove(dest);
+        if (r == GETFILE_BROKEN || (r == GETFILE_ERR && (!keep || readn(s, &code, 4) != 4)))
+        {
+            close(s);
+            s = -1;
+        }
+
+        finish_job(ctx, j, r, dim);
+    }
+
+    if (s >= 0)
+    {
+        writen(s, "QUIT\r\n", 6);
+        close(s);
+    }
+
+    return NULL;
+}
+
+/*****************************************************************************
+ * fetch every job from host:port over "nconn" connections; a failed file is
+ * requested again up to "retries" times. Returns the number of files given up.
+ *****************************************************************************/
+int bulk_fetch(const char *host, const char *port, struct bulk_job *jobs, int njobs, int nconn, int retries,
+               struct bulk_stats *st)
+{
+    struct bulk_ctx ctx;
+    struct timespec t1, t2;
+    int i;
+
+    if (nconn < 1)
+        nconn = 1;
+    if (nconn > njobs && njobs > 0)
+        nconn = njobs;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.host = host;
+    ctx.port = port;
+    ctx.jobs = jobs;
+    ctx.retries = retries;
+    ctx.nworkers = nconn;
+    ctx.pending = njobs;
+    pthread_mutex_init(&ctx.lock, NULL);
+
+    if ((ctx.workers = calloc(nconn, sizeof(*ctx.workers))) == NULL || (ctx.retry = calloc(njobs + 1, sizeof(int))) == NULL)
+        err_quit("(%s) error - out of memory", prog_name);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    /* every worker starts with an equal slice, stealing balances the rest */
+    for (i = 0; i < nconn; i++)
+    {
+        struct worker *w = &ctx.workers[i];
+
+        pthread_mutex_init(&w->lock, NULL);
+        w->head = (long)njobs * i / nconn;
+        w->tail = (long)njobs * (i + 1) / nconn;
+        w->ctx = &ctx;
+    }
+    for (i = 0; i < nconn; i++)
+        if (pthread_create(&ctx.workers[i].tid, NULL, bulk_worker, &ctx.workers[i]) != 0)
+            err_quit("(%s) error - pthread_create() failed", prog_name);
+    for (i = 0; i < nconn; i++)
+        pthread_join(ctx.workers[i].tid, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    ctx.st.seconds = (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+
+    for (i = 0; i < nconn; i++)
+        pthread_mutex_destroy(&ctx.workers[i].lock);
+    pthread_mutex_destroy(&ctx.lock);
+    free(ctx.workers);
+    free(ctx.retry);
+
+    if (st != NULL)
+        *st = ctx.st;
+
+    return (int)ctx.st.failures;
+}
+
+/* summary of a bulk download, with the files given up */
+void bulk_report(struct bulk_job *jobs, int njobs, const struct bulk_stats *st)
+{
+    double seconds = st->seconds > 0 ? st->seconds : 1e-6;
+    int i;
+
+    for (i = 0; i < njobs; i++)
+        if (jobs[i].status != GETFILE_OK)
+            printf("failed: {%s} (%s, %d attempts)\n", jobs[i].name,
+                   jobs[i].status == GETFILE_ERR ? "-ERR" : "connection error", jobs[i].attempts);
+
+    printf("\n%ld files received, %ld failed, %ld retries, %ld steals\n", st->files, st->failures, st->retries, st->steals);
+    printf("|- bytes: %llu in %.2f s\n", (unsigned long long)st->bytes, st->seconds);
+    printf("|- throughput: %.1f MB/s\n", st->bytes / seconds / 1000000);
+    printf("|- files/s: %.1f\n", st->files / seconds);
+    fflush(stdout);
+}
@@ -0,0 +1,49 @@
+/*
+
+ module: bulk.h
+
+ purpose: definitions of functions in bulk.c
+
+ reference: Luigi Ferrettino (S254300)
+
+ */
+
+#ifndef _BULK_H
+
+#define _BULK_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define BULK_CONN 4    /* default number of connections */
+#define BULK_RETRIES 2 /* default retries of a failed file */
+
+/* a file to fetch */
+struct bulk_job
+{
+    char *name;   /* name requested to the server */
+    char *dest;   /* where to store it, NULL for the last component of name in the current directory */
+    char *final;  /* if not NULL, dest is renamed to it once complete, with the timestamp of the server */
+    int attempts; /* how many times it has been requested */
+    int status;   /* GETFILE_OK or the last error (see recvfile.h) */
+};
+
+/* outcome of bulk_fetch() */
+struct bulk_stats
+{
+    long files;      /* files received */
+    long failures;   /* files given up after the retries */
+    long retries;    /* requests repeated after a failure */
+    long steals;     /* ranges of work taken from another connection */
+    uint64_t bytes;  /* bytes received */
+    double seconds;  /* elapsed time */
+};
+
+struct bulk_job *read_manifest(FILE *fp, int *njobs);
+
+int bulk_fetch(const char *host, const char *port, struct bulk_job *jobs, int njobs, int nconn, int retries,
+               struct bulk_stats *st);
+
+void bulk_report(struct bulk_job *jobs, int njobs, const struct bulk_stats *st);
+
+#endif
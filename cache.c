@@ -0,0 +1,250 @@
+/*
+
+module: cache.c
+
+purpose: metadata of the served files in memory shared by the forked workers, without descriptors
+
+author: Luigi Ferrettino (S254300)
+
+*/
+
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "errlib.h"
+#include "pack.h" /* pack_hash() */
+#include "stats.h"
+#include "cache.h"
+
+extern char *prog_name;
+
+static struct cache_shm *cache = NULL; /* NULL: nothing kept */
+static uint64_t lookup_gen;            /* cache->gen at the last cache_lookup() of this worker */
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* the cache, shared with the processes forked from now on, trusting an answer for "valid" milliseconds; -1 on error */
+int cache_init(unsigned valid)
+{
+    void *map;
+
+    if ((map = mmap(NULL, sizeof(struct cache_shm), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) ==
+        MAP_FAILED)
+        return -1;
+
+    cache = map;
+    cache->valid = valid;
+    return 0;
+}
+
+void Cache_init(unsigned valid)
+{
+    if (cache_init(valid) < 0)
+        err_sys("(%s) error - cannot map the metadata cache", prog_name);
+}
+
+/* first slot of the bucket of "name", NULL if the name is not kept */
+static struct cache_slot *bucket(const char *name, size_t len, uint64_t *h)
+{
+    if (cache == NULL || len >= CACHE_NAMELEN || !meta_canonical(name))
+        return NULL;
+
+    *h = pack_hash(name, len);
+    return &cache->slots[(*h & (CACHE_SLOTS / CACHE_WAYS - 1)) * CACHE_WAYS];
+}
+
+/* a consistent copy of *s in *copy; 0 if it is being written */
+static int slot_read(struct cache_slot *s, struct cache_slot *copy)
+{
+    uint32_t seq;
+
+    if ((seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE)) & 1)
+        return 0;
+    memcpy(copy, s, sizeof(*copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq;
+}
+
+/* make seq odd; 0 if another worker is writing the slot */
+static int slot_claim(struct cache_slot *s)
+{
+    uint32_t seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+
+    if ((seq & 1) || !__atomic_compare_exchange_n(&s->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return 1;
+}
+
+static void slot_release(struct cache_slot *s)
+{
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+static int slot_match(const struct cache_slot *s, const char *name, size_t len, uint64_t h)
+{
+    return s->state != CACHE_EMPTY && s->hash == h && s->namelen == len && memcmp(s->name, name, len) == 0;
+}
+
+/*******************************************************************************
+ * look "name" up as another worker found it: META_FOUND with size and timestamp
+ * in *e, META_MISSING if it was not there, META_UNKNOWN if nobody asked the
+ * filesystem in the last "valid" milliseconds. Counted in the statistics.
+ *******************************************************************************/
+int cache_lookup(const char *name, struct meta_entry *e)
+{
+    struct cache_slot *s, copy;
+    size_t len = strlen(name);
+    uint64_t h;
+    int i;
+
+    if ((s = bucket(name, len, &h)) == NULL)
+        return META_UNKNOWN;
+
+    /* what the filesystem says from now on may be stored by cache_put() */
+    lookup_gen = __atomic_load_n(&cache->gen, __ATOMIC_SEQ_CST);
+
+    for (i = 0; i < CACHE_WAYS; i++)
+    {
+        if (!slot_read(&s[i], &copy) || !slot_match(&copy, name, len, h))
+            continue;
+
+        if (now_ms() - copy.checked >= cache->valid)
+        {
+            __atomic_fetch_add(&cache->expired, 1, __ATOMIC_RELAXED);
+            break;
+        }
+
+        stats_cache(STATS_SHARED, 1);
+        if (copy.state == CACHE_MISSING)
+            return META_MISSING;
+        e->ino = copy.ino;
+        e->size = copy.size;
+        e->mtime = copy.mtime;
+        return META_FOUND;
+    }
+
+    stats_cache(STATS_SHARED, 0);
+    return META_UNKNOWN;
+}
+
+/*****************************************************************************
+ * what the filesystem said about "name" after the last cache_lookup(): the
+ * regular file described by *sb, or nothing there if sb is NULL. It goes in
+ * the slot already holding the name, otherwise in a free one, otherwise in
+ * the oldest of the bucket; not at all if a cache_forget() ran meanwhile,
+ * since the answer may be older than the change that was forgotten.
+ *****************************************************************************/
+void cache_put(const char *name, const struct stat *sb)
+{
+    struct cache_slot *s, *victim = NULL, copy;
+    size_t len = strlen(name);
+    uint64_t h, now, oldest = UINT64_MAX;
+    int i;
+
+    if ((s = bucket(name, len, &h)) == NULL)
+        return;
+
+    for (i = 0; i < CACHE_WAYS; i++)
+    {
+        if (!slot_read(&s[i], &copy))
+            continue;
+        if (slot_match(&copy, name, len, h))
+        {
+            victim = &s[i];
+            oldest = 0;
+            break;
+        }
+        if (copy.state == CACHE_EMPTY)
+            copy.checked = 0;
+        if (copy.checked < oldest)
+        {
+            victim = &s[i];
+            oldest = copy.checked;
+        }
+    }
+
+    /* the bucket is being written by others: this answer is not kept */
+    if (victim == NULL || !slot_claim(victim))
+        return;
+
+    /* checked holding the slot: a cache_forget() after this waits for it, and clears it */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&cache->gen, __ATOMIC_SEQ_CST) != lookup_gen)
+    {
+        slot_release(victim);
+        return;
+    }
+
+    now = now_ms();
+    if (oldest != 0 && now - oldest < cache->valid)
+        __atomic_fetch_add(&cache->evictions, 1, __ATOMIC_RELAXED);
+
+    victim->state = sb != NULL ? CACHE_FILE : CACHE_MISSING;
+    victim->hash = h;
+    victim->checked = now;
+    victim->ino = sb != NULL ? sb->st_ino : 0;
+    victim->size = sb != NULL ? sb->st_size : 0;
+    victim->mtime = sb != NULL ? sb->st_mtime : 0;
+    victim->namelen = len;
+    memcpy(victim->name, name, len);
+    slot_release(victim);
+
+    __atomic_fetch_add(&cache->stores, 1, __ATOMIC_RELAXED);
+}
+
+/****************************************************************************
+ * "name" has just been changed by this worker (PUT): the others must ask the
+ * filesystem. The generation goes first, so an answer taken before now is
+ * not stored anymore; a slot being written is waited for (a writer that does
+ * not come back within CACHE_TRIES is dead, and its odd slot never read).
+ ****************************************************************************/
+void cache_forget(const char *name)
+{
+    struct cache_slot *s, copy;
+    size_t len = strlen(name);
+    uint64_t h;
+    int i, tries;
+
+    if ((s = bucket(name, len, &h)) == NULL)
+        return;
+
+    __atomic_fetch_add(&cache->gen, 1, __ATOMIC_SEQ_CST);
+
+    for (i = 0; i < CACHE_WAYS; i++)
+        for (tries = 0; tries < CACHE_TRIES; tries++)
+        {
+            if (slot_read(&s[i], &copy))
+            {
+                if (!slot_match(&copy, name, len, h))
+                    break;
+                if (slot_claim(&s[i]))
+                {
+                    s[i].state = CACHE_EMPTY;
+                    slot_release(&s[i]);
+                    break;
+                }
+            }
+            sched_yield();
+        }
+}
+
+/* counters of the cache; -1 if there is none */
+int cache_counts(uint64_t *stores, uint64_t *evictions, uint64_t *expired)
+{
+    if (cache == NULL)
+        return -1;
+
+    *stores = __atomic_load_n(&cache->stores, __ATOMIC_RELAXED);
+    *evictions = __atomic_load_n(&cache->evictions, __ATOMIC_RELAXED);
+    *expired = __atomic_load_n(&cache->expired, __ATOMIC_RELAXED);
+    return 0;
+}
@@ -0,0 +1,82 @@
+/*
+
+ module: cache.h
+
+ purpose: definitions of functions in cache.c
+
+ reference: Luigi Ferrettino (S254300)
+
+ */
+
+#ifndef _CACHE_H
+
+#define _CACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "meta.h" /* META_FOUND, META_MISSING, META_UNKNOWN and struct meta_entry */
+
+/*****************************************************************************
+ * what a worker learns from the filesystem about a name (size, timestamp and
+ * inode of a regular file, or that there is nothing) is kept for CACHE_VALID
+ * milliseconds in CACHE_SLOTS slots of shared memory, CACHE_WAYS per bucket,
+ * so the other workers do not ask again: a missing name is refused without
+ * open(), a file found is held to the fstat() of its descriptor. Names longer
+ * than CACHE_NAMELEN - 1 are not kept.
+ *****************************************************************************/
+#define CACHE_SLOTS 16384 /* power of 2 */
+#define CACHE_WAYS 4
+#define CACHE_NAMELEN 80
+#define CACHE_VALID 1000
+#define CACHE_TRIES 1000 /* yields of cache_forget() waiting for a slot being written */
+
+/* state of a slot */
+#define CACHE_EMPTY 0
+#define CACHE_FILE 1    /* a regular file */
+#define CACHE_MISSING 2 /* openat2() said ENOENT */
+
+/*****************************************************************************
+ * any worker writes a slot: it makes seq odd with a compare and swap (a slot
+ * already odd is left alone) and even again when done. The readers take a
+ * copy and use it only if seq was even and did not change meanwhile, so a
+ * worker killed while writing costs a slot, never a wait.
+ *****************************************************************************/
+struct cache_slot
+{
+    uint32_t seq;     /* odd while being written */
+    uint32_t state;   /* CACHE_* */
+    uint64_t hash;    /* pack_hash() of the name */
+    uint64_t checked; /* CLOCK_MONOTONIC milliseconds of the answer of the filesystem */
+    uint64_t ino;
+    uint64_t size;
+    uint32_t mtime;
+    uint32_t namelen;
+    char name[CACHE_NAMELEN];
+};
+
+/* in shared memory, inherited by the forked workers; the counters are atomic */
+struct cache_shm
+{
+    uint64_t valid;     /* milliseconds an answer is trusted */
+    uint64_t gen;       /* calls of cache_forget() */
+    uint64_t stores;    /* answers written */
+    uint64_t evictions; /* answers still valid overwritten by others of the same bucket */
+    uint64_t expired;   /* answers found too old */
+    struct cache_slot slots[CACHE_SLOTS];
+};
+
+int cache_init(unsigned valid);
+
+void Cache_init(unsigned valid);
+
+int cache_lookup(const char *name, struct meta_entry *e);
+
+void cache_put(const char *name, const struct stat *sb);
+
+void cache_forget(const char *name);
+
+int cache_counts(uint64_t *stores, uint64_t *evictions, uint64_t *expired);
+
+#endif
@@ -28,41 +28,219 @@
   * 
   * (6 characters) and then it closes the connection with the client.
   * 
+  * The client first sends:
+  * 
+  * |K|E|E|P|CR|LF|
+  * 
+  * and a server that replies "+OK\r\n" keeps the connection open after an error, sending a 4 byte error code
+  * after "-ERR\r\n" (the codes of protocol 2): a missing file is reported and the next one is requested on the
+  * same connection. A server that does not know KEEP replies "-ERR" and closes, so the client connects again.
+  * 
+  * With -l the client connects to the local (Unix domain) socket of a server on the same host and sends
+  * "OPEN filename" instead of "GET filename": the reply carries the open file descriptor instead of the content,
+  * and the file is copied locally (see copyfile() in recvfile.c).
+  * 
+  * With -R the same files are requested to a list of replicated servers: when the first one does not answer within
+  * the -P percentile of the recent response times, the request is duplicated on the next replica and the first
+  * "+OK" wins (hedged requests, see hedge.c).
+  * 
+  * With -M a directory of the server (LIST) is mirrored into a local one: only new or changed files (size or
+  * timestamp) are fetched, in parallel, and -d removes the local files deleted on the server (see mirror.c).
+  * 
+  * With -u the files are uploaded instead (PUT, accepted by server2 -w), under the last component of their path.
+  * 
+  * With -S the client sends |S|T|A|T|S|CR|LF| and writes the reply, the counters of the server in the Prometheus
+  * text format, to the standard output and nothing else (e.g. for the textfile collector of node_exporter).
+  * 
+  * With -2 the client negotiates protocol 2 (binary frames, see proto2.h) with a HELLO and falls back to this
+  * protocol if the server does not speak it; there a missing file is reported and the next one is requested.
+  * If the server multiplexes, all the files are requested at once and their interleaved chunks are reassembled,
+  * so the small files do not wait behind the big ones. -U sets the urgency (0-3) of the files requested: the more
+  * urgent ones are sent first, then the smallest.
+  * 
   * 
   * [ author: Luigi Ferrettino (S254300) ]
   *********************************************************************************************************************/
 
+#include <sys/stat.h>
+#include <endian.h>
+
 #include "../errlib.h"
 #include "../sockwrap.h"
 #include "../recvfile.h"
+#include "../agent.h"
+#include "../bulk.h"
+#include "../hedge.h"
+#include "../mirror.h"
 
 /* GLOBAL VARIABLES */
 char *prog_name;
 
+/* PROTOTYPES */
+void usage(void);
+int agent_jobs(const char *agent_path, const char *host, const char *port, int nfiles, char **files);
+int bulk_mode(const char *manifest, const char *host, const char *port, int nconn, int retries);
+int hedge_mode(char *replica_list, int percentile, int nfiles, char **files);
+int upload_mode(const char *host, const char *port, int nfiles, char **files);
+int stats_mode(const char *host, const char *port);
+int get2_mode(const char *host, const char *port, int urgency, int nfiles, char **files);
+int get2_mux(int s, int urgency, int nfiles, char **files);
+int mirror_mode(const char *local_dir, const char *host, const char *port, const char *remote_dir, int nconn,
+                int retries, int prune);
+
 /* MAIN */
 int main(int argc, char *argv[])
 {
   int s;                              /* socket */
   char buf[MAXBUFLEN];                /* byte buffer */
   uint32_t len, dimension, timestamp; /* unsigned 32bit varibles */
+  int fd = -1;                        /* file passed by a local server */
   struct timeval tval;                /* uset to set ti TIMEOUT with setsockopt() */
+  char *local_path = NULL;            /* Unix socket of a server on this host */
+  char *agent_path = NULL;            /* Unix socket of the client agent (clientd) */
+  char *manifest = NULL;              /* file with the list of files to fetch ("-" for stdin) */
+  int nconn = BULK_CONN;              /* connections used for the manifest */
+  int retries = BULK_RETRIES;         /* retries of a failed file of the manifest */
+  char *replica_list = NULL;          /* host:port of the replicated servers */
+  int percentile = HEDGE_PERCENTILE;  /* of the response times, used as hedge delay */
+  char *mirror_dir = NULL;            /* local copy of a directory of the server */
+  int prune = 0;                      /* remove from mirror_dir what the server does not have */
+  int upload = 0;                     /* send the files instead of requesting them */
+  int stats = 0;                      /* print the counters of the server */
+  int v2 = 0;                         /* try protocol 2 first */
+  int urgency = 0;                    /* of the files requested with protocol 2 */
+  int opt, first;                     /* index of the first filename in argv */
+  int r;                              /* result of a mode */
+  int keep;                           /* KEEP accepted: an error does not close the connection */
+  int failures = 0;                   /* files not received */
+  uint32_t code;                      /* error code after "-ERR" with KEEP */
 
   /* store the program name from argv */
   prog_name = argv[0];
 
   /* checking terminal commands */
-  if (argc < 4)
+  while ((opt = getopt(argc, argv, "l:a:m:n:r:R:P:M:du2U:S")) != -1)
+  {
+    switch (opt)
+    {
+    case 'l':
+      local_path = optarg;
+      break;
+    case 'a':
+      agent_path = optarg;
+      break;
+    case 'm':
+      manifest = optarg;
+      break;
+    case 'n':
+      nconn = atoi(optarg);
+      break;
+    case 'r':
+      retries = atoi(optarg);
+      break;
+    case 'R':
+      replica_list = optarg;
+      break;
+    case 'P':
+      if ((percentile = atoi(optarg)) < 1 || percentile > 100)
+        usage();
+      break;
+    case 'M':
+      mirror_dir = optarg;
+      break;
+    case 'd':
+      prune = 1;
+      break;
+    case 'u':
+      upload = 1;
+      break;
+    case '2':
+      v2 = 1;
+      break;
+    case 'U':
+      if ((urgency = atoi(optarg)) < 0 || urgency > 3)
+        usage();
+      break;
+    case 'S':
+      stats = 1;
+      break;
+    default:
+      usage();
+    }
+  }
+
+  /* bulk download: the filenames come from the manifest */
+  if (manifest != NULL)
+  {
+    if (argc - optind != 2)
+      usage();
+    exit(bulk_mode(manifest, argv[optind], argv[optind + 1], nconn, retries));
+  }
+
+  /* mirror: the filenames come from the listing of the server */
+  if (mirror_dir != NULL)
+  {
+    if (argc - optind != 2 && argc - optind != 3)
+      usage();
+    exit(mirror_mode(mirror_dir, argv[optind], argv[optind + 1], argc - optind == 3 ? argv[optind + 2] : ".", nconn,
+                     retries, prune));
+  }
+
+  if (stats)
+  {
+    if (argc - optind != 2)
+      usage();
+    exit(stats_mode(argv[optind], argv[optind + 1]));
+  }
+
+  if (upload)
+  {
+    if (argc - optind < 3)
+      usage();
+    exit(upload_mode(argv[optind], argv[optind + 1], argc - optind - 2, argv + optind + 2));
+  }
+
+  /* replicated servers: every file goes to one of them, hedged on another if slow */
+  if (replica_list != NULL)
   {
-    err_quit("Usage: %s <IPv4/IPv6 address> <port number> <filename> [<filename>...]\n", prog_name);
+    if (argc - optind < 1)
+      usage();
+    exit(hedge_mode(replica_list, percentile, argc - optind, argv + optind));
   }
 
-  printf("NOTE: for IPv6 addresses, specify the interface with (%%) at the end of it.\n");
+  if ((local_path == NULL && argc - optind < 3) || (local_path != NULL && argc - optind < 1))
+    usage();
 
-  /*****************************************************
-   * modified tcp_connect() implementation in sockwrap.c
-   * with a non-blocking connect() and a timeout
-   *****************************************************/
-  s = tcp_connect(argv[1], argv[2]);
+  /* the agent keeps the connection warm: just submit the jobs */
+  if (agent_path != NULL)
+    exit(agent_jobs(agent_path, argv[optind], argv[optind + 1], argc - optind - 2, argv + optind + 2));
+
+  /* binary framing if the server speaks it, otherwise on with protocol 1 */
+  if (v2 && local_path == NULL && (r = get2_mode(argv[optind], argv[optind + 1], urgency, argc - optind - 2, argv + optind + 2)) <= 0)
+    exit(r);
+
+  if (local_path != NULL)
+  {
+    /* same host: no TCP stack and no copy of the content through the socket */
+    if ((s = unix_connect(local_path)) < 0)
+      err_sys("(%s) connect error for %s", prog_name, local_path);
+    first = optind;
+  }
+  else
+  {
+    printf("NOTE: for IPv6 addresses, specify the interface with (%%) at the end of it.\n");
+
+    /*****************************************************
+     * modified tcp_connect() implementation in sockwrap.c
+     * with a non-blocking connect() and a timeout
+     *****************************************************/
+    s = tcp_connect(argv[optind], argv[optind + 1]);
+    first = optind + 2;
+
+    printf("\n%s connection in %ld ms (attempt %d of %d%s)\n", tcp_connect_stats.family == AF_INET6 ? "IPv6" : "IPv4",
+           tcp_connect_stats.latency_ms, tcp_connect_stats.attempts, tcp_connect_stats.candidates,
+           tcp_connect_stats.fastopen ? ", fast open" : "");
+  }
 
   printf("\nconnected.\n===========================================================\n");
 
@@ -84,17 +262,30 @@ int main(int argc, char *argv[])
    *********************************************************************************/
   Setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (char *)&tval, sizeof(tval));
 
+  /* errors that do not close the connection, if the server knows KEEP; otherwise connect again without */
+  if ((r = sendkeep(s)) == GETFILE_ERR)
+  {
+    Close(s);
+    if ((s = local_path != NULL ? unix_connect(local_path) : tcp_connect(argv[optind], argv[optind + 1])) < 0)
+      err_sys("(%s) connect error for %s", prog_name, local_path);
+    Setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (char *)&tval, sizeof(tval));
+    printf("KEEP not supported by the server, an error closes the connection\n");
+  }
+  else if (r != GETFILE_OK)
+    err_quit("(%s) server error - invalid KEEP response", prog_name);
+  keep = r == GETFILE_OK;
+
   int k;
 
   /* loop statement for every file requested by the terminal */
-  for (k = 3; k < argc; k++)
+  for (k = first; k < argc; k++)
   {
 
     /* reset the buffer */
     memset(buf, 0, MAXBUFLEN);
 
-    /* create the "GET filename\r\n" string command */
-    strcpy(buf, "GET ");
+    /* create the "GET filename\r\n" (or "OPEN filename\r\n") string command */
+    strcpy(buf, local_path != NULL ? "OPEN " : "GET ");
     strncat(buf, argv[k], strlen(argv[k]));
     strncat(buf, "\r\n", 2);
 
@@ -107,8 +298,15 @@ int main(int argc, char *argv[])
      * read the first 5 bytes; this is the maximum number of bytes possible 
      * to read according to the protocol because, if we read 6 bytes,
      * the 6th can be the first byte of the dimension variable.
+     * A local server passes the file descriptor along with these bytes.
      **********************************************************************/
-    Readn(s, buf, 5);
+    if (local_path != NULL)
+    {
+      if ((len = Read_fd(s, buf, 5, &fd)) < 5)
+        Readn(s, buf + len, 5 - len);
+    }
+    else
+      Readn(s, buf, 5);
 
     /* check if the server response is positive */
     if (strncmp(buf, "+OK\r\n", 5) == 0)
@@ -125,7 +323,15 @@ int main(int argc, char *argv[])
       timestamp = ntohl(timestamp);
 
       /* receive the file byte by byte and store it; implemented in recvfile.c */
-      len = Recvfile(s, argv[k], dimension, buf, timestamp);
+      if (local_path == NULL)
+        len = Recvfile(s, argv[k], dimension, buf, timestamp);
+      else if (fd < 0)
+        err_quit("(%s) server error - no file descriptor received", prog_name);
+      else
+      {
+        len = Copyfile(fd, argv[k], dimension, timestamp);
+        Close(fd);
+      }
     }
     /* check if the server response is negative */
     else if (strncmp(buf, "-ERR\r", 5) == 0)
@@ -136,7 +342,14 @@ int main(int argc, char *argv[])
        **************************************************************/
       char c;
       Readn(s, &c, 1);
-      if (c == '\n')
+      if (c == '\n' && keep)
+      {
+        /* the connection goes on with the next file */
+        Readn(s, &code, 4);
+        err_msg("(%s) server error - file {%s} %s", prog_name, argv[k], ntohl(code) == V2_ENOENT ? "not found" : "refused");
+        failures++;
+      }
+      else if (c == '\n')
       {
         err_msg("(%s) server error - closing", prog_name);
         printf("\n===========================================================\n");
@@ -169,5 +382,460 @@ int main(int argc, char *argv[])
   Close(s);
   printf("closed.\n");
 
-  exit(0);
+  exit(failures != 0 ? -1 : 0);
+}
+
+void usage(void)
+{
+  err_quit("Usage: %s <IPv4/IPv6 address> <port number> <filename> [<filename>...]\n"
+           "       %s -l <local socket> <filename> [<filename>...]\n"
+           "       %s -a <agent socket> <IPv4/IPv6 address> <port number> <filename> [<filename>...]\n"
+           "       %s -m <manifest|-> [-n <connections>] [-r <retries>] <IPv4/IPv6 address> <port number>\n"
+           "       %s -R <host:port>[,<host:port>...] [-P <percentile>] <filename> [<filename>...]\n"
+           "       %s -M <local directory> [-d] [-n <connections>] [-r <retries>] <IPv4/IPv6 address> <port number> "
+           "[<remote directory>]\n"
+           "       %s -u <IPv4/IPv6 address> <port number> <filename> [<filename>...]\n"
+           "       %s -2 [-U <urgency>] <IPv4/IPv6 address> <port number> <filename> [<filename>...]\n"
+           "       %s -S <IPv4/IPv6 address> <port number>\n",
+           prog_name, prog_name, prog_name, prog_name, prog_name, prog_name, prog_name, prog_name, prog_name);
+}
+
+/*****************************************************************
+ * fetch the files through the client agent (clientd), which owns
+ * the connections to the server; same output and exit status of
+ * the direct mode.
+ *****************************************************************/
+int agent_jobs(const char *agent_path, const char *host, const char *port, int nfiles, char **files)
+{
+  int agentfd, outfd, k, r;
+  uint32_t dimension, timestamp;
+  char *name;
+
+  if ((agentfd = agent_connect(agent_path)) < 0)
+    err_sys("(%s) connect error for %s", prog_name, agent_path);
+
+  for (k = 0; k < nfiles; k++)
+  {
+    /* like recvfile(), only the last component of the path is kept */
+    name = strrchr(files[k], '/') != NULL ? strrchr(files[k], '/') + 1 : files[k];
+
+    if ((outfd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+      err_sys("(%s) error - open() failed", prog_name);
+
+    printf("\nfile {%s} submitted to the agent, waiting for response.\n", files[k]);
+
+    r = agent_fetch(agentfd, host, port, files[k], outfd, &dimension, &timestamp);
+    Close(outfd);
+
+    if (r != 0)
+    {
+      remove(name);
+      err_msg("(%s) %s error - closing", prog_name, r == -1 ? "server" : "agent");
+      Close(agentfd);
+      return -1;
+    }
+
+    printf("{%s} received\n|- bytes: %lu\n|- timestamp: %lu\n", name, (unsigned long)dimension, (unsigned long)timestamp);
+  }
+
+  Close(agentfd);
+  return 0;
+}
+
+/******************************************************************
+ * fetch every file listed in the manifest (one per line) over a
+ * pool of connections, see bulk.c; exit status -1 if some failed.
+ ******************************************************************/
+int bulk_mode(const char *manifest, const char *host, const char *port, int nconn, int retries)
+{
+  struct bulk_job *jobs;
+  struct bulk_stats st;
+  int njobs, failures;
+  FILE *fp;
+
+  if (strcmp(manifest, "-") == 0)
+    fp = stdin;
+  else
+    fp = Fopen(manifest, "r");
+
+  jobs = read_manifest(fp, &njobs);
+  if (fp != stdin)
+    Fclose(fp);
+
+  Signal(SIGPIPE, SIG_IGN);
+
+  printf("%d files in the manifest, %d connections to %s %s\n", njobs, nconn, host, port);
+  fflush(stdout);
+
+  failures = bulk_fetch(host, port, jobs, njobs, nconn, retries, &st);
+  bulk_report(jobs, njobs, &st);
+
+  return failures > 0 ? -1 : 0;
+}
+
+/********************************************************************
+ * fetch the files from a list of replicated servers: the primary
+ * rotates over the replicas, a slow one is hedged on the next (see
+ * hedge.c); exit status -1 if some file was not received.
+ ********************************************************************/
+int hedge_mode(char *replica_list, int percentile, int nfiles, char **files)
+{
+  struct replica *r;
+  struct hedge_stats st;
+  char buf[MAXBUFLEN], *name;
+  int nrep, outfd, k, res, winner;
+  uint32_t dimension, timestamp;
+
+  if ((nrep = parse_replicas(replica_list, &r)) < 1)
+    usage();
+
+  memset(&st, 0, sizeof(st));
+  st.percentile = percentile;
+
+  Signal(SIGPIPE, SIG_IGN);
+
+  printf("%d replicas, hedging after the %dth percentile of the response time\n", nrep, percentile);
+
+  for (k = 0; k < nfiles; k++)
+  {
+    /* like recvfile(), only the last component of the path is kept */
+    name = strrchr(files[k], '/') != NULL ? strrchr(files[k], '/') + 1 : files[k];
+
+    if ((outfd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+      err_sys("(%s) error - open() failed", prog_name);
+
+    printf("\nfile {%s} requested, waiting for response.\n", files[k]);
+
+    res = hedge_fetch(r, nrep, k % nrep, files[k], outfd, buf, &dimension, &timestamp, &st, &winner);
+    Close(outfd);
+
+    if (res != GETFILE_OK)
+    {
+      remove(name);
+      err_msg("(%s) %s error for {%s}", prog_name, res == GETFILE_ERR ? "server" : "connection", files[k]);
+      continue;
+    }
+
+    printf("{%s} received\n|- bytes: %lu\n|- timestamp: %lu\n|- from: %s %s\n", name, (unsigned long)dimension,
+           (unsigned long)timestamp, r[winner].host, r[winner].port);
+  }
+
+  for (k = 0; k < nrep; k++)
+    if (r[k].fd >= 0)
+    {
+      writen(r[k].fd, "QUIT\r\n", 6);
+      Close(r[k].fd);
+    }
+  free(r);
+
+  printf("\n===========================================================\n");
+  printf("%ld requests, %ld failed, %ld hedged (%.1f%%), hedge won %ld times (%.1f%% of the hedged)\n", st.requests,
+         st.failures, st.hedged, st.requests ? 100.0 * st.hedged / st.requests : 0.0, st.hedge_wins,
+         st.hedged ? 100.0 * st.hedge_wins / st.hedged : 0.0);
+  printf("|- hedge delay: %d ms\n", hedge_delay(&st));
+
+  return st.failures > 0 ? -1 : 0;
+}
+
+/*********************************************************************
+ * bring local_dir up to date with remote_dir of the server, fetching
+ * only what changed (see mirror.c); exit status -1 if some failed.
+ *********************************************************************/
+int mirror_mode(const char *local_dir, const char *host, const char *port, const char *remote_dir, int nconn,
+                int retries, int prune)
+{
+  struct mirror_stats st;
+  int failures;
+
+  Signal(SIGPIPE, SIG_IGN);
+
+  printf("mirroring {%s} of %s %s into %s\n", remote_dir, host, port, local_dir);
+  fflush(stdout);
+
+  failures = mirror(host, port, remote_dir, local_dir, nconn, retries, prune, &st);
+
+  printf("\n%ld files on the server: %ld up to date, %ld fetched, %ld failed, %ld pruned\n", st.listed, st.uptodate,
+         st.bulk.files, st.bulk.failures, st.pruned);
+
+  return failures != 0 ? -1 : 0;
+}
+
+/*********************************************************************
+ * upload the files (PUT) on a single connection, the content goes out
+ * with sendfile(); stop at the first refusal, as the download does.
+ *********************************************************************/
+int upload_mode(const char *host, const char *port, int nfiles, char **files)
+{
+  char buf[MAXBUFLEN], *name;
+  uint32_t dimension, timestamp;
+  struct timeval tval;
+  struct stat sb;
+  int s, fd, k, r;
+
+  Signal(SIGPIPE, SIG_IGN);
+
+  s = tcp_connect((char *)host, (char *)port);
+
+  /* the reply comes after the server synced the file: same timeout of the downloads */
+  tval.tv_sec = 6;
+  tval.tv_usec = 0;
+  Setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (char *)&tval, sizeof(tval));
+
+  for (k = 0; k < nfiles; k++)
+  {
+    name = strrchr(files[k], '/') != NULL ? strrchr(files[k], '/') + 1 : files[k];
+
+    if ((fd = open(files[k], O_RDONLY)) < 0 || fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode) || sb.st_size > UINT32_MAX)
+      err_quit("(%s) error - %s is not a file that can be sent", prog_name, files[k]);
+
+    printf("\nfile {%s} sent as {%s}, waiting for response.\n", files[k], name);
+
+    if ((r = sendput(s, name, fd, buf, sb.st_size, sb.st_mtime)) == GETFILE_OK)
+      r = recvhdr(s, buf, &dimension, &timestamp);
+    Close(fd);
+
+    if (r != GETFILE_OK)
+    {
+      err_msg("(%s) %s error - closing", prog_name, r == GETFILE_ERR ? "server" : "connection");
+      Close(s);
+      return -1;
+    }
+
+    printf("{%s} stored\n|- bytes: %lu\n|- timestamp: %lu\n", name, (unsigned long)dimension, (unsigned long)timestamp);
+  }
+
+  Writen(s, "QUIT\r\n", 6);
+  Close(s);
+
+  return 0;
+}
+
+/*********************************************************************
+ * STATS: the reply is sent like a file, its content goes to stdout as
+ * it arrives. 0 if complete, -1 otherwise.
+ *********************************************************************/
+int stats_mode(const char *host, const char *port)
+{
+  char buf[MAXBUFLEN];
+  uint32_t dimension, timestamp;
+  struct timeval tval;
+  int s, r;
+
+  Signal(SIGPIPE, SIG_IGN);
+
+  s = tcp_connect((char *)host, (char *)port);
+
+  tval.tv_sec = 6;
+  tval.tv_usec = 0;
+  Setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (char *)&tval, sizeof(tval));
+
+  if (writen(s, "STATS\r\n", 7) != 7)
+    err_sys("(%s) error - writen() failed", prog_name);
+
+  if ((r = recvget(s, STDOUT_FILENO, buf, &dimension, &timestamp)) != GETFILE_OK)
+  {
+    err_msg("(%s) error - %s", prog_name, r == GETFILE_ERR ? "statistics not available" : "connection broken");
+    close(s);
+    return -1;
+  }
+
+  writen(s, "QUIT\r\n", 6);
+  close(s);
+  return 0;
+}
+
+/*************************************************************************
+ * fetch the files with protocol 2 on a single connection; an error frame
+ * does not end it, so every file is requested. Returns 1 (nothing done)
+ * if the server speaks protocol 1 only, -1 if some file was not fetched.
+ *************************************************************************/
+int get2_mode(const char *host, const char *port, int urgency, int nfiles, char **files)
+{
+  char buf[MAXBUFLEN];
+  uint64_t dimension;
+  uint32_t timestamp, id, caps;
+  struct timeval tval;
+  int s, k, r, failures = 0;
+
+  Signal(SIGPIPE, SIG_IGN);
+
+  s = tcp_connect((char *)host, (char *)port);
+
+  tval.tv_sec = 6;
+  tval.tv_usec = 0;
+  Setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (char *)&tval, sizeof(tval));
+
+  if ((r = hello2(s, &caps)) == GETFILE_ERR)
+  {
+    printf("protocol 2 not supported by the server, using protocol 1\n");
+    Close(s);
+    return 1;
+  }
+  else if (r != GETFILE_OK)
+    err_quit("(%s) server error - invalid HELLO response", prog_name);
+
+  printf("\nprotocol 2 negotiated%s.\n===========================================================\n",
+         caps & V2_CAP_MUX ? ", multiplexed" : "");
+
+  if (caps & V2_CAP_MUX)
+    return get2_mux(s, urgency, nfiles, files);
+
+  for (k = 0; k < nfiles; k++)
+  {
+    printf("\nfile {%s} requested, waiting for response.\n", files[k]);
+
+    if ((r = sendget2(s, k, 0, files[k])) == GETFILE_OK)
+      r = recvhdr2(s, &id, &dimension, &timestamp);
+
+    if (r == GETFILE_OK && id == (uint32_t)k && dimension <= UINT32_MAX)
+      Recvfile(s, files[k], dimension, buf, timestamp);
+    else if (r == GETFILE_ERR && id == (uint32_t)k)
+    {
+      err_msg("(%s) server error - file {%s} %s", prog_name, files[k], dimension == V2_ENOENT ? "not found" : "refused");
+      failures++;
+    }
+    else
+    {
+      err_msg("(%s) server error - invalid response", prog_name);
+      printf("\n===========================================================\n");
+      Close(s);
+      printf("closed.\n");
+      return -1;
+    }
+  }
+
+  sendquit2(s);
+
+  printf("\n===========================================================\n");
+  Close(s);
+  printf("closed.\n");
+
+  return failures != 0 ? -1 : 0;
+}
+
+/* a file being received by get2_mux() */
+struct incoming
+{
+  int fd;         /* -1 until its FILE frame comes */
+  uint64_t dim;
+  uint64_t left;  /* bytes still to come in DATA frames */
+  uint32_t timestamp;
+};
+
+/* the last DATA frame (or an empty FILE) of a file arrived */
+static void incoming_done(struct incoming *in, const char *filename)
+{
+  const char *name = strrchr(filename, '/') != NULL ? strrchr(filename, '/') + 1 : filename;
+
+  Close(in->fd);
+  in->fd = -1;
+  printf("{%s} received\n|- bytes: %lu\n|- timestamp: %lu\n", name, (unsigned long)in->dim,
+         (unsigned long)in->timestamp);
+  fflush(stdout);
+}
+
+/****************************************************************************
+ * protocol 2 multiplexed: up to V2_MAX_STREAMS GETs in flight, the id of a
+ * frame tells which file its chunk belongs to. Returns -1 if some file was
+ * not fetched; a broken connection removes the incomplete files.
+ ****************************************************************************/
+int get2_mux(int s, int urgency, int nfiles, char **files)
+{
+  struct incoming *in;
+  unsigned char hdr[V2_HDRLEN];
+  char buf[MAXBUFLEN];
+  const char *name;
+  struct v2_frame f;
+  uint64_t info[2];
+  uint32_t code;
+  ssize_t n;
+  int next = 0, done = 0, inflight = 0, failures = 0, k;
+
+  if ((in = calloc(nfiles, sizeof(*in))) == NULL)
+    err_quit("(%s) error - out of memory", prog_name);
+  for (k = 0; k < nfiles; k++)
+    in[k].fd = -1;
+
+  while (done < nfiles)
+  {
+    /* keep the window full */
+    for (; next < nfiles && inflight < V2_MAX_STREAMS; next++, inflight++)
+    {
+      if (sendget2(s, next, (urgency << 4) & V2_URGENCY_MASK, files[next]) != GETFILE_OK)
+        goto broken;
+      printf("\nfile {%s} requested.\n", files[next]);
+    }
+
+    if (readn(s, hdr, V2_HDRLEN) != V2_HDRLEN || v2_unpack(hdr, &f) < 0 || f.id >= (uint32_t)next)
+      goto broken;
+    k = f.id;
+
+    if (f.opcode == V2_ERROR && f.length == 4)
+    {
+      if (readn(s, &code, 4) != 4)
+        goto broken;
+      err_msg("(%s) server error - file {%s} %s", prog_name, files[k], ntohl(code) == V2_ENOENT ? "not found" : "refused");
+      failures++;
+      done++;
+      inflight--;
+    }
+    else if (f.opcode == V2_FILE && f.length == 16 && in[k].fd < 0)
+    {
+      if (readn(s, info, 16) != 16)
+        goto broken;
+      name = strrchr(files[k], '/') != NULL ? strrchr(files[k], '/') + 1 : files[k];
+      if ((in[k].fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+        err_sys("(%s) error - open() failed", prog_name);
+      in[k].timestamp = be64toh(info[0]);
+      in[k].dim = in[k].left = be64toh(info[1]);
+      if (in[k].left == 0)
+      {
+        incoming_done(&in[k], files[k]);
+        done++;
+        inflight--;
+      }
+    }
+    else if (f.opcode == V2_DATA && in[k].fd >= 0 && f.length <= in[k].left)
+    {
+      for (in[k].left -= f.length; f.length > 0; f.length -= n)
+      {
+        if ((n = readn(s, buf, f.length < MAXBUFLEN ? f.length : MAXBUFLEN)) <= 0)
+          goto broken;
+        Writen(in[k].fd, buf, n);
+      }
+      if (in[k].left == 0)
+      {
+        incoming_done(&in[k], files[k]);
+        done++;
+        inflight--;
+      }
+    }
+    else
+      goto broken;
+  }
+
+  sendquit2(s);
+  free(in);
+
+  printf("\n===========================================================\n");
+  Close(s);
+  printf("closed.\n");
+
+  return failures != 0 ? -1 : 0;
+
+broken:
+  err_msg("(%s) server error - invalid response or connection broken", prog_name);
+  for (k = 0; k < nfiles; k++)
+    if (in[k].fd >= 0)
+    {
+      close(in[k].fd);
+      name = strrchr(files[k], '/') != NULL ? strrchr(files[k], '/') + 1 : files[k];
+      remove(name); /* incomplete */
+    }
+  free(in);
+  printf("\n===========================================================\n");
+  Close(s);
+  printf("closed.\n");
+
+  return -1;
 }
@@ -0,0 +1,302 @@
+/*********************************************************************************************************************
+  *                                                   CLIENT AGENT
+  *
+  * Long-lived client that fetches files on behalf of local programs (client1 -a, or agent_fetch() in agent.c), so
+  * that they do not pay name resolution, connect and handshake for every file. A job is sent on the Unix socket of
+  * the agent as:
+  *
+  * |F|E|T|C|H| |host| |port| |...filename...|CR|LF|
+  *
+  * with the destination file descriptor attached (SCM_RIGHTS): the agent writes into it with the same permissions
+  * of the program that opened it. The reply is the "+OK" message of the server (dimension and timestamp in network
+  * byte order) once the file is stored, or "-ERR\r\n".
+  *
+  * Connections to the servers are kept in a pool after every successful GET and reused by the next job for the same
+  * host and port, so a warm job costs one round trip. Pooled connections are closed (QUIT) after POOL_IDLE seconds,
+  * before the server drops them, and never handed out after that; a pooled connection found broken is replaced by a
+  * fresh one transparently.
+  *
+  *
+  * [ author: Luigi Ferrettino (S254300) ]
+  *********************************************************************************************************************/
+
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+
+#include "../errlib.h"
+#include "../sockwrap.h"
+#include "../recvfile.h"
+#include "../agent.h"
+
+#define POOL_MAX 64  /* pooled connections, all the servers together */
+#define POOL_IDLE 40 /* seconds a connection stays pooled; plus POOL_REAP, less than IDLE_TIMEOUT of the servers (55) */
+#define POOL_REAP 10 /* seconds between two rounds of the reaper */
+
+/* GLOBAL VARIABLES */
+char *prog_name;
+
+/* an idle connection to host:port */
+struct pooled
+{
+  char host[NI_MAXHOST];
+  char port[NI_MAXSERV];
+  int fd;
+  time_t since; /* idle since */
+};
+
+static struct pooled pool[POOL_MAX];
+static int npool = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* PROTOTYPES */
+void *agent_serve(void *arg);
+void *pool_reaper(void *arg);
+int pool_get(const char *host, const char *port, int *reused);
+void pool_put(const char *host, const char *port, int fd);
+void quit_close(int fd);
+
+int main(int argc, char *argv[])
+{
+  int listenfd, s;
+  pthread_t tid;
+
+  /* store the program name from argv */
+  prog_name = argv[0];
+
+  if (argc != 2)
+    err_quit("Usage: %s <agent socket>", prog_name);
+
+  /* a leftover path is from an agent that is not running anymore */
+  if ((s = unix_connect(argv[1])) >= 0)
+    err_quit("(%s) error - an agent is already running on %s", prog_name, argv[1]);
+  unlink(argv[1]);
+  listenfd = Unix_listen(argv[1]);
+
+  /***********************************************************************
+   * ignore the SIGPIPE and handle errors of broken pipes directly in the
+   * code: a server going away must not kill the agent.
+   ***********************************************************************/
+  Signal(SIGPIPE, SIG_IGN);
+
+  if (pthread_create(&tid, NULL, pool_reaper, NULL) != 0)
+    err_quit("(%s) error - pthread_create() failed", prog_name);
+  pthread_detach(tid);
+
+  printf("ready on %s\n", argv[1]);
+  fflush(stdout);
+
+  /* one thread for every local connection, the pool is shared */
+  for (;;)
+  {
+    s = Accept(listenfd, NULL, NULL);
+
+    if (pthread_create(&tid, NULL, agent_serve, (void *)(intptr_t)s) != 0)
+    {
+      err_msg("(%s) error - pthread_create() failed", prog_name);
+      Close(s);
+      continue;
+    }
+    pthread_detach(tid);
+  }
+
+  exit(0);
+}
+
+/* serve the jobs of a local connection, one after the other */
+void *agent_serve(void *arg)
+{
+  int fd = (int)(intptr_t)arg;
+  char line[AGENT_LINELEN], buf[MAXBUFLEN];
+  char *host, *port, *filename, *save;
+  int outfd, s, r, reused, attempt;
+  uint32_t dim, timestamp;
+  ssize_t n;
+
+  /* the destination descriptor travels with the first byte of the job */
+  while (read_fd(fd, line, 1, &outfd) == 1)
+  {
+    if ((n = readline_unbuffered(fd, line + 1, sizeof(line) - 1)) <= 0)
+    {
+      if (outfd >= 0)
+        close(outfd);
+      break;
+    }
+    n++;
+
+    /* |F|E|T|C|H| |host| |port| |filename|CR|LF| */
+    r = GETFILE_ERR;
+    if (outfd >= 0 && n > 8 && strncmp(line, "FETCH ", 6) == 0 && line[n - 2] == '\r' && line[n - 1] == '\n')
+    {
+      line[n - 2] = '\0';
+      host = strtok_r(line + 6, " ", &save);
+      port = strtok_r(NULL, " ", &save);
+      filename = strtok_r(NULL, "", &save);
+
+      /* a pooled connection can be found dead only when used: then retry once on a fresh one */
+      for (attempt = 0; host != NULL && port != NULL && filename != NULL && attempt < 2; attempt++)
+      {
+        if ((s = pool_get(host, port, &reused)) < 0)
+        {
+          err_ret("(%s) error - connect to %s %s failed", prog_name, host, port);
+          break;
+        }
+
+        ftruncate(outfd, 0);
+        lseek(outfd, 0, SEEK_SET);
+
+        if ((r = getfile(s, filename, outfd, buf, &dim, &timestamp)) == GETFILE_OK)
+        {
+          pool_put(host, port, s);
+          break;
+        }
+
+        close(s);
+        if (r == GETFILE_ERR || !reused)
+          break;
+      }
+
+      printf("%s %s {%s} %s\n", host != NULL ? host : "-", port != NULL ? port : "-",
+             filename != NULL ? filename : "-", r == GETFILE_OK ? "fetched" : "failed");
+      fflush(stdout);
+    }
+
+    if (outfd >= 0)
+      close(outfd);
+
+    if (r == GETFILE_OK)
+    {
+      dim = htonl(dim);
+      timestamp = htonl(timestamp);
+      memcpy(buf, "+OK\r\n", 5);
+      memcpy(buf + 5, &dim, 4);
+      memcpy(buf + 9, &timestamp, 4);
+      n = 13;
+    }
+    else
+    {
+      memcpy(buf, "-ERR\r\n", 6);
+      n = 6;
+    }
+
+    if (writen(fd, buf, n) != n)
+      break;
+  }
+
+  close(fd);
+  return NULL;
+}
+
+/* take a warm connection to host:port from the pool, or open a new one */
+int pool_get(const char *host, const char *port, int *reused)
+{
+  struct pollfd pfd;
+  struct timeval tval;
+  int i, fd, old;
+
+  for (;;)
+  {
+    fd = -1;
+    old = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    /* the most recently used is the warmest one */
+    for (i = npool - 1; i >= 0; i--)
+    {
+      if (strcmp(pool[i].host, host) == 0 && strcmp(pool[i].port, port) == 0)
+      {
+        fd = pool[i].fd;
+        old = time(NULL) - pool[i].since >= POOL_IDLE;
+        pool[i] = pool[--npool];
+        break;
+      }
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (fd < 0)
+      break;
+
+    /* not yet reaped, but the server may be closing it right now */
+    if (old)
+    {
+      quit_close(fd);
+      continue;
+    }
+
+    /* an idle connection must have nothing to read: otherwise it is closed (EOF) or out of sync */
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 0) == 0)
+    {
+      *reused = 1;
+      return fd;
+    }
+    close(fd);
+  }
+
+  *reused = 0;
+  if ((fd = tcp_connect_race(host, port, NULL)) < 0)
+    return -1;
+
+  /* do not wait forever for a server that stopped answering (same timeout of client1) */
+  tval.tv_sec = 6;
+  tval.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tval, sizeof(tval));
+
+  return fd;
+}
+
+/* give a connection back to the pool, or close it if the pool is full */
+void pool_put(const char *host, const char *port, int fd)
+{
+  pthread_mutex_lock(&pool_lock);
+  if (npool < POOL_MAX)
+  {
+    snprintf(pool[npool].host, sizeof(pool[npool].host), "%s", host);
+    snprintf(pool[npool].port, sizeof(pool[npool].port), "%s", port);
+    pool[npool].fd = fd;
+    pool[npool].since = time(NULL);
+    npool++;
+    fd = -1;
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  if (fd >= 0)
+    quit_close(fd);
+}
+
+/* close the pooled connections that have been idle for too long */
+void *pool_reaper(void *arg)
+{
+  int i, n, expired[POOL_MAX];
+
+  for (;;)
+  {
+    sleep(POOL_REAP);
+
+    n = 0;
+    pthread_mutex_lock(&pool_lock);
+    for (i = 0; i < npool; i++)
+    {
+      if (time(NULL) - pool[i].since >= POOL_IDLE)
+      {
+        expired[n++] = pool[i].fd;
+        pool[i--] = pool[--npool];
+      }
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    for (i = 0; i < n; i++)
+      quit_close(expired[i]);
+  }
+
+  return NULL;
+}
+
+/* say goodbye to the server, as client1 does */
+void quit_close(int fd)
+{
+  writen(fd, "QUIT\r\n", 6);
+  close(fd);
+}
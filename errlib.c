@@ -18,6 +18,7 @@ reference: Stevens, Unix network programming (3ed)
 #define MAXLINE 4095
 
 int daemon_proc = 0; /* set to 0 if stdout/stderr available, else set to 1 */
+void (*err_hook)(const char *line) = NULL; /* if set, takes the messages instead (see log.c) */
 
 /* Print message and return to caller
  * Caller specifies "errnoflag" and "level" */
@@ -34,7 +35,11 @@ static void err_doit(int errnoflag, int level, const char *fmt, va_list ap)
 		snprintf(buf + n, MAXLINE - n, ": %s", strerror(errno_save));
 	strcat(buf, "\n");
 
-	if (daemon_proc)
+	if (err_hook != NULL)
+	{
+		err_hook(buf);
+	}
+	else if (daemon_proc)
 	{
 		syslog(level, "%s", buf);
 	}
@@ -16,6 +16,8 @@ reference: Stevens, Unix network programming (3ed)
 
 extern int daemon_proc;
 
+extern void (*err_hook)(const char *line);
+
 void err_msg (const char *fmt, ...);
 
 void err_quit (const char *fmt, ...);
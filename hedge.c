@@ -0,0 +1,237 @@
+/*
+
+module: hedge.c
+
+purpose: hedged requests across replicated servers
+
+author: Luigi Ferrettino (S254300)
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include "errlib.h"
+#include "sockwrap.h"
+#include "recvfile.h"
+#include "hedge.h"
+
+extern char *prog_name;
+
+/* monotonic clock in milliseconds */
+static long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* "host:port,[v6 address]:port,..." into an array of replicas, returns how many */
+int parse_replicas(char *list, struct replica **replicas)
+{
+    struct replica *r = NULL;
+    char *item, *save, *colon, *host;
+    int n = 0;
+
+    for (item = strtok_r(list, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save))
+    {
+        if ((colon = strrchr(item, ':')) == NULL)
+            err_quit("(%s) error - replica '%s' is not <host>:<port>", prog_name, item);
+        *colon = '\0';
+
+        host = item;
+        if (host[0] == '[' && colon[-1] == ']')
+        {
+            host++;
+            colon[-1] = '\0';
+        }
+
+        if ((r = realloc(r, (n + 1) * sizeof(*r))) == NULL)
+            err_quit("(%s) error - out of memory", prog_name);
+        snprintf(r[n].host, sizeof(r[n].host), "%s", host);
+        snprintf(r[n].port, sizeof(r[n].port), "%s", colon + 1);
+        r[n].fd = -1;
+        r[n].retry_at = 0;
+        n++;
+    }
+
+    *replicas = r;
+    return n;
+}
+
+static int replica_connect(struct replica *r)
+{
+    struct timeval tval;
+
+    if (r->fd >= 0)
+        return r->fd;
+
+    if ((r->fd = tcp_connect_race(r->host, r->port, NULL)) < 0)
+    {
+        err_ret("(%s) error - replica %s:%s not available", prog_name, r->host, r->port);
+        r->retry_at = time(NULL) + HEDGE_BACKOFF;
+        return -1;
+    }
+
+    /* same timeout of the single server mode */
+    tval.tv_sec = 6;
+    tval.tv_usec = 0;
+    setsockopt(r->fd, SOL_SOCKET, SO_RCVTIMEO, &tval, sizeof(tval));
+
+    return r->fd;
+}
+
+/* the protocol cannot abort a transfer or survive an error: the connection is closed */
+static void replica_drop(struct replica *r)
+{
+    if (r->fd >= 0)
+        close(r->fd);
+    r->fd = -1;
+}
+
+/*********************************************************************************
+ * send the request to the first replica, starting from "from" and skipping "skip",
+ * that takes it; -1 if none. Connecting is synchronous, so the unreachable replicas
+ * are skipped until their backoff expires; the primary request (skip < 0) tries
+ * them anyway when they are all backing off.
+ *********************************************************************************/
+static int replica_request(struct replica *r, int nrep, int from, int skip, const char *filename, char *buf)
+{
+    time_t now = time(NULL);
+    int i, k, tried = 0, pass;
+
+    for (pass = 0; pass < 2 && tried == 0; pass++)
+    {
+        for (i = 0; i < nrep; i++)
+        {
+            k = (from + i) % nrep;
+            if (k == skip || (pass == 0 && r[k].fd < 0 && r[k].retry_at > now) || (pass == 1 && skip >= 0))
+                continue;
+            tried++;
+            if (replica_connect(&r[k]) >= 0 && sendget(r[k].fd, filename, buf) == GETFILE_OK)
+            {
+                r[k].retry_at = 0;
+                return k;
+            }
+            replica_drop(&r[k]);
+        }
+    }
+
+    return -1;
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+/* current hedge delay: the configured percentile of the recent response times */
+int hedge_delay(const struct hedge_stats *st)
+{
+    int sorted[HEDGE_SAMPLES], d;
+
+    if (st->nsamples < HEDGE_MIN_SAMPLES)
+        return HEDGE_DELAY;
+
+    memcpy(sorted, st->samples, st->nsamples * sizeof(int));
+    qsort(sorted, st->nsamples, sizeof(int), cmp_int);
+    d = sorted[(st->nsamples - 1) * st->percentile / 100];
+
+    return d > HEDGE_MIN_DELAY ? d : HEDGE_MIN_DELAY;
+}
+
+static void add_sample(struct hedge_stats *st, long ms)
+{
+    st->samples[st->next] = (int)ms;
+    st->next = (st->next + 1) % HEDGE_SAMPLES;
+    if (st->nsamples < HEDGE_SAMPLES)
+        st->nsamples++;
+}
+
+/*******************************************************************************
+ * request "filename" to the replica "primary" (or the next available one); if
+ * the answer does not start within hedge_delay(), the same request goes to the
+ * next replica too, and the first "+OK" wins: its content is stored in outfd,
+ * the other connection is closed to cancel the duplicate transfer.
+ * Returns a GETFILE_* code, the replica that answered goes in *winner.
+ *******************************************************************************/
+int hedge_fetch(struct replica *r, int nrep, int primary, const char *filename, int outfd, char *buf,
+                uint32_t *dim, uint32_t *timestamp, struct hedge_stats *st, int *winner)
+{
+    struct pollfd pfd[2];
+    long sent;
+    int who[2], n, i, k, npfd, res = GETFILE_BROKEN, sampled = 0, hedge = -1;
+
+    st->requests++;
+
+    if ((who[0] = replica_request(r, nrep, primary, -1, filename, buf)) < 0)
+    {
+        st->failures++;
+        return GETFILE_BROKEN;
+    }
+    sent = now_ms();
+    pfd[0].fd = r[who[0]].fd;
+    pfd[0].events = POLLIN;
+    npfd = 1;
+
+    /* too slow: duplicate the request on another replica */
+    if ((n = poll(pfd, 1, hedge_delay(st))) == 0 && nrep > 1 &&
+        (who[1] = replica_request(r, nrep, who[0] + 1, who[0], filename, buf)) >= 0)
+    {
+        st->hedged++;
+        hedge = who[1]; /* its slot becomes 0 if the primary fails first */
+        pfd[1].fd = r[who[1]].fd;
+        pfd[1].events = POLLIN;
+        npfd = 2;
+    }
+
+    while (npfd > 0)
+    {
+        if ((n = poll(pfd, npfd, 6000)) < 0 && INTERRUPTED_BY_SIGNAL)
+            continue;
+        if (n <= 0)
+            break; /* nobody answers */
+
+        for (i = 0; i < npfd && pfd[i].revents == 0; i++)
+            ;
+        k = who[i];
+
+        /* timed from the first request: a hedge answering first says the primary took at least as long */
+        if (!sampled)
+        {
+            add_sample(st, now_ms() - sent);
+            sampled = 1;
+        }
+
+        ftruncate(outfd, 0);
+        lseek(outfd, 0, SEEK_SET);
+        if ((res = recvget(r[k].fd, outfd, buf, dim, timestamp)) == GETFILE_OK)
+        {
+            if (k == hedge)
+                st->hedge_wins++;
+            if (npfd == 2)
+                replica_drop(&r[who[1 - i]]);
+            *winner = k;
+            return GETFILE_OK;
+        }
+
+        /* this one failed, maybe the other one (if any) has the file */
+        replica_drop(&r[k]);
+        if (i == 0 && npfd == 2)
+        {
+            pfd[0] = pfd[1];
+            who[0] = who[1];
+        }
+        npfd--;
+    }
+
+    for (i = 0; i < npfd; i++)
+        replica_drop(&r[who[i]]);
+
+    st->failures++;
+    return res;
+}
@@ -0,0 +1,54 @@
+/*
+
+ module: hedge.h
+
+ purpose: definitions of functions in hedge.c
+
+ reference: Dean & Barroso, The Tail at Scale (2013)
+
+ */
+
+#ifndef _HEDGE_H
+
+#define _HEDGE_H
+
+#include <netdb.h>
+#include <stdint.h>
+#include <time.h>
+
+#define HEDGE_PERCENTILE 95 /* default percentile of the response time used as hedge delay */
+#define HEDGE_SAMPLES 128   /* response times remembered */
+#define HEDGE_MIN_SAMPLES 8 /* below this, HEDGE_DELAY is used */
+#define HEDGE_DELAY 50      /* ms, initial hedge delay */
+#define HEDGE_MIN_DELAY 2   /* ms, the delay is never lower than this */
+#define HEDGE_BACKOFF 10    /* s, a replica that cannot be reached is not tried again before this */
+
+/* an instance of the server */
+struct replica
+{
+    char host[NI_MAXHOST];
+    char port[NI_MAXSERV];
+    int fd;          /* connection, -1 if not connected */
+    time_t retry_at; /* unreachable until then */
+};
+
+struct hedge_stats
+{
+    long requests;     /* files requested */
+    long hedged;       /* requests duplicated on a second replica */
+    long hedge_wins;   /* hedged requests whose file came from the second replica */
+    long failures;     /* files not received */
+    int samples[HEDGE_SAMPLES]; /* recent response times (ms), from the first request to the first answer */
+    int nsamples;
+    int next;
+    int percentile;
+};
+
+int parse_replicas(char *list, struct replica **replicas);
+
+int hedge_delay(const struct hedge_stats *st);
+
+int hedge_fetch(struct replica *r, int nrep, int primary, const char *filename, int outfd, char *buf,
+                uint32_t *dim, uint32_t *timestamp, struct hedge_stats *st, int *winner);
+
+#endif
@@ -0,0 +1,269 @@
+/*
+
+module: hist.c
+
+purpose: per-phase latency histograms of serve(), shared by the forked workers
+
+author: Luigi Ferrettino (S254300)
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "errlib.h"
+#include "hist.h"
+
+extern char *prog_name;
+
+const char *hist_phase_name[HIST_PHASES] = {"parse", "lookup", "open", "header", "send", "total"};
+
+#ifndef NO_HIST
+
+static struct hist_shm *hist = NULL; /* NULL: not timing */
+static int hist_slot = 0;            /* of this worker */
+static pid_t hist_owner = -1;        /* the process that dumps on a signal */
+
+/* bucket of a value, see hist.h */
+static unsigned bucket(uint64_t v)
+{
+    unsigned e;
+
+    if (v < HIST_SUB)
+        return v;
+    if (v >> HIST_MAX_BITS)
+        return HIST_BUCKETS - 1;
+
+    e = 63 - __builtin_clzll(v);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB + (v >> (e - HIST_SUB_BITS)) - HIST_SUB;
+}
+
+/* highest value of a bucket */
+static uint64_t bucket_top(unsigned b)
+{
+    unsigned shift;
+
+    if (b < HIST_SUB)
+        return b;
+    shift = b / HIST_SUB - 1;
+    return (((uint64_t)(b % HIST_SUB + HIST_SUB + 1)) << shift) - 1;
+}
+
+/* the histograms, shared with the processes forked from now on; -1 on error */
+int hist_init(void)
+{
+    void *map;
+
+    if ((map = mmap(NULL, sizeof(struct hist_shm), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) ==
+        MAP_FAILED)
+        return -1;
+
+    hist = map;
+    hist_owner = getpid();
+    return 0;
+}
+
+void Hist_init(void)
+{
+    if (hist_init() < 0)
+        err_sys("(%s) error - cannot map the timing histograms", prog_name);
+}
+
+/* the worker "pid" records in its own slot (two workers may share one: the counters are atomic) */
+void hist_bind(int pid)
+{
+    hist_slot = pid % HIST_SLOTS;
+}
+
+/* lock-free: relaxed atomic adds, nobody waits for anybody */
+void hist_record(int phase, uint64_t ns)
+{
+    if (hist == NULL)
+        return;
+
+    __atomic_fetch_add(&hist->count[hist_slot][phase][bucket(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum[hist_slot][phase], ns, __ATOMIC_RELAXED);
+}
+
+/* "v" nanoseconds as microseconds with one decimal, at *p; returns the end */
+static char *put_us(char *p, uint64_t v)
+{
+    char digits[24];
+    int n = 0;
+
+    v /= 100;
+    do
+    {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v > 0 || n < 2);
+
+    while (n > 1)
+        *p++ = digits[--n];
+    *p++ = '.';
+    *p++ = digits[0];
+    return p;
+}
+
+static char *put_str(char *p, const char *s)
+{
+    size_t len = strlen(s);
+
+    memcpy(p, s, len);
+    return p + len;
+}
+
+static char *put_u64(char *p, uint64_t v)
+{
+    char digits[24];
+    int n = 0;
+
+    do
+    {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v > 0);
+
+    while (n > 0)
+        *p++ = digits[--n];
+    return p;
+}
+
+/*****************************************************************************
+ * aggregate "phase" across the slots: samples, sum, percentiles 50, 99 and
+ * 99.9, maximum (upper bounds of their buckets); -1 if not timing. No locks
+ * and no allocations, so it can be called by a signal handler too.
+ *****************************************************************************/
+int hist_summary(int phase, struct hist_summary *hs)
+{
+    static const int permille[3] = {500, 990, 999};
+    uint64_t agg[HIST_BUCKETS], seen, rank, q[3];
+    int s, b, k, top = 0;
+
+    if (hist == NULL)
+        return -1;
+
+    hs->count = hs->sum = 0;
+    for (b = 0; b < HIST_BUCKETS; b++)
+    {
+        agg[b] = 0;
+        for (s = 0; s < HIST_SLOTS; s++)
+            agg[b] += __atomic_load_n(&hist->count[s][phase][b], __ATOMIC_RELAXED);
+        hs->count += agg[b];
+        if (agg[b] > 0)
+            top = b;
+    }
+    for (s = 0; s < HIST_SLOTS; s++)
+        hs->sum += __atomic_load_n(&hist->sum[s][phase], __ATOMIC_RELAXED);
+
+    for (k = 0; k < 3; k++)
+    {
+        q[k] = 0;
+        if (hs->count == 0)
+            continue;
+        rank = (hs->count - 1) * permille[k] / 1000;
+        for (seen = 0, b = 0; seen + agg[b] <= rank; b++)
+            seen += agg[b];
+        q[k] = bucket_top(b);
+    }
+    hs->p50 = q[0];
+    hs->p99 = q[1];
+    hs->p999 = q[2];
+    hs->max = hs->count > 0 ? bucket_top(top) : 0;
+
+    return 0;
+}
+
+/*****************************************************************************
+ * one line per phase, all the workers together: samples, mean, percentiles 50,
+ * 99 and 99.9, maximum. Only write(), so it can be called by a signal handler
+ * while the process is anywhere else.
+ *****************************************************************************/
+void hist_dump(int fd)
+{
+    struct hist_summary hs;
+    char line[256], *p;
+    int phase;
+
+    for (phase = 0; phase < HIST_PHASES; phase++)
+    {
+        if (hist_summary(phase, &hs) < 0)
+            return;
+
+        p = put_str(line, "PARENT\ttiming ");
+        p = put_str(p, hist_phase_name[phase]);
+        p = put_str(p, ": ");
+        p = put_u64(p, hs.count);
+        p = put_str(p, " samples");
+        if (hs.count > 0)
+        {
+            p = put_str(p, ", mean ");
+            p = put_us(p, hs.sum / hs.count);
+            p = put_str(p, " us, p50 ");
+            p = put_us(p, hs.p50);
+            p = put_str(p, " us, p99 ");
+            p = put_us(p, hs.p99);
+            p = put_str(p, " us, p999 ");
+            p = put_us(p, hs.p999);
+            p = put_str(p, " us, max ");
+            p = put_us(p, hs.max);
+            p = put_str(p, " us");
+        }
+        *p++ = '\n';
+
+        if (write(fd, line, p - line) < 0)
+            return;
+    }
+}
+
+/* handler of the dump signal: only the process that mapped the histograms answers */
+void hist_sig(int signo)
+{
+    int saved = errno;
+
+    if (getpid() == hist_owner)
+        hist_dump(STDOUT_FILENO);
+    errno = saved;
+}
+
+#else
+
+int hist_init(void)
+{
+    return 0;
+}
+
+void Hist_init(void)
+{
+}
+
+void hist_bind(int pid)
+{
+}
+
+void hist_record(int phase, uint64_t ns)
+{
+}
+
+int hist_summary(int phase, struct hist_summary *hs)
+{
+    return -1;
+}
+
+void hist_dump(int fd)
+{
+    static const char msg[] = "PARENT\ttiming compiled out (NO_HIST)\n";
+
+    if (write(fd, msg, sizeof(msg) - 1) < 0)
+        return;
+}
+
+void hist_sig(int signo)
+{
+    hist_dump(STDOUT_FILENO);
+}
+
+#endif
@@ -0,0 +1,92 @@
+/*
+
+ module: hist.h
+
+ purpose: definitions of functions in hist.c
+
+ reference: Gil Tene, HdrHistogram (log-linear buckets)
+
+ */
+
+#ifndef _HIST_H
+
+#define _HIST_H
+
+#include <stdint.h>
+#include <time.h>
+
+/***************************************************************************
+ * phases of a GET timed by serve(), from the first byte of the command to
+ * the last byte of the content (HIST_TOTAL covers them all)
+ ***************************************************************************/
+#define HIST_PARSE 0  /* the rest of the command line, up to CR LF */
+#define HIST_LOOKUP 1 /* name checks, packed archive and metadata index */
+#define HIST_OPEN 2   /* openat2() and fstat() */
+#define HIST_HEADER 3 /* "+OK", dimension and timestamp */
+#define HIST_SEND 4   /* the content */
+#define HIST_TOTAL 5
+#define HIST_PHASES 6
+
+extern const char *hist_phase_name[HIST_PHASES];
+
+/*****************************************************************************
+ * nanoseconds: below HIST_SUB a bucket per value, then every power of 2 is
+ * split in HIST_SUB buckets (relative error under 1/HIST_SUB); values from
+ * 2^HIST_MAX_BITS ns (~18 minutes) on all go in the last bucket. Every worker
+ * records in the slot of its pid, aggregated by hist_dump().
+ *****************************************************************************/
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+#define HIST_SLOTS 16
+
+/* in shared memory, inherited by the forked workers */
+struct hist_shm
+{
+    uint64_t count[HIST_SLOTS][HIST_PHASES][HIST_BUCKETS];
+    uint64_t sum[HIST_SLOTS][HIST_PHASES];
+};
+
+/**********************************************************************
+ * the timing of serve() compiles to nothing with -DNO_HIST: HIST_CLOCK
+ * takes the time in "t", HIST_RECORD adds the time since "t" to "phase"
+ **********************************************************************/
+#ifndef NO_HIST
+#define HIST_CLOCK(t) ((t) = hist_now())
+#define HIST_RECORD(phase, t) hist_record((phase), hist_now() - (t))
+#else
+#define HIST_CLOCK(t) ((void)(t))
+#define HIST_RECORD(phase, t) ((void)(t))
+#endif
+
+static inline uint64_t hist_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* one phase of all the workers together (nanoseconds, upper bounds of the buckets) */
+struct hist_summary
+{
+    uint64_t count, sum;
+    uint64_t p50, p99, p999, max;
+};
+
+int hist_init(void);
+
+void Hist_init(void);
+
+void hist_bind(int pid);
+
+void hist_record(int phase, uint64_t ns);
+
+int hist_summary(int phase, struct hist_summary *hs);
+
+void hist_dump(int fd);
+
+void hist_sig(int signo);
+
+#endif
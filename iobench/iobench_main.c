@@ -0,0 +1,364 @@
+/*********************************************************************************************************************
+  *                                                   I/O MICROBENCHMARK
+  *
+  * Measures the I/O primitives that every request goes through: readn(), readline() (buffered in the static buffer
+  * of my_read()), readline_unbuffered(), writen() and sendn() of sockwrap.c, Readn_timeo() and readline_timeo() of
+  * serve.c. Each one is run on one end of a Unix socketpair and of a loopback TCP connection, while a peer process
+  * writes the messages it reads (or drains what it writes), for every message size of -s:
+  *
+  *   iobench [-t unix|tcp] [-s <size>[,<size>...]] [-b <bytes>] [<primitive>...]
+  *
+  * ns/op is the wall clock time of one call, MB/s the bytes it moves per second. syscalls/op is counted on a
+  * separate run traced with ptrace(): the system calls of k and of 2k calls, the difference divided by k, so the
+  * setup does not count. -b is the amount of data moved by the timed run of every primitive and size (fewer
+  * iterations for the bigger messages). A line ending with '\n' is a message for the readline functions.
+  *
+  *
+  * [ author: Luigi Ferrettino (S254300) ]
+  *********************************************************************************************************************/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+
+#include "../errlib.h"
+#include "../sockwrap.h"
+#include "../serve.h"
+
+#define IOBENCH_SIZES "16,128,1024,8192,65536"
+#define IOBENCH_BYTES 8388608 /* moved by the timed run of every primitive and size */
+#define MIN_ITERS 64
+#define MAX_ITERS 200000
+#define TRACE_BYTES 16384 /* moved by the (slow) traced runs */
+#define MAX_SIZE 1048576
+
+/* GLOBAL VARIABLES */
+char *prog_name;
+
+/* a primitive under test: one call moves "size" bytes */
+struct prim
+{
+  const char *name;
+  int writer; /* the peer drains, instead of writing */
+  int line;   /* the messages are lines */
+  ssize_t (*op)(int fd, char *buf, size_t size);
+};
+
+static struct conn bench_conn; /* for the functions of serve.c, no deadline armed */
+
+/* PROTOTYPES */
+void usage(void);
+void make_pair(int tcp, int sv[2]);
+pid_t start_peer(const struct prim *p, int sv[2], size_t size, long iters);
+void run_ops(const struct prim *p, int fd, char *buf, size_t size, long iters);
+double time_ops(const struct prim *p, int tcp, size_t size, long iters);
+long count_syscalls(const struct prim *p, int tcp, size_t size, long iters);
+
+static ssize_t op_readn(int fd, char *buf, size_t size)
+{
+  return readn(fd, buf, size);
+}
+
+static ssize_t op_readline(int fd, char *buf, size_t size)
+{
+  return readline(fd, buf, size + 1);
+}
+
+static ssize_t op_readline_unbuffered(int fd, char *buf, size_t size)
+{
+  return readline_unbuffered(fd, buf, size + 1);
+}
+
+static ssize_t op_readn_timeo(int fd, char *buf, size_t size)
+{
+  return Readn_timeo(&bench_conn, buf, size);
+}
+
+static ssize_t op_readline_timeo(int fd, char *buf, size_t size)
+{
+  return readline_timeo(&bench_conn, buf, size + 1);
+}
+
+static ssize_t op_writen(int fd, char *buf, size_t size)
+{
+  return writen(fd, buf, size);
+}
+
+static ssize_t op_sendn(int fd, char *buf, size_t size)
+{
+  return sendn(fd, buf, size, 0);
+}
+
+static const struct prim prims[] = {
+    {"readn", 0, 0, op_readn},
+    {"readline", 0, 1, op_readline},
+    {"readline_unbuffered", 0, 1, op_readline_unbuffered},
+    {"Readn_timeo", 0, 0, op_readn_timeo},
+    {"readline_timeo", 0, 1, op_readline_timeo},
+    {"writen", 1, 0, op_writen},
+    {"sendn", 1, 0, op_sendn},
+};
+#define NPRIMS (int)(sizeof(prims) / sizeof(prims[0]))
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+  char *sizes = IOBENCH_SIZES, *transport = NULL, *list, *tok;
+  size_t size[32];
+  long bytes = IOBENCH_BYTES, iters, k, calls1, calls2;
+  int nsizes = 0, opt, i, j, t, selected;
+  double ns;
+
+  /* store the program name from argv */
+  prog_name = argv[0];
+
+  while ((opt = getopt(argc, argv, "t:s:b:")) != -1)
+  {
+    switch (opt)
+    {
+    case 't':
+      if (strcmp(optarg, "unix") != 0 && strcmp(optarg, "tcp") != 0)
+        usage();
+      transport = optarg;
+      break;
+    case 's':
+      sizes = optarg;
+      break;
+    case 'b':
+      if ((bytes = atol(optarg)) < 1)
+        usage();
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if ((list = strdup(sizes)) == NULL)
+    err_quit("(%s) error - out of memory", prog_name);
+  for (tok = strtok(list, ","); tok != NULL && nsizes < 32; tok = strtok(NULL, ","))
+    if ((size[nsizes++] = strtoul(tok, NULL, 10)) < 2 || size[nsizes - 1] > MAX_SIZE)
+      usage();
+
+  for (i = optind; i < argc; i++)
+  {
+    for (j = 0; j < NPRIMS && strcmp(argv[i], prims[j].name) != 0; j++)
+      ;
+    if (j == NPRIMS)
+      usage();
+  }
+
+  /* the peer closing must not kill the benchmark */
+  Signal(SIGPIPE, SIG_IGN);
+
+  bench_conn.host = "iobench";
+  bench_conn.pid = getpid();
+  bench_conn.expired = NULL;
+  tw_init(&bench_conn.tw, tw_now_ms());
+
+  printf("%-20s %-9s %7s %8s %10s %9s %12s\n", "primitive", "transport", "size", "iters", "ns/op", "MB/s",
+         "syscalls/op");
+
+  for (i = 0; i < NPRIMS; i++)
+  {
+    for (selected = optind == argc, j = optind; j < argc; j++)
+      selected |= strcmp(argv[j], prims[i].name) == 0;
+    if (!selected)
+      continue;
+
+    for (t = 0; t < 2; t++)
+    {
+      if (transport != NULL && strcmp(transport, t ? "tcp" : "unix") != 0)
+        continue;
+
+      for (j = 0; j < nsizes; j++)
+      {
+        iters = bytes / size[j];
+        iters = iters < MIN_ITERS ? MIN_ITERS : iters > MAX_ITERS ? MAX_ITERS : iters;
+        ns = time_ops(&prims[i], t, size[j], iters);
+
+        /* k and 2k calls traced: the difference is the cost of k calls alone */
+        k = TRACE_BYTES / size[j] < 1 ? 1 : TRACE_BYTES / size[j] > MIN_ITERS ? MIN_ITERS : TRACE_BYTES / size[j];
+        if ((calls1 = count_syscalls(&prims[i], t, size[j], k)) >= 0 &&
+            (calls2 = count_syscalls(&prims[i], t, size[j], 2 * k)) >= 0)
+          printf("%-20s %-9s %7lu %8ld %10.0f %9.1f %12.2f\n", prims[i].name, t ? "tcp" : "unix",
+                 (unsigned long)size[j], iters, ns / iters, size[j] * iters / ns * 1e3, (double)(calls2 - calls1) / k);
+        else
+          printf("%-20s %-9s %7lu %8ld %10.0f %9.1f %12s\n", prims[i].name, t ? "tcp" : "unix", (unsigned long)size[j],
+                 iters, ns / iters, size[j] * iters / ns * 1e3, "-");
+        fflush(stdout);
+      }
+    }
+  }
+
+  exit(0);
+}
+
+void usage(void)
+{
+  int i;
+
+  fprintf(stderr, "Usage: %s [-t unix|tcp] [-s <size>[,<size>...]] [-b <bytes>] [<primitive>...]\nprimitives:",
+          prog_name);
+  for (i = 0; i < NPRIMS; i++)
+    fprintf(stderr, " %s", prims[i].name);
+  err_quit("\nsizes from 2 to %d bytes (default " IOBENCH_SIZES ")", MAX_SIZE);
+}
+
+/* two connected stream sockets: a Unix socketpair, or both ends of a loopback TCP connection */
+void make_pair(int tcp, int sv[2])
+{
+  struct sockaddr_in sa;
+  socklen_t len = sizeof(sa);
+  int listenfd;
+
+  if (!tcp)
+  {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+      err_sys("(%s) error - socketpair() failed", prog_name);
+    return;
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sa.sin_port = 0;
+
+  listenfd = Socket(AF_INET, SOCK_STREAM, 0);
+  Bind(listenfd, (SA *)&sa, sizeof(sa));
+  Listen(listenfd, 1);
+  Getsockname(listenfd, (SA *)&sa, &len);
+
+  sv[0] = Socket(AF_INET, SOCK_STREAM, 0);
+  Connect(sv[0], (SA *)&sa, sizeof(sa));
+  sv[1] = Accept(listenfd, NULL, NULL);
+  Close(listenfd);
+}
+
+/* the other end, sv[1]: "iters" messages of "size" bytes for a reader, everything drained for a writer */
+pid_t start_peer(const struct prim *p, int sv[2], size_t size, long iters)
+{
+  static char chunk[MAX_SIZE];
+  uint64_t left = (uint64_t)size * iters;
+  size_t n, i;
+  pid_t pid;
+  int fd;
+
+  if ((pid = Fork()) > 0)
+    return pid;
+  close(sv[0]); /* or a writer never sees its EOF */
+  fd = sv[1];
+
+  if (p->writer)
+  {
+    while (read(fd, chunk, sizeof(chunk)) > 0)
+      ;
+    _exit(0);
+  }
+
+  /* the messages one after the other: with lines, every "size" bytes end with '\n' */
+  memset(chunk, 'x', sizeof(chunk));
+  if (p->line)
+    for (i = size - 1; i < sizeof(chunk); i += size)
+      chunk[i] = '\n';
+  n = sizeof(chunk) / size * size;
+
+  for (; left > 0; left -= left < n ? left : n)
+    if (writen(fd, chunk, left < n ? left : n) < 0)
+      _exit(1);
+  _exit(0);
+}
+
+void run_ops(const struct prim *p, int fd, char *buf, size_t size, long iters)
+{
+  long i;
+
+  bench_conn.fd = fd;
+  for (i = 0; i < iters; i++)
+    if (p->op(fd, buf, size) != (ssize_t)size)
+      err_sys("(%s) error - %s() moved less than %lu bytes", prog_name, p->name, (unsigned long)size);
+}
+
+/* nanoseconds taken by "iters" calls */
+double time_ops(const struct prim *p, int tcp, size_t size, long iters)
+{
+  static char buf[MAX_SIZE + 1];
+  uint64_t t0, t1;
+  int sv[2];
+  pid_t peer;
+
+  make_pair(tcp, sv);
+  peer = start_peer(p, sv, size, iters);
+  Close(sv[1]);
+
+  memset(buf, 'x', sizeof(buf));
+  t0 = now_ns();
+  run_ops(p, sv[0], buf, size, iters);
+  t1 = now_ns();
+
+  Close(sv[0]);
+  waitpid(peer, NULL, 0);
+
+  return t1 - t0;
+}
+
+/*******************************************************************************
+ * system calls made by a child that sets up the connection and its peer, stops,
+ * and then makes "iters" calls; every one stops twice under PTRACE_SYSCALL
+ * (entry and exit) except exit_group(). -1 if it cannot be traced.
+ *******************************************************************************/
+long count_syscalls(const struct prim *p, int tcp, size_t size, long iters)
+{
+  static char buf[MAX_SIZE + 1];
+  int sv[2], status, sig = 0;
+  long stops = 0;
+  pid_t pid;
+
+  if ((pid = Fork()) == 0)
+  {
+    make_pair(tcp, sv);
+    start_peer(p, sv, size, iters);
+    close(sv[1]);
+
+    if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0)
+      _exit(1);
+    raise(SIGSTOP);
+
+    run_ops(p, sv[0], buf, size, iters);
+    _exit(0);
+  }
+
+  if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status) ||
+      ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *)(long)(PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL)) < 0)
+  {
+    waitpid(pid, NULL, 0);
+    return -1;
+  }
+
+  for (;;)
+  {
+    if (ptrace(PTRACE_SYSCALL, pid, NULL, (void *)(long)sig) < 0 || waitpid(pid, &status, 0) < 0)
+      return -1;
+    if (WIFEXITED(status) || WIFSIGNALED(status))
+      break;
+
+    /* signals other than the syscall stops go through */
+    sig = 0;
+    if (WSTOPSIG(status) == (SIGTRAP | 0x80))
+      stops++;
+    else
+      sig = WSTOPSIG(status);
+  }
+
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? (stops + 1) / 2 : -1;
+}
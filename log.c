@@ -0,0 +1,410 @@
+/*
+
+module: log.c
+
+purpose: asynchronous logging of the workers through shared rings, written out by a drainer process
+
+author: Luigi Ferrettino (S254300)
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "errlib.h"
+#include "sockwrap.h"
+#include "log.h"
+
+#define LOG_OUTLEN 65536 /* bytes written at once by the drainer */
+
+extern char *prog_name;
+
+static struct log_shm *logs = NULL; /* NULL: not started, print as before */
+static struct log_ring *own = NULL; /* ring of this process, NULL until its first record */
+static int log_format = LOG_FMT_TEXT;
+static uint64_t tokens = LOG_BURST, refilled = 0; /* rate limit of this process */
+
+/* output buffers of the drainer */
+struct out
+{
+    int fd;
+    size_t len;
+    char buf[LOG_OUTLEN];
+};
+
+static void log_err(const char *line);
+static void log_forked(void);
+static struct log_rec *log_reserve(void);
+static void log_commit(void);
+static void log_drainer(int rfd);
+static int drain(struct out *out, struct out *err, int reap);
+static void emit(struct out *o, const struct log_rec *r);
+static void flush(struct out *o);
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*****************************************************************************
+ * map the rings and start the drainer; from now on log_msg() and the errlib
+ * functions of this process and of the ones forked from it go through the
+ * rings. The drainer is not a child of the server (it would be waited for
+ * with the workers): it stops when the last process holding the write end of
+ * a pipe is gone, that is the server and all its workers, after a last pass.
+ * Returns -1 on error, logging stays synchronous.
+ *****************************************************************************/
+int log_init(int format)
+{
+    int pfd[2];
+    pid_t pid;
+    void *map;
+
+    if ((map = mmap(NULL, sizeof(struct log_shm), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) ==
+        MAP_FAILED)
+        return -1;
+    if (pipe(pfd) < 0)
+    {
+        munmap(map, sizeof(struct log_shm));
+        return -1;
+    }
+
+    fflush(stdout);
+    if ((pid = fork()) < 0)
+    {
+        munmap(map, sizeof(struct log_shm));
+        close(pfd[0]);
+        close(pfd[1]);
+        return -1;
+    }
+    if (pid == 0)
+    {
+        /* the intermediate process exits at once, the drainer is adopted by init */
+        logs = map;
+        log_format = format;
+        close(pfd[1]);
+        if (fork() == 0)
+            log_drainer(pfd[0]);
+        _exit(0);
+    }
+    close(pfd[0]);
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+        ;
+
+    logs = map;
+    log_format = format;
+    pthread_atfork(NULL, NULL, log_forked);
+    err_hook = log_err;
+    return 0;
+}
+
+void Log_init(int format)
+{
+    if (log_init(format) < 0)
+        err_sys("(%s) error - cannot start the logger", prog_name);
+}
+
+/* a forked process gets a ring of its own, and a full rate */
+static void log_forked(void)
+{
+    own = NULL;
+    tokens = LOG_BURST;
+    refilled = 0;
+}
+
+/*********************************************************************
+ * the next record of the ring of this process, to be filled and then
+ * published by log_commit(); NULL if it must be dropped (rate limit,
+ * ring full) or if there is no ring left for this process.
+ *********************************************************************/
+static struct log_rec *log_reserve(void)
+{
+    uint64_t now = now_ms();
+    uint32_t head;
+    pid_t pid, none;
+    int i;
+
+    if (own == NULL)
+    {
+        pid = getpid();
+        for (i = 0; i < LOG_RINGS && own == NULL; i++)
+        {
+            none = 0;
+            if (__atomic_compare_exchange_n(&logs->rings[i].owner, &none, pid, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                own = &logs->rings[i];
+        }
+        if (own == NULL)
+            return NULL;
+    }
+
+    /* token bucket: LOG_RATE per second, up to LOG_BURST */
+    if (now != refilled)
+    {
+        tokens += (now - refilled) * LOG_RATE / 1000;
+        if (tokens > LOG_BURST || refilled == 0)
+            tokens = LOG_BURST;
+        refilled = now;
+    }
+    if (tokens == 0)
+    {
+        __atomic_fetch_add(&logs->limited, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    tokens--;
+
+    head = own->head;
+    if (head - __atomic_load_n(&own->tail, __ATOMIC_ACQUIRE) == LOG_RECORDS)
+    {
+        __atomic_fetch_add(&logs->full, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    return &own->recs[head % LOG_RECORDS];
+}
+
+/* the drainer sees the record only from here */
+static void log_commit(void)
+{
+    __atomic_store_n(&own->head, own->head + 1, __ATOMIC_RELEASE);
+}
+
+/*****************************************************************************
+ * a message of the worker "pid" serving "host" (NULL if none): the format is
+ * expanded straight into its record, no system call. Before log_init(), and
+ * in a process that found no free ring, it is printed as "<pid>\t<host> - ".
+ *****************************************************************************/
+void log_msg(int pid, const char *host, const char *fmt, ...)
+{
+    struct log_rec *r;
+    struct timespec ts;
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    if (logs == NULL || (r = log_reserve()) == NULL)
+    {
+        if (logs == NULL || own == NULL)
+        {
+            printf("%d\t%s - ", pid, host != NULL ? host : "");
+            vprintf(fmt, ap);
+            printf("\n");
+            fflush(stdout);
+        }
+        va_end(ap);
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    r->ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    r->pid = pid;
+    r->err = 0;
+    strncpy(r->host, host != NULL ? host : "", LOG_HOSTLEN - 1);
+    r->host[LOG_HOSTLEN - 1] = '\0';
+    n = vsnprintf(r->text, LOG_TEXTLEN, fmt, ap);
+    r->len = n < 0 ? 0 : n < LOG_TEXTLEN ? n : LOG_TEXTLEN - 1;
+    va_end(ap);
+
+    log_commit();
+}
+
+/* hook of errlib: a line already formatted, with its newline */
+static void log_err(const char *line)
+{
+    struct log_rec *r;
+    struct timespec ts;
+    size_t len = strlen(line);
+
+    if ((r = log_reserve()) == NULL)
+    {
+        if (own == NULL)
+        {
+            fflush(stdout);
+            fputs(line, stderr);
+            fflush(stderr);
+        }
+        return;
+    }
+
+    if (len > 0 && line[len - 1] == '\n')
+        len--;
+    if (len > LOG_TEXTLEN - 1)
+        len = LOG_TEXTLEN - 1;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    r->ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    r->pid = getpid();
+    r->err = 1;
+    r->host[0] = '\0';
+    memcpy(r->text, line, len);
+    r->text[len] = '\0';
+    r->len = len;
+
+    log_commit();
+}
+
+/* records dropped so far, because of a full ring and of the rate limit */
+void log_drops(uint64_t *full, uint64_t *limited)
+{
+    *full = logs != NULL ? __atomic_load_n(&logs->full, __ATOMIC_RELAXED) : 0;
+    *limited = logs != NULL ? __atomic_load_n(&logs->limited, __ATOMIC_RELAXED) : 0;
+}
+
+/*****************************************************************************
+ * the drainer: every LOG_PERIOD milliseconds the records of all the rings go
+ * out with one write() per stream, and once a second the rings of processes
+ * that are gone are released and new drops are reported. It ignores the
+ * signals sent to the whole group (^C), so what the workers logged before
+ * dying is still written; it ends at the EOF of "rfd".
+ *****************************************************************************/
+static void log_drainer(int rfd)
+{
+    static struct out out, err;
+    struct log_rec r;
+    struct pollfd pfd;
+    uint64_t full, limited, told_full = 0, told_limited = 0, reaped = 0;
+    char c;
+
+    signal(SIGINT, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGUSR1, SIG_IGN);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_IGN);
+    err_hook = NULL;
+
+    out.fd = STDOUT_FILENO;
+    err.fd = STDERR_FILENO;
+    pfd.fd = rfd;
+    pfd.events = POLLIN;
+
+    for (;;)
+    {
+        int reap = now_ms() - reaped >= 1000;
+
+        drain(&out, &err, reap);
+
+        if (reap)
+        {
+            reaped = now_ms();
+            log_drops(&full, &limited);
+            if (full != told_full || limited != told_limited)
+            {
+                memset(&r, 0, sizeof(r));
+                r.ns = (uint64_t)time(NULL) * 1000000000;
+                r.pid = getpid();
+                r.err = 1;
+                r.len = snprintf(r.text, LOG_TEXTLEN, "PARENT\t(%s) log - %llu records dropped (ring full), %llu over the rate limit",
+                                 prog_name, (unsigned long long)full, (unsigned long long)limited);
+                emit(&err, &r);
+                flush(&err);
+                told_full = full;
+                told_limited = limited;
+            }
+        }
+
+        if (poll(&pfd, 1, LOG_PERIOD) > 0 && read(rfd, &c, 1) <= 0)
+            break;
+    }
+
+    drain(&out, &err, 0);
+    _exit(0);
+}
+
+/* everything published so far; with "reap", the rings of dead owners are released. Returns the records */
+static int drain(struct out *out, struct out *err, int reap)
+{
+    struct log_ring *ring;
+    uint32_t head, tail;
+    pid_t owner;
+    int i, n = 0;
+
+    for (i = 0; i < LOG_RINGS; i++)
+    {
+        ring = &logs->rings[i];
+        if ((owner = __atomic_load_n(&ring->owner, __ATOMIC_ACQUIRE)) == 0)
+            continue;
+
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (tail = ring->tail; tail != head; tail++, n++)
+        {
+            struct log_rec *r = &ring->recs[tail % LOG_RECORDS];
+
+            /* the two streams may be the same file: what came first goes out first */
+            flush(r->err ? out : err);
+            emit(r->err ? err : out, r);
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        /* nothing more can come from a process that is gone */
+        if (reap && kill(owner, 0) < 0 && errno == ESRCH && __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail)
+            __atomic_compare_exchange_n(&ring->owner, &owner, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+
+    flush(out);
+    flush(err);
+    return n;
+}
+
+/* one record, as a line in the format chosen */
+static void emit(struct out *o, const struct log_rec *r)
+{
+    char line[LOG_TEXTLEN * 6 + LOG_HOSTLEN + 128], *p = line;
+    const char *s;
+    int k;
+
+    if (log_format == LOG_FMT_JSON)
+    {
+        p += sprintf(p, "{\"ts\":%llu.%06llu,\"pid\":%d,\"level\":\"%s\"", (unsigned long long)(r->ns / 1000000000),
+                     (unsigned long long)(r->ns % 1000000000 / 1000), (int)r->pid, r->err ? "error" : "info");
+        if (r->host[0] != '\0')
+            p += sprintf(p, ",\"host\":\"%.*s\"", LOG_HOSTLEN, r->host);
+        p += sprintf(p, ",\"msg\":\"");
+        for (s = r->text, k = 0; k < r->len; s++, k++)
+        {
+            if (*s == '"' || *s == '\\')
+            {
+                *p++ = '\\';
+                *p++ = *s;
+            }
+            else if (*s == '\t')
+            {
+                *p++ = '\\';
+                *p++ = 't';
+            }
+            else if ((unsigned char)*s < 0x20)
+                p += sprintf(p, "\\u%04x", *s);
+            else
+                *p++ = *s;
+        }
+        p += sprintf(p, "\"}\n");
+    }
+    else if (r->err)
+        p += sprintf(p, "%.*s\n", (int)r->len, r->text);
+    else
+        p += sprintf(p, "%d\t%.*s - %.*s\n", (int)r->pid, LOG_HOSTLEN, r->host, (int)r->len, r->text);
+
+    if (o->len + (p - line) > LOG_OUTLEN)
+        flush(o);
+    memcpy(o->buf + o->len, line, p - line);
+    o->len += p - line;
+}
+
+/* a failed write has nowhere to be reported: the records are lost */
+static void flush(struct out *o)
+{
+    if (o->len > 0)
+        writen(o->fd, o->buf, o->len);
+    o->len = 0;
+}
@@ -0,0 +1,72 @@
+/*
+
+ module: log.h
+
+ purpose: definitions of functions in log.c
+
+ reference: Luigi Ferrettino (S254300)
+
+ */
+
+#ifndef _LOG_H
+
+#define _LOG_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* output of the drainer */
+#define LOG_FMT_TEXT 0 /* "<pid>\t<host> - <message>", as printed before */
+#define LOG_FMT_JSON 1 /* one object per line: ts, pid, level, host, msg */
+
+/*****************************************************************************
+ * every process that logs owns one of LOG_RINGS rings of LOG_RECORDS records
+ * (a power of 2), written only by it and read only by the drainer process
+ * every LOG_PERIOD milliseconds. A process logs at most LOG_RATE records per
+ * second (LOG_BURST at once), the others are dropped and counted, as the ones
+ * that find the ring full.
+ *****************************************************************************/
+#define LOG_RINGS 64
+#define LOG_RECORDS 256
+#define LOG_TEXTLEN 448
+#define LOG_HOSTLEN 48
+#define LOG_PERIOD 10
+#define LOG_RATE 20000
+#define LOG_BURST 20000
+
+struct log_rec
+{
+    uint64_t ns;  /* CLOCK_REALTIME */
+    int32_t pid;
+    uint16_t err; /* from errlib (standard error), otherwise standard output */
+    uint16_t len;
+    char host[LOG_HOSTLEN]; /* "" if none */
+    char text[LOG_TEXTLEN];
+};
+
+/* single producer (the owner), single consumer (the drainer): head and tail only grow */
+struct log_ring
+{
+    pid_t owner;   /* 0: free */
+    uint32_t head; /* next record written */
+    char pad[56];  /* head and tail on different cache lines */
+    uint32_t tail; /* next record read */
+    struct log_rec recs[LOG_RECORDS];
+};
+
+/* in shared memory, inherited by the forked workers */
+struct log_shm
+{
+    uint64_t full, limited; /* records dropped */
+    struct log_ring rings[LOG_RINGS];
+};
+
+int log_init(int format);
+
+void Log_init(int format);
+
+void log_msg(int pid, const char *host, const char *fmt, ...);
+
+void log_drops(uint64_t *full, uint64_t *limited);
+
+#endif
@@ -0,0 +1,595 @@
+/*
+
+module: meta.c
+
+purpose: memory-mapped index of the metadata of the served tree, kept current with inotify
+
+author: Luigi Ferrettino (S254300)
+
+*/
+
+#define _GNU_SOURCE /* nftw() */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <ftw.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/prctl.h>
+
+#include "errlib.h"
+#include "sockwrap.h"
+#include "pack.h" /* pack_hash() */
+#include "meta.h"
+
+#define META_EVENTS (IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+extern char *prog_name;
+
+/* state of the watcher process (nftw() has no user argument) */
+static struct meta *watch_m;
+static int watch_ifd = -1;
+static char **watch_dirs; /* directory of every watch descriptor */
+static int watch_ndirs;
+static uint32_t watch_gen;
+
+static int meta_grow(struct meta *m, size_t namelen);
+
+/* map the index file in *m; -1 if it is not a valid index */
+static int meta_map(struct meta *m, int fd)
+{
+    struct stat sb;
+    void *map;
+
+    if (fstat(fd, &sb) < 0 || (size_t)sb.st_size < sizeof(struct meta_header) ||
+        (map = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+        return -1;
+
+    m->hdr = map;
+    m->maplen = sb.st_size;
+    m->slots = (struct meta_slot *)(m->hdr + 1);
+    m->names = (char *)map + m->hdr->names;
+
+    if (memcmp(m->hdr->magic, META_MAGIC, 8) != 0 || m->hdr->nslots == 0 ||
+        (m->hdr->nslots & (m->hdr->nslots - 1)) != 0 ||
+        sizeof(struct meta_header) + (uint64_t)m->hdr->nslots * sizeof(struct meta_slot) > m->hdr->names ||
+        m->hdr->names + m->hdr->names_cap > m->maplen || m->hdr->names_len > m->hdr->names_cap)
+    {
+        munmap(map, sb.st_size);
+        m->hdr = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* write an empty index of "nslots" slots and "names" bytes of names in fd */
+static int meta_format(int fd, const struct stat *root, uint32_t nslots, uint64_t names)
+{
+    struct meta_header hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, META_MAGIC, 8);
+    hdr.root_dev = root->st_dev;
+    hdr.root_ino = root->st_ino;
+    hdr.nslots = nslots;
+    hdr.names = sizeof(hdr) + (uint64_t)nslots * sizeof(struct meta_slot);
+    hdr.names_cap = names;
+
+    /* the slots are zero (META_EMPTY) as ftruncate() leaves them */
+    if (ftruncate(fd, 0) < 0 || ftruncate(fd, hdr.names + names) < 0 || pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+        return -1;
+
+    return 0;
+}
+
+/**************************************************************************
+ * map the index in "path" of the tree "root", or create an empty one if it
+ * is missing, damaged or of another tree. *warm tells if it can already
+ * answer (a previous run left it complete). NULL on error.
+ **************************************************************************/
+struct meta *meta_open(const char *path, const char *root, int *warm)
+{
+    struct meta *m;
+    struct stat rs;
+    int fd;
+
+    if (stat(root, &rs) < 0 || (m = calloc(1, sizeof(*m))) == NULL)
+        return NULL;
+    snprintf(m->path, sizeof(m->path), "%s", path);
+
+    if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+    {
+        free(m);
+        return NULL;
+    }
+
+    if (meta_map(m, fd) == 0 && m->hdr->root_dev == (uint64_t)rs.st_dev && m->hdr->root_ino == (uint64_t)rs.st_ino)
+        *warm = m->hdr->ready;
+    else
+    {
+        if (m->hdr != NULL)
+            munmap(m->hdr, m->maplen);
+        *warm = 0;
+        if (meta_format(fd, &rs, META_MIN_SLOTS, META_MIN_NAMES) < 0 || meta_map(m, fd) < 0)
+        {
+            close(fd);
+            free(m);
+            return NULL;
+        }
+    }
+    close(fd);
+
+    return m;
+}
+
+struct meta *Meta_open(const char *path, const char *root, int *warm)
+{
+    struct meta *m;
+
+    if ((m = meta_open(path, root, warm)) == NULL)
+        err_sys("(%s) error - cannot open the metadata index %s", prog_name, path);
+
+    return m;
+}
+
+/* the watcher wrote a bigger index: map the new file instead (the old mapping stays if it fails) */
+static void meta_reopen(struct meta *m)
+{
+    struct meta n;
+    int fd;
+
+    n = *m;
+    if ((fd = open(m->path, O_RDWR)) < 0)
+        return;
+    if (meta_map(&n, fd) == 0)
+    {
+        munmap(m->hdr, m->maplen);
+        *m = n;
+    }
+    close(fd);
+}
+
+/* only the names that the scan would produce can be looked up: "a//b", "./a", "a/" and so on are left to the filesystem */
+int meta_canonical(const char *name)
+{
+    const char *p = name;
+
+    if (*name == '\0' || *name == '/')
+        return 0;
+    for (;;)
+    {
+        if (p[0] == '/' || (p[0] == '.' && (p[1] == '/' || p[1] == '\0')) ||
+            (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0')))
+            return 0;
+        if ((p = strchr(p, '/')) == NULL)
+            return 1;
+        p++;
+        if (*p == '\0')
+            return 0;
+    }
+}
+
+/*******************************************************************************
+ * look "name" up without touching the filesystem: META_FOUND with size and
+ * timestamp in *e, META_MISSING if it is not in the tree, META_UNKNOWN if the
+ * index cannot tell (not built yet, a symbolic link on the way, an odd name).
+ *******************************************************************************/
+int meta_lookup(struct meta *m, const char *name, struct meta_entry *e)
+{
+    struct meta_slot *s, copy;
+    size_t len = strlen(name);
+    uint64_t h;
+    uint32_t mask, i, n, seq;
+    int match;
+
+    if (__atomic_load_n(&m->hdr->replaced, __ATOMIC_ACQUIRE))
+        meta_reopen(m);
+
+    if (!__atomic_load_n(&m->hdr->ready, __ATOMIC_ACQUIRE) || !meta_canonical(name))
+        return META_UNKNOWN;
+
+    h = pack_hash(name, len);
+    mask = m->hdr->nslots - 1;
+
+    for (i = h & mask, n = 0; n < m->hdr->nslots; i = (i + 1) & mask, n++)
+    {
+        s = &m->slots[i];
+
+        /* seqlock: a consistent copy of the slot, retried while the watcher writes it */
+        do
+        {
+            while ((seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE)) & 1)
+                ;
+            memcpy(&copy, s, sizeof(copy));
+            match = (copy.state == META_FILE || copy.state == META_LINK) && copy.hash == h && copy.namelen == len &&
+                    (uint64_t)copy.name + len <= m->hdr->names_cap && memcmp(m->names + copy.name, name, len) == 0;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq);
+
+        if (copy.state == META_EMPTY)
+            break;
+        if (match)
+        {
+            if (copy.state == META_LINK)
+                return META_UNKNOWN;
+            e->ino = copy.ino;
+            e->size = copy.size;
+            e->mtime = copy.mtime;
+            return META_FOUND;
+        }
+    }
+
+    /* behind a symbolic link to a directory there may be anything */
+    return m->hdr->links > 0 && strchr(name, '/') != NULL ? META_UNKNOWN : META_MISSING;
+}
+
+/********************************************************************
+ * the functions below run only in the watcher process, the only one
+ * writing the index
+ ********************************************************************/
+
+static void slot_begin(struct meta_slot *s)
+{
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void slot_end(struct meta_slot *s)
+{
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* the slot of "name", NULL if none; *freeslot is where it would go */
+static struct meta_slot *slot_find(struct meta *m, const char *name, size_t len, uint64_t h, struct meta_slot **freeslot)
+{
+    struct meta_slot *s;
+    uint32_t mask = m->hdr->nslots - 1, i, n;
+
+    *freeslot = NULL;
+    for (i = h & mask, n = 0; n < m->hdr->nslots; i = (i + 1) & mask, n++)
+    {
+        s = &m->slots[i];
+        if (s->state == META_EMPTY)
+        {
+            if (*freeslot == NULL)
+                *freeslot = s;
+            return NULL;
+        }
+        if (s->state == META_DELETED)
+        {
+            if (*freeslot == NULL)
+                *freeslot = s;
+            continue;
+        }
+        if (s->hash == h && s->namelen == len && memcmp(m->names + s->name, name, len) == 0)
+            return s;
+    }
+
+    return NULL;
+}
+
+/* add or update "name" */
+static int meta_put(struct meta *m, const char *name, const struct stat *sb, uint32_t gen)
+{
+    struct meta_slot *s, *freeslot;
+    size_t len = strlen(name);
+    uint64_t h = pack_hash(name, len);
+    uint32_t state = S_ISLNK(sb->st_mode) ? META_LINK : META_FILE;
+
+    if ((s = slot_find(m, name, len, h, &freeslot)) == NULL)
+    {
+        /* at most 3/4 full, counting the deleted slots that lengthen the lookups too */
+        if ((uint64_t)(m->hdr->used + m->hdr->deleted + 1) * 4 > (uint64_t)m->hdr->nslots * 3 ||
+            m->hdr->names_len + len > m->hdr->names_cap)
+        {
+            if (meta_grow(m, len) < 0)
+                return -1;
+            slot_find(m, name, len, h, &freeslot);
+        }
+        s = freeslot;
+
+        /* the name is written before the slot points to it */
+        memcpy(m->names + m->hdr->names_len, name, len);
+
+        slot_begin(s);
+        if (s->state == META_DELETED)
+            m->hdr->deleted--;
+        s->hash = h;
+        s->name = m->hdr->names_len;
+        s->namelen = len;
+        s->state = META_EMPTY; /* counted below as new */
+        m->hdr->names_len += len;
+        m->hdr->used++;
+    }
+    else
+        slot_begin(s);
+
+    if (s->state == META_LINK)
+        m->hdr->links--;
+    if (state == META_LINK)
+        m->hdr->links++;
+    s->state = state;
+    s->ino = sb->st_ino;
+    s->size = sb->st_size;
+    s->mtime = sb->st_mtime;
+    s->seen = gen;
+    slot_end(s);
+
+    return 0;
+}
+
+static void slot_delete(struct meta *m, struct meta_slot *s)
+{
+    slot_begin(s);
+    if (s->state == META_LINK)
+        m->hdr->links--;
+    s->state = META_DELETED;
+    slot_end(s);
+    m->hdr->used--;
+    m->hdr->deleted++;
+}
+
+static void meta_del(struct meta *m, const char *name)
+{
+    struct meta_slot *s, *freeslot;
+    size_t len = strlen(name);
+
+    if ((s = slot_find(m, name, len, pack_hash(name, len), &freeslot)) != NULL)
+        slot_delete(m, s);
+}
+
+/* a directory went away: everything under it */
+static void meta_del_dir(struct meta *m, const char *dir)
+{
+    size_t len = strlen(dir);
+    uint32_t i;
+
+    for (i = 0; i < m->hdr->nslots; i++)
+    {
+        struct meta_slot *s = &m->slots[i];
+
+        if ((s->state == META_FILE || s->state == META_LINK) && s->namelen > len &&
+            memcmp(m->names + s->name, dir, len) == 0 && m->names[s->name + len] == '/')
+            slot_delete(m, s);
+    }
+}
+
+/* after a scan: what it did not find is not there anymore */
+static void meta_sweep(struct meta *m, uint32_t gen)
+{
+    uint32_t i;
+
+    for (i = 0; i < m->hdr->nslots; i++)
+        if ((m->slots[i].state == META_FILE || m->slots[i].state == META_LINK) && m->slots[i].seen != gen)
+            slot_delete(m, &m->slots[i]);
+}
+
+/*************************************************************************
+ * copy the live entries in a bigger index (half full, with room for the
+ * names), rename it over the old one and tell the readers to map it again
+ *************************************************************************/
+static int meta_grow(struct meta *m, size_t namelen)
+{
+    struct meta n;
+    struct stat rs;
+    char tmp[PATH_MAX + sizeof(".tmp")];
+    uint64_t names = 0;
+    uint32_t nslots, i;
+    int fd;
+
+    for (i = 0; i < m->hdr->nslots; i++)
+        if (m->slots[i].state == META_FILE || m->slots[i].state == META_LINK)
+            names += m->slots[i].namelen;
+    for (nslots = META_MIN_SLOTS; (uint64_t)nslots < 2 * ((uint64_t)m->hdr->used + 1); nslots *= 2)
+        ;
+    names = 2 * (names + namelen) > META_MIN_NAMES ? 2 * (names + namelen) : META_MIN_NAMES;
+
+    rs.st_dev = m->hdr->root_dev;
+    rs.st_ino = m->hdr->root_ino;
+
+    n = *m;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", m->path);
+    if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+        return -1;
+    if (meta_format(fd, &rs, nslots, names) < 0 || meta_map(&n, fd) < 0)
+    {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+
+    n.hdr->gen = m->hdr->gen;
+    n.hdr->ready = m->hdr->ready;
+    for (i = 0; i < m->hdr->nslots; i++)
+    {
+        struct meta_slot *s = &m->slots[i], *d, *freeslot;
+
+        if (s->state != META_FILE && s->state != META_LINK)
+            continue;
+        slot_find(&n, m->names + s->name, s->namelen, s->hash, &freeslot);
+        d = freeslot;
+        *d = *s;
+        d->seq = 0;
+        d->name = n.hdr->names_len;
+        memcpy(n.names + d->name, m->names + s->name, s->namelen);
+        n.hdr->names_len += s->namelen;
+        n.hdr->used++;
+        if (s->state == META_LINK)
+            n.hdr->links++;
+    }
+
+    if (rename(tmp, m->path) < 0)
+    {
+        munmap(n.hdr, n.maplen);
+        unlink(tmp);
+        return -1;
+    }
+    __atomic_store_n(&m->hdr->replaced, 1, __ATOMIC_RELEASE);
+    munmap(m->hdr, m->maplen);
+    *m = n;
+
+    return 0;
+}
+
+/* remember the directory of a watch descriptor (a moved directory keeps its descriptor) */
+static void watch_dir(const char *dir)
+{
+    int wd;
+
+    if ((wd = inotify_add_watch(watch_ifd, dir, META_EVENTS)) < 0)
+    {
+        err_ret("(%s) warning - cannot watch %s", prog_name, dir);
+        return;
+    }
+
+    if (wd >= watch_ndirs)
+    {
+        int n = wd * 2 + 64;
+
+        if ((watch_dirs = realloc(watch_dirs, n * sizeof(char *))) == NULL)
+            err_quit("(%s) error - out of memory", prog_name);
+        memset(watch_dirs + watch_ndirs, 0, (n - watch_ndirs) * sizeof(char *));
+        watch_ndirs = n;
+    }
+    free(watch_dirs[wd]);
+    watch_dirs[wd] = strdup(dir);
+}
+
+/* nftw() callback of the scans: watch the directories, index the files */
+static int scan_entry(const char *path, const struct stat *sb, int type, struct FTW *ftwbuf)
+{
+    if (strncmp(path, "./", 2) == 0)
+        path += 2;
+
+    if (type == FTW_D)
+        watch_dir(path);
+    else if ((type == FTW_F && S_ISREG(sb->st_mode)) || type == FTW_SL || type == FTW_SLN)
+        meta_put(watch_m, path, sb, watch_gen);
+
+    return 0;
+}
+
+/* scan the whole tree in a new generation, then drop what was not found */
+static void reconcile(struct meta *m)
+{
+    watch_gen = m->hdr->gen + 1;
+    nftw(".", scan_entry, 32, FTW_PHYS);
+    meta_sweep(watch_m, watch_gen);
+    watch_m->hdr->gen = watch_gen;
+    __atomic_store_n(&watch_m->hdr->ready, 1, __ATOMIC_RELEASE);
+}
+
+/* apply an inotify event */
+static void watch_event(struct inotify_event *ev)
+{
+    char path[PATH_MAX];
+    struct stat sb;
+    const char *dir;
+
+    if (ev->mask & IN_Q_OVERFLOW)
+    {
+        /* events were lost: only a new scan can tell what changed */
+        reconcile(watch_m);
+        return;
+    }
+    if (ev->wd < 0 || ev->wd >= watch_ndirs || (dir = watch_dirs[ev->wd]) == NULL)
+        return;
+    if (ev->mask & IN_IGNORED)
+    {
+        free(watch_dirs[ev->wd]);
+        watch_dirs[ev->wd] = NULL;
+        return;
+    }
+    if (ev->len == 0)
+        return;
+
+    if (strcmp(dir, ".") == 0)
+        snprintf(path, sizeof(path), "%s", ev->name);
+    else
+        snprintf(path, sizeof(path), "%s/%s", dir, ev->name);
+
+    if (ev->mask & IN_ISDIR)
+    {
+        if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+            nftw(path, scan_entry, 32, FTW_PHYS);
+        else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+            meta_del_dir(watch_m, path);
+        return;
+    }
+
+    if ((ev->mask & (IN_DELETE | IN_MOVED_FROM)) == 0 && lstat(path, &sb) == 0 &&
+        (S_ISREG(sb.st_mode) || S_ISLNK(sb.st_mode)))
+        meta_put(watch_m, path, &sb, watch_gen);
+    else
+        meta_del(watch_m, path);
+}
+
+/****************************************************************************
+ * fork the process that keeps the index of "root" current: it scans the tree
+ * (the index answers only after the first complete scan, unless it is warm
+ * from a previous run) and then applies the inotify events. It dies with the
+ * server; a lock lets only one watcher at a time write the index, so after an
+ * upgrade the new one waits for the old one. Returns the pid of the watcher.
+ ****************************************************************************/
+pid_t meta_watch(struct meta *m, const char *root)
+{
+    char buf[65536], lockpath[PATH_MAX + sizeof(".lock")];
+    struct inotify_event *ev;
+    ssize_t n, k;
+    uint32_t i;
+    pid_t pid;
+    int lockfd;
+
+    if ((pid = fork()) != 0)
+        return pid;
+
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    signal(SIGCHLD, SIG_DFL);
+
+    snprintf(lockpath, sizeof(lockpath), "%s.lock", m->path);
+    if ((lockfd = open(lockpath, O_RDWR | O_CREAT, 0644)) < 0 || flock(lockfd, LOCK_EX) < 0 || chdir(root) < 0 ||
+        (watch_ifd = inotify_init1(IN_CLOEXEC)) < 0)
+    {
+        err_ret("(%s) error - metadata watcher not started, the index is not used", prog_name);
+        __atomic_store_n(&m->hdr->ready, 0, __ATOMIC_RELEASE);
+        exit(1);
+    }
+
+    /* a previous watcher may have grown the index meanwhile, or died in the middle of a slot */
+    meta_reopen(m);
+    for (i = 0; i < m->hdr->nslots; i++)
+        if (m->slots[i].seq & 1)
+        {
+            m->slots[i].seen = 0; /* dropped by the scan, unless found again */
+            __atomic_store_n(&m->slots[i].seq, m->slots[i].seq + 1, __ATOMIC_RELEASE);
+        }
+
+    watch_m = m;
+    reconcile(m);
+
+    for (;;)
+    {
+        if ((n = read(watch_ifd, buf, sizeof(buf))) < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+
+        for (k = 0; k < n; k += sizeof(struct inotify_event) + ev->len)
+        {
+            ev = (struct inotify_event *)(buf + k);
+            watch_event(ev);
+        }
+    }
+
+    /* the index would not follow the tree anymore */
+    err_ret("(%s) error - metadata watcher stopped, the index is not used", prog_name);
+    __atomic_store_n(&watch_m->hdr->ready, 0, __ATOMIC_RELEASE);
+    exit(1);
+}
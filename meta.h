@@ -0,0 +1,100 @@
+/*
+
+ module: meta.h
+
+ purpose: definitions of functions in meta.c
+
+ reference: Luigi Ferrettino (S254300)
+
+ */
+
+#ifndef _META_H
+
+#define _META_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <sys/types.h>
+
+#define META_MAGIC "DP1META1"  /* first bytes of the index file */
+#define META_MIN_SLOTS 4096    /* slots of a new index */
+#define META_MIN_NAMES 262144  /* bytes for the names of a new index */
+
+/* state of a slot */
+#define META_EMPTY 0   /* never used, ends a lookup */
+#define META_FILE 1    /* a regular file */
+#define META_LINK 2    /* a symbolic link: the filesystem is asked */
+#define META_DELETED 3 /* removed, the lookups go on */
+
+/* results of meta_lookup() */
+#define META_FOUND 1    /* in the index, size and timestamp in the entry */
+#define META_MISSING 0  /* surely not in the tree: no need to ask the filesystem */
+#define META_UNKNOWN -1 /* the index cannot tell, ask the filesystem */
+
+/****************************************************************************
+ * the index file, mapped by every process (native byte order, as built):
+ *
+ *   | header | nslots slots (open addressing) | names (append only) |
+ *
+ * only the watcher process writes it; a slot being written has an odd seq,
+ * so the readers retry (seqlock). When full, the watcher writes a bigger
+ * copy, renames it over the old one and marks the old one "replaced".
+ ****************************************************************************/
+struct meta_header
+{
+    char magic[8];
+    uint64_t root_dev, root_ino; /* the tree indexed */
+    uint32_t nslots;             /* power of 2 */
+    uint32_t used;               /* META_FILE and META_LINK slots */
+    uint32_t deleted;            /* META_DELETED slots */
+    uint32_t links;              /* META_LINK slots */
+    uint64_t names;              /* offset of the names in the file */
+    uint64_t names_cap, names_len;
+    uint32_t gen;                /* scan generation */
+    uint32_t ready;              /* a whole scan has been applied: a miss is a miss */
+    uint32_t replaced;           /* a bigger index took the place of this one */
+    uint32_t pad;
+};
+
+struct meta_slot
+{
+    uint32_t seq;   /* odd while being written */
+    uint32_t state; /* META_* */
+    uint64_t hash;
+    uint64_t ino;
+    uint64_t size;
+    uint32_t mtime;
+    uint32_t seen;  /* last scan generation that found it */
+    uint32_t name;  /* offset in the names */
+    uint32_t namelen;
+};
+
+/* an index mapped in memory */
+struct meta
+{
+    char path[PATH_MAX];
+    struct meta_header *hdr;
+    size_t maplen;
+    struct meta_slot *slots;
+    char *names;
+};
+
+/* result of a lookup */
+struct meta_entry
+{
+    uint64_t ino;
+    uint64_t size;
+    uint32_t mtime;
+};
+
+struct meta *meta_open(const char *path, const char *root, int *warm);
+
+struct meta *Meta_open(const char *path, const char *root, int *warm);
+
+int meta_lookup(struct meta *m, const char *name, struct meta_entry *e);
+
+int meta_canonical(const char *name);
+
+pid_t meta_watch(struct meta *m, const char *root);
+
+#endif
@@ -0,0 +1,282 @@
+/*
+
+module: mirror.c
+
+purpose: incremental mirror of a directory of the server
+
+author: Luigi Ferrettino (S254300)
+
+*/
+
+#define _GNU_SOURCE /* nftw() */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+#include "errlib.h"
+#include "sockwrap.h"
+#include "recvfile.h"
+#include "mirror.h"
+
+extern char *prog_name;
+
+/* a line of the LIST response */
+struct entry
+{
+    char *name;       /* name on the server */
+    char *rel;        /* the same, relative to the mirrored directory */
+    unsigned long size;
+    unsigned long mtime;
+};
+
+/* state of the pruning walk (nftw() has no user argument) */
+static struct entry *prune_entries;
+static int prune_nentries;
+static size_t prune_base;
+static long prune_count;
+
+static int cmp_rel(const void *a, const void *b)
+{
+    return strcmp(((const struct entry *)a)->rel, ((const struct entry *)b)->rel);
+}
+
+/* "LIST remote" on a new connection; the text of the response, NULL on failure */
+static char *get_listing(const char *host, const char *port, const char *remote, uint32_t *len)
+{
+    struct timeval tval;
+    char buf[MAXBUFLEN], *text;
+    uint32_t timestamp;
+    int s;
+
+    if (strlen(remote) > sizeof(buf) - 8)
+        return NULL;
+
+    if ((s = tcp_connect_race(host, port, NULL)) < 0)
+    {
+        err_ret("(%s) error - connect to %s %s failed", prog_name, host, port);
+        return NULL;
+    }
+
+    tval.tv_sec = 6;
+    tval.tv_usec = 0;
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tval, sizeof(tval));
+
+    snprintf(buf, sizeof(buf), "LIST %s\r\n", remote);
+    if (writen(s, buf, strlen(buf)) < 0 || recvhdr(s, buf, len, &timestamp) != GETFILE_OK ||
+        (text = malloc(*len + 1)) == NULL)
+    {
+        err_msg("(%s) error - cannot list {%s} on %s %s", prog_name, remote, host, port);
+        close(s);
+        return NULL;
+    }
+
+    if (readn(s, text, *len) != *len)
+    {
+        err_msg("(%s) error - listing of {%s} interrupted", prog_name, remote);
+        free(text);
+        close(s);
+        return NULL;
+    }
+    text[*len] = '\0';
+
+    writen(s, "QUIT\r\n", 6);
+    close(s);
+
+    return text;
+}
+
+/* parse "<size> <timestamp> <name>" lines, keeping only the names under remote that stay inside the local tree */
+static struct entry *parse_listing(char *text, const char *remote, int *n)
+{
+    struct entry *e = NULL;
+    char *line, *save, *name;
+    size_t skip = strcmp(remote, ".") == 0 ? 0 : strlen(remote) + 1;
+    unsigned long size, mtime;
+    int count = 0, cap = 0, off;
+
+    for (line = strtok_r(text, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save))
+    {
+        if (sscanf(line, "%lu %lu %n", &size, &mtime, &off) != 2)
+            continue;
+        name = line + off;
+
+        if (strlen(name) <= skip || (skip > 0 && (strncmp(name, remote, skip - 1) != 0 || name[skip - 1] != '/')))
+            continue;
+        if (name[skip] == '/' || strcmp(name + skip, "..") == 0 || strncmp(name + skip, "../", 3) == 0 ||
+            strstr(name + skip, "/../") != NULL)
+        {
+            err_msg("(%s) error - {%s} would be outside the mirror, skipped", prog_name, name);
+            continue;
+        }
+
+        if (count == cap)
+        {
+            cap = cap ? cap * 2 : 1024;
+            if ((e = realloc(e, cap * sizeof(*e))) == NULL)
+                err_quit("(%s) error - out of memory", prog_name);
+        }
+        e[count].name = name;
+        e[count].rel = name + skip;
+        e[count].size = size;
+        e[count].mtime = mtime;
+        count++;
+    }
+
+    *n = count;
+    return e;
+}
+
+/* create the directories of a local path */
+static int mkparents(char *path)
+{
+    char *p;
+
+    for (p = strchr(path + 1, '/'); p != NULL; p = strchr(p + 1, '/'))
+    {
+        *p = '\0';
+        if (mkdir(path, 0755) < 0 && errno != EEXIST)
+        {
+            *p = '/';
+            return -1;
+        }
+        *p = '/';
+    }
+
+    return 0;
+}
+
+/* nftw() callback of the pruning: remove what the server does not have, then the directories left empty */
+static int prune_entry(const char *path, const struct stat *sb, int type, struct FTW *ftwbuf)
+{
+    struct entry key;
+
+    if (ftwbuf->level == 0)
+        return 0;
+
+    if (type == FTW_DP)
+    {
+        rmdir(path); /* fails if not empty, as wanted */
+        return 0;
+    }
+
+    key.rel = (char *)path + prune_base + 1;
+    if (bsearch(&key, prune_entries, prune_nentries, sizeof(key), cmp_rel) == NULL)
+    {
+        if (unlink(path) == 0)
+        {
+            printf("pruned: {%s}\n", key.rel);
+            prune_count++;
+        }
+        else
+            err_ret("(%s) error - cannot remove %s", prog_name, path);
+    }
+
+    return 0;
+}
+
+/***********************************************************************************
+ * make "local" a copy of the directory "remote" of the server: files missing here,
+ * or with another size or timestamp, are fetched over "nconn" connections (see
+ * bulk.c) into temporary names and renamed once complete; with "prune", local files
+ * not on the server anymore are removed. Returns the number of files not fetched.
+ ***********************************************************************************/
+int mirror(const char *host, const char *port, const char *remote, const char *local, int nconn, int retries,
+           int prune, struct mirror_stats *st)
+{
+    struct entry *e;
+    struct bulk_job *jobs;
+    struct stat sb;
+    char path[PATH_MAX], rdir[PATH_MAX], ldir[PATH_MAX], *text;
+    uint32_t len;
+    int n, njobs = 0, i, failures = 0;
+
+    memset(st, 0, sizeof(*st));
+
+    /* "dir/" and "dir" are the same directory, but the names are built on them */
+    snprintf(rdir, sizeof(rdir), "%s", *remote != '\0' ? remote : ".");
+    snprintf(ldir, sizeof(ldir), "%s", local);
+    for (i = strlen(rdir) - 1; i > 0 && rdir[i] == '/'; i--)
+        rdir[i] = '\0';
+    for (i = strlen(ldir) - 1; i > 0 && ldir[i] == '/'; i--)
+        ldir[i] = '\0';
+    remote = rdir;
+    local = ldir;
+
+    if ((text = get_listing(host, port, remote, &len)) == NULL)
+        return -1;
+
+    e = parse_listing(text, remote, &n);
+    st->listed = n;
+
+    if ((jobs = calloc(n + 1, sizeof(*jobs))) == NULL)
+        err_quit("(%s) error - out of memory", prog_name);
+
+    /* only what is new or changed is requested */
+    for (i = 0; i < n; i++)
+    {
+        if (snprintf(path, sizeof(path), "%s/%s", local, e[i].rel) >= (int)sizeof(path) - (int)strlen(MIRROR_SUFFIX))
+        {
+            err_msg("(%s) error - {%s} name too long, skipped", prog_name, e[i].name);
+            continue;
+        }
+
+        if (lstat(path, &sb) == 0 && S_ISREG(sb.st_mode) && (unsigned long)sb.st_size == e[i].size &&
+            (unsigned long)sb.st_mtime == e[i].mtime)
+        {
+            st->uptodate++;
+            continue;
+        }
+
+        if (mkparents(path) < 0)
+        {
+            err_ret("(%s) error - cannot create the directories of %s", prog_name, path);
+            continue;
+        }
+
+        jobs[njobs].name = e[i].name;
+        jobs[njobs].final = strdup(path);
+        strcat(path, MIRROR_SUFFIX);
+        jobs[njobs].dest = strdup(path);
+        jobs[njobs].status = GETFILE_BROKEN;
+        if (jobs[njobs].final == NULL || jobs[njobs].dest == NULL)
+            err_quit("(%s) error - out of memory", prog_name);
+        njobs++;
+    }
+
+    printf("%ld files on the server, %ld up to date, %d to fetch\n", st->listed, st->uptodate, njobs);
+    fflush(stdout);
+
+    if (njobs > 0)
+    {
+        failures = bulk_fetch(host, port, jobs, njobs, nconn, retries, &st->bulk);
+        bulk_report(jobs, njobs, &st->bulk);
+    }
+
+    /* the listing is complete (a failed one returned above), so what is not there has been deleted */
+    if (prune)
+    {
+        qsort(e, n, sizeof(*e), cmp_rel);
+        prune_entries = e;
+        prune_nentries = n;
+        prune_base = strlen(local);
+        prune_count = 0;
+        if (nftw(local, prune_entry, 16, FTW_DEPTH | FTW_PHYS) != 0)
+            err_ret("(%s) error - cannot walk %s", prog_name, local);
+        st->pruned = prune_count;
+    }
+
+    for (i = 0; i < njobs; i++)
+    {
+        free(jobs[i].final);
+        free(jobs[i].dest);
+    }
+    free(jobs);
+    free(e);
+    free(text);
+
+    return failures;
+}
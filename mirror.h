@@ -0,0 +1,31 @@
+/*
+
+ module: mirror.h
+
+ purpose: definitions of functions in mirror.c
+
+ reference: Luigi Ferrettino (S254300)
+
+ */
+
+#ifndef _MIRROR_H
+
+#define _MIRROR_H
+
+#include "bulk.h"
+
+#define MIRROR_SUFFIX ".mirror-tmp" /* a file being fetched, renamed without it once complete */
+
+/* outcome of mirror() */
+struct mirror_stats
+{
+    long listed;            /* files on the server */
+    long uptodate;          /* already here, same size and timestamp */
+    long pruned;            /* local files not on the server anymore, removed */
+    struct bulk_stats bulk; /* the new or changed files fetched */
+};
+
+int mirror(const char *host, const char *port, const char *remote, const char *local, int nconn, int retries,
+           int prune, struct mirror_stats *st);
+
+#endif
@@ -0,0 +1,357 @@
+/*
+
+module: pack.c
+
+purpose: packed archives of many small files: blobs plus a memory-mapped hash index
+
+author: Luigi Ferrettino (S254300)
+
+*/
+
+#define _GNU_SOURCE /* nftw(), copy_file_range() */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <ftw.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "errlib.h"
+#include "sockwrap.h"
+#include "pack.h"
+
+extern char *prog_name;
+
+/* a file found by pack_build() */
+struct packed
+{
+    char *name;
+    uint64_t offset;
+    uint32_t length;
+    uint32_t mtime;
+    uint16_t blob;
+};
+
+/* state of the walk of pack_build() (nftw() has no user argument) */
+static struct packed *build_files;
+static long build_nfiles, build_cap;
+static size_t build_base;
+
+/* FNV-1a, 64 bit */
+uint64_t pack_hash(const char *name, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+
+/* map the index of the archive and open its blobs; NULL on error */
+struct pack *pack_open(const char *archive)
+{
+    struct pack *p;
+    struct stat sb;
+    char path[PATH_MAX];
+    void *map;
+    uint32_t i;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s.idx", archive);
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
+
+    if (fstat(fd, &sb) < 0 || (size_t)sb.st_size < sizeof(struct pack_header) ||
+        (map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    close(fd);
+
+    if ((p = calloc(1, sizeof(*p))) == NULL)
+    {
+        munmap(map, sb.st_size);
+        return NULL;
+    }
+    p->hdr = map;
+    p->maplen = sb.st_size;
+    p->slots = (const struct pack_slot *)(p->hdr + 1);
+    p->names = (const char *)map + p->hdr->names;
+
+    /* the slots must be a power of 2 and everything must be inside the map */
+    if (memcmp(p->hdr->magic, PACK_MAGIC, 8) != 0 || p->hdr->nslots == 0 ||
+        (p->hdr->nslots & (p->hdr->nslots - 1)) != 0 ||
+        sizeof(struct pack_header) + (uint64_t)p->hdr->nslots * sizeof(struct pack_slot) > p->hdr->names ||
+        p->hdr->names > p->maplen)
+    {
+        pack_close(p);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* lookups jump around the index: no readahead */
+    madvise(map, p->maplen, MADV_RANDOM);
+
+    if ((p->blobfd = malloc(p->hdr->nblobs * sizeof(int) + 1)) == NULL)
+    {
+        pack_close(p);
+        return NULL;
+    }
+    for (i = 0; i < p->hdr->nblobs; i++)
+        p->blobfd[i] = -1;
+    for (i = 0; i < p->hdr->nblobs; i++)
+    {
+        snprintf(path, sizeof(path), "%s.%u.blob", archive, i);
+        if ((p->blobfd[i] = open(path, O_RDONLY)) < 0)
+        {
+            pack_close(p);
+            return NULL;
+        }
+    }
+
+    return p;
+}
+
+struct pack *Pack_open(const char *archive)
+{
+    struct pack *p;
+
+    if ((p = pack_open(archive)) == NULL)
+        err_sys("(%s) error - cannot open the packed archive %s", prog_name, archive);
+
+    return p;
+}
+
+/* find "name": 0 and its position in *e, -1 if not in the archive */
+int pack_lookup(const struct pack *p, const char *name, struct pack_entry *e)
+{
+    size_t len = strlen(name);
+    uint64_t h = pack_hash(name, len);
+    uint32_t mask = p->hdr->nslots - 1, i;
+    const struct pack_slot *s;
+
+    for (i = h & mask;; i = (i + 1) & mask)
+    {
+        s = &p->slots[i];
+        if (s->namelen == 0)
+            return -1;
+        if (s->hash == h && s->namelen == len && s->name + len <= p->maplen - p->hdr->names &&
+            memcmp(p->names + s->name, name, len) == 0 && s->blob < p->hdr->nblobs)
+        {
+            e->fd = p->blobfd[s->blob];
+            e->offset = s->offset;
+            e->length = s->length;
+            e->mtime = s->mtime;
+            return 0;
+        }
+    }
+}
+
+void pack_close(struct pack *p)
+{
+    uint32_t i;
+
+    if (p->blobfd != NULL)
+        for (i = 0; i < p->hdr->nblobs; i++)
+            if (p->blobfd[i] >= 0)
+                close(p->blobfd[i]);
+    free(p->blobfd);
+    munmap(p->hdr, p->maplen);
+    free(p);
+}
+
+/* nftw() callback of pack_build(): remember the regular files */
+static int build_entry(const char *path, const struct stat *sb, int type, struct FTW *ftwbuf)
+{
+    if (type != FTW_F || !S_ISREG(sb->st_mode))
+        return 0;
+
+    /* the protocol has 32 bit sizes, the index 16 bit names */
+    if (sb->st_size > UINT32_MAX || strlen(path + build_base) > UINT16_MAX)
+    {
+        err_msg("(%s) warning - %s cannot be packed, skipped", prog_name, path);
+        return 0;
+    }
+
+    if (build_nfiles == build_cap)
+    {
+        build_cap = build_cap ? build_cap * 2 : 4096;
+        if ((build_files = realloc(build_files, build_cap * sizeof(*build_files))) == NULL)
+            err_quit("(%s) error - out of memory", prog_name);
+    }
+    if ((build_files[build_nfiles].name = strdup(path + build_base)) == NULL)
+        err_quit("(%s) error - out of memory", prog_name);
+    build_files[build_nfiles].length = sb->st_size;
+    build_files[build_nfiles].mtime = sb->st_mtime;
+    build_nfiles++;
+
+    return 0;
+}
+
+/* append "length" bytes of src to blob, in the kernel when possible */
+static int append(int blob, int src, uint32_t length)
+{
+    char buf[65536];
+    ssize_t n;
+    uint32_t left = length;
+
+    while (left > 0 && (n = copy_file_range(src, NULL, blob, NULL, left, 0)) > 0)
+        left -= n;
+    if (left == 0)
+        return 0;
+    if (n < 0 && errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)
+        return -1;
+
+    /* not supported between these two files */
+    while (left > 0 && (n = read(src, buf, left < sizeof(buf) ? left : sizeof(buf))) > 0)
+    {
+        if (writen(blob, buf, n) != n)
+            return -1;
+        left -= n;
+    }
+
+    return left == 0 ? 0 : -1;
+}
+
+/* create the next blob with a temporary name */
+static int blob_create(const char *archive, int n)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s.%d.blob.tmp", archive, n);
+    return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+
+/*******************************************************************************
+ * pack every regular file under "dir" into "archive", named as a GET from "dir"
+ * would name them. The files are written with temporary names and renamed at the
+ * end, the index last: a running server keeps using the archive it opened (the
+ * renames are not atomic as a whole, so do not start one while repacking).
+ * Returns the number of files packed, -1 on error.
+ *******************************************************************************/
+long pack_build(const char *archive, const char *dir)
+{
+    struct pack_header hdr;
+    struct pack_slot *slots;
+    char path[PATH_MAX], final[PATH_MAX];
+    uint64_t offset = 0, nameoff = 0;
+    uint32_t nslots, i;
+    long k;
+    int blob, src, nblobs = 1, fd;
+
+    build_files = NULL;
+    build_nfiles = build_cap = 0;
+    build_base = strlen(dir);
+    while (build_base > 1 && dir[build_base - 1] == '/')
+        build_base--;
+    build_base++; /* the '/' after the directory */
+
+    if (nftw(dir, build_entry, 64, FTW_PHYS) != 0)
+        return -1;
+
+    if ((blob = blob_create(archive, 0)) < 0)
+        return -1;
+
+    for (k = 0; k < build_nfiles; k++)
+    {
+        struct packed *f = &build_files[k];
+
+        /* a big file does not go past the end of a blob, unless it is the first one */
+        if (offset > 0 && offset + f->length > PACK_BLOB_MAX)
+        {
+            close(blob);
+            if (nblobs == UINT16_MAX || (blob = blob_create(archive, nblobs)) < 0)
+                return -1;
+            nblobs++;
+            offset = 0;
+        }
+
+        snprintf(path, sizeof(path), "%.*s/%s", (int)build_base - 1, dir, f->name);
+        if ((src = open(path, O_RDONLY)) < 0 || append(blob, src, f->length) < 0)
+        {
+            err_ret("(%s) error - cannot pack %s", prog_name, path);
+            if (src >= 0)
+                close(src);
+            close(blob);
+            return -1;
+        }
+        close(src);
+
+        f->blob = nblobs - 1;
+        f->offset = offset;
+        offset += f->length;
+    }
+    if (fsync(blob) < 0 || close(blob) < 0)
+        return -1;
+
+    /* load factor at most 1/2, linear probing stays short */
+    for (nslots = 16; nslots < 2 * (uint64_t)build_nfiles; nslots *= 2)
+        ;
+    if ((slots = calloc(nslots, sizeof(*slots))) == NULL)
+        err_quit("(%s) error - out of memory", prog_name);
+
+    for (k = 0; k < build_nfiles; k++)
+    {
+        struct packed *f = &build_files[k];
+        size_t len = strlen(f->name);
+        uint64_t h = pack_hash(f->name, len);
+
+        for (i = h & (nslots - 1); slots[i].namelen != 0; i = (i + 1) & (nslots - 1))
+            ;
+        slots[i].hash = h;
+        slots[i].offset = f->offset;
+        slots[i].length = f->length;
+        slots[i].mtime = f->mtime;
+        slots[i].name = nameoff;
+        slots[i].blob = f->blob;
+        slots[i].namelen = len;
+        nameoff += len;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, PACK_MAGIC, 8);
+    hdr.nblobs = nblobs;
+    hdr.nslots = nslots;
+    hdr.nfiles = build_nfiles;
+    hdr.names = sizeof(hdr) + (uint64_t)nslots * sizeof(*slots);
+
+    snprintf(path, sizeof(path), "%s.idx.tmp", archive);
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 || writen(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        writen(fd, slots, nslots * sizeof(*slots)) != (ssize_t)(nslots * sizeof(*slots)))
+        return -1;
+    for (k = 0; k < build_nfiles; k++)
+        if (writen(fd, build_files[k].name, strlen(build_files[k].name)) < 0)
+            return -1;
+    if (fsync(fd) < 0 || close(fd) < 0)
+        return -1;
+
+    /* blobs first: the new index is never opened with old blobs */
+    for (i = 0; i < (uint32_t)nblobs; i++)
+    {
+        snprintf(path, sizeof(path), "%s.%u.blob.tmp", archive, i);
+        snprintf(final, sizeof(final), "%s.%u.blob", archive, i);
+        if (rename(path, final) < 0)
+            return -1;
+    }
+    snprintf(path, sizeof(path), "%s.idx.tmp", archive);
+    snprintf(final, sizeof(final), "%s.idx", archive);
+    if (rename(path, final) < 0)
+        return -1;
+
+    for (k = 0; k < build_nfiles; k++)
+        free(build_files[k].name);
+    free(build_files);
+    free(slots);
+
+    return build_nfiles;
+}
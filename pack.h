@@ -0,0 +1,79 @@
+/*
+
+ module: pack.h
+
+ purpose: definitions of functions in pack.c
+
+ reference: Luigi Ferrettino (S254300)
+
+ */
+
+#ifndef _PACK_H
+
+#define _PACK_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define PACK_MAGIC "DP1PACK1"      /* first bytes of the index */
+#define PACK_BLOB_MAX (1UL << 30)  /* a new blob is started past this size */
+
+/*************************************************************************
+ * <archive>.idx, mapped in memory (native byte order, as built):
+ *
+ *   | header | nslots slots (open addressing) | names |
+ *
+ * <archive>.<n>.blob holds the contents, one after the other.
+ *************************************************************************/
+struct pack_header
+{
+    char magic[8];
+    uint32_t nblobs;   /* <archive>.0.blob ... <archive>.<nblobs-1>.blob */
+    uint32_t nslots;   /* power of 2, at least twice the files */
+    uint64_t nfiles;
+    uint64_t names;    /* offset of the names in the index */
+};
+
+struct pack_slot
+{
+    uint64_t hash;    /* pack_hash() of the name */
+    uint64_t offset;  /* of the content in the blob */
+    uint32_t length;
+    uint32_t mtime;
+    uint32_t name;    /* offset of the name in the names */
+    uint16_t blob;
+    uint16_t namelen; /* 0 for an empty slot */
+};
+
+/* an archive open for lookups */
+struct pack
+{
+    struct pack_header *hdr;
+    size_t maplen;
+    const struct pack_slot *slots;
+    const char *names;
+    int *blobfd;
+};
+
+/* result of a lookup: the content is "length" bytes at "offset" of "fd" */
+struct pack_entry
+{
+    int fd;
+    off_t offset;
+    uint32_t length;
+    uint32_t mtime;
+};
+
+uint64_t pack_hash(const char *name, size_t len);
+
+struct pack *pack_open(const char *archive);
+
+struct pack *Pack_open(const char *archive);
+
+int pack_lookup(const struct pack *p, const char *name, struct pack_entry *e);
+
+void pack_close(struct pack *p);
+
+long pack_build(const char *archive, const char *dir);
+
+#endif
@@ -0,0 +1,44 @@
+/*********************************************************************************************************************
+  *                                                   PACKER
+  *
+  * Builds a packed archive (see pack.h) out of a directory: every regular file under it goes, one after the other,
+  * in big blob files, and its name (the one a client would use in a GET with that directory as working directory)
+  * in a hash index. server2 -p <archive> maps the index and answers the GETs of those names with sendfile() from
+  * the blobs, with no open() or stat() per file and no inode per file.
+  *
+  *
+  * [ author: Luigi Ferrettino (S254300) ]
+  *********************************************************************************************************************/
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "../errlib.h"
+#include "../sockwrap.h"
+#include "../pack.h"
+
+/* GLOBAL VARIABLES */
+char *prog_name;
+
+int main(int argc, char *argv[])
+{
+  struct timespec t1, t2;
+  long n;
+
+  /* store the program name from argv */
+  prog_name = argv[0];
+
+  if (argc != 3)
+    err_quit("Usage: %s <archive> <directory>", prog_name);
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  if ((n = pack_build(argv[1], argv[2])) < 0)
+    err_sys("(%s) error - cannot pack %s into %s", prog_name, argv[2], argv[1]);
+
+  clock_gettime(CLOCK_MONOTONIC, &t2);
+
+  printf("%ld files packed into %s in %.2f s\n", n, argv[1], (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9);
+
+  exit(0);
+}
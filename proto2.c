@@ -0,0 +1,47 @@
+/*
+
+module: proto2.c
+
+purpose: encoding and decoding of the frames of protocol 2
+
+author: Luigi Ferrettino (S254300)
+
+*/
+
+#include <string.h>
+#include <endian.h>
+
+#include "proto2.h"
+
+/* write the header of f in the first V2_HDRLEN bytes of hdr */
+void v2_pack(unsigned char *hdr, const struct v2_frame *f)
+{
+    uint32_t id = htobe32(f->id);
+    uint64_t length = htobe64(f->length);
+
+    hdr[0] = V2_MAGIC;
+    hdr[1] = V2_VERSION;
+    hdr[2] = f->opcode;
+    hdr[3] = f->flags;
+    memcpy(hdr + 4, &id, 4);
+    memcpy(hdr + 8, &length, 8);
+}
+
+/* decode a header at fixed offsets; -1 if it is not a frame of this version */
+int v2_unpack(const unsigned char *hdr, struct v2_frame *f)
+{
+    uint32_t id;
+    uint64_t length;
+
+    if (hdr[0] != V2_MAGIC || hdr[1] != V2_VERSION)
+        return -1;
+
+    f->opcode = hdr[2];
+    f->flags = hdr[3];
+    memcpy(&id, hdr + 4, 4);
+    memcpy(&length, hdr + 8, 8);
+    f->id = be32toh(id);
+    f->length = be64toh(length);
+
+    return 0;
+}
@@ -0,0 +1,77 @@
+/*
+
+ module: proto2.h
+
+ purpose: definitions of functions in proto2.c
+
+ reference: Luigi Ferrettino (S254300)
+
+ */
+
+#ifndef _PROTO2_H
+
+#define _PROTO2_H
+
+#include <stdint.h>
+
+/***********************************************************************************
+ * protocol 2: every message is a frame, a fixed header followed by "length" bytes
+ *
+ *   |M|V|O|F|I1|I2|I3|I4|L1|L2|L3|L4|L5|L6|L7|L8|...payload...|
+ *
+ * M is V2_MAGIC (no command of protocol 1 starts with it), V is the version, O the
+ * opcode, F the flags, I the request id (echoed in the response), L the length of
+ * the payload; all in network byte order. A connection starts with protocol 1 and
+ * switches when the client sends HELLO and the server answers with HELLO.
+ ***********************************************************************************/
+#define V2_MAGIC 0xD0
+#define V2_VERSION 2
+#define V2_HDRLEN 16
+
+/* opcodes */
+#define V2_HELLO 1 /* both ways, payload: version (4 bytes) and capabilities (4 bytes) */
+#define V2_GET 2   /* client, payload: the name of the file */
+#define V2_FILE 3  /* server, payload: timestamp (8 bytes) and the content of the file */
+#define V2_ERROR 4 /* server, payload: error code (4 bytes); the connection goes on */
+#define V2_QUIT 5  /* client, no payload: the server closes the connection */
+#define V2_DATA 6  /* server, with V2_CAP_MUX: payload a chunk of the content of the file of that id */
+
+/* error codes of V2_ERROR */
+#define V2_ENOENT 1 /* the file does not exist (or is not readable) */
+#define V2_EINVAL 2 /* malformed request, unknown opcode or flags */
+
+/* capabilities announced in HELLO: only the ones set by both sides can be used */
+#define V2_CAP_MUX 0x1 /* multiplexed responses, see below */
+#define V2_CAPS V2_CAP_MUX
+
+/*****************************************************************************
+ * V2_CAP_MUX: many GETs in flight on the connection, their responses
+ * interleaved. FILE carries only timestamp and dimension (8 bytes each), the
+ * content follows in DATA frames of at most V2_CHUNK bytes with the same id;
+ * files in flight get the connection in turns of V2_WEIGHT(flags of the GET)
+ * chunks. The next turn goes to the most urgent file (V2_URGENCY(flags)),
+ * then to the one with the least left to send, so a small file does not wait
+ * for a big one sent before it; a file waiting long enough gets a turn anyway.
+ * The server reads new requests only while less than V2_MAX_STREAMS are in
+ * flight.
+ *****************************************************************************/
+#define V2_CHUNK 65536
+#define V2_MAX_STREAMS 32
+#define V2_WEIGHT_MASK 0x0f                           /* flags of a GET: weight - 1 */
+#define V2_WEIGHT(flags) (((flags) & V2_WEIGHT_MASK) + 1) /* chunks per turn */
+#define V2_URGENCY_MASK 0x30                              /* flags of a GET: urgency, 0 (default) to 3 */
+#define V2_URGENCY(flags) (((flags) & V2_URGENCY_MASK) >> 4)
+
+struct v2_frame
+{
+    uint8_t opcode;
+    uint8_t flags;
+    uint32_t id;
+    uint64_t length;
+};
+
+void v2_pack(unsigned char *hdr, const struct v2_frame *f);
+
+int v2_unpack(const unsigned char *hdr, struct v2_frame *f);
+
+#endif
@@ -0,0 +1,496 @@
+/*********************************************************************************************************************
+  *                                                   CACHING PROXY
+  *
+  * Speaks the same GET/QUIT protocol of server1 and server2 (see server2_main.c) and serves the files from a local
+  * cache directory, with sendfile() as the servers do. A file missing in the cache is requested to the upstream server
+  * with the client functions of recvfile.c and streamed to the requester while it is being written to the cache:
+  *
+  *   name.part   content received so far, renamed to "name" (with the upstream timestamp) once complete
+  *   name.lock   held (flock) by the process fetching "name"; it contains the response of the upstream server
+  *
+  * A process that finds the lock already held does not go upstream: it reads the response from the lock file and
+  * follows name.part as it grows, so concurrent misses of the same file cost a single upstream transfer. Locks are
+  * released by the kernel when a process dies, so a crashed fetch is simply repeated by the next request.
+  *
+  * Messages, timing and STATS are the ones of server2, -j included.
+  *
+  *
+  * [ author: Luigi Ferrettino (S254300) ]
+  *********************************************************************************************************************/
+
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include "../serve.h"
+#include "../recvfile.h"
+
+#define UPSTREAM_TIMEOUT 6000 /* ms without data from the upstream server (same timeout of client1) */
+#define FOLLOW_POLL 5         /* ms between two looks at a file fetched by another process */
+#define CHUNK 65536           /* bytes read from upstream at once */
+
+/* GLOBAL VARIABLES */
+char *prog_name;
+static char *up_host, *up_port; /* upstream server */
+static int upfd = -1;           /* upstream connection of this child, kept across the requests */
+
+/* PROTOTYPES */
+void sig_chld(int signo);
+int proxy_miss(struct conn *c, const char *filename);
+int fetch(struct conn *c, const char *filename, const char *partpath, const char *lockpath, int lockfd);
+int follow(struct conn *c, const char *filename, const char *partpath, int lockfd);
+int upstream_get(const char *filename, char *buf, uint32_t *dim, uint32_t *timestamp);
+int push(struct conn *c, int fd, off_t *sent, off_t avail);
+int push_all(struct conn *c, int fd, off_t *sent, off_t dim);
+int mkparents(const char *path);
+
+int main(int argc, char *argv[])
+{
+  int listenfd, s;              /* sockets */
+  struct sockaddr_storage ss;   /* struct for sockaddr opaque storage */
+  socklen_t len;                /* sizeof the sockaddr */
+  char ipstr[INET6_ADDRSTRLEN]; /* used to store the client network address */
+  pid_t childpid;               /* pid of child process */
+  char *cache_dir = ".";        /* where the files are cached */
+  int opt;
+  int log_format = LOG_FMT_TEXT; /* of the messages */
+
+  /* for errlib to know the program name */
+  prog_name = argv[0];
+
+  /* check arguments */
+  while ((opt = getopt(argc, argv, "c:j")) != -1)
+  {
+    switch (opt)
+    {
+    case 'c':
+      cache_dir = optarg;
+      break;
+    case 'j':
+      log_format = LOG_FMT_JSON;
+      break;
+    default:
+      err_quit("Usage: %s [-c <cache directory>] [-j] <upstream address> <upstream port> <port>", prog_name);
+    }
+  }
+  if (optind != argc - 3)
+    err_quit("Usage: %s [-c <cache directory>] [-j] <upstream address> <upstream port> <port>", prog_name);
+
+  /* messages of serve() are written out by a separate process, not on the way of the transfers */
+  Log_init(log_format);
+
+  up_host = argv[optind];
+  up_port = argv[optind + 1];
+
+  /* the cache is the working directory, as the files are for the servers */
+  if (chdir(cache_dir) < 0)
+    err_sys("(%s) error - cannot use %s as cache directory", prog_name, cache_dir);
+
+  len = sizeof(ss);
+  listenfd = tcp_listen(NULL, argv[optind + 2], &len);
+
+  /* files missing in the cache are handled here */
+  serve_miss = proxy_miss;
+
+  /* signal handler to avoid zombie processes */
+  Signal(SIGCHLD, sig_chld);
+
+  /* a broken connection (client or upstream) is handled in the code */
+  Signal(SIGPIPE, SIG_IGN);
+
+  /* counters answered to STATS, shared with the children */
+  Stats_init();
+
+  /* per-phase timing of the GETs, shared with the children and printed on SIGUSR1 */
+  Hist_init();
+  Signal(SIGUSR1, hist_sig);
+
+  printf("ready, upstream %s %s\n\n", up_host, up_port);
+
+  printf("PID\tMESSAGE\n");
+  fflush(stdout);
+
+  for (;;)
+  {
+    len = sizeof(ss);
+    s = Accept(listenfd, (SA *)&ss, &len);
+
+    /* get the IP address of the client */
+    Getpeername(s, (SA *)&ss, &len);
+
+    if (ss.ss_family == AF_INET6)
+    {
+      struct sockaddr_in6 *s = (struct sockaddr_in6 *)&ss;
+      inet_ntop(AF_INET6, &s->sin6_addr, ipstr, sizeof(ipstr));
+    }
+    else
+    {
+      err_msg("PARENT\t(%s) error - client socket family not valid, closing...\n", prog_name);
+      Close(s);
+      continue;
+    }
+
+    /* fork a new process to serve the client on the new connection */
+    if ((childpid = fork()) < 0)
+    {
+      err_msg("(%s) error - fork() failed", prog_name);
+      Close(s);
+    }
+    else if (childpid > 0)
+    {
+      Close(s);
+    }
+    else
+    {
+      Close(listenfd);
+
+      #ifdef __linux__
+      prctl(PR_SET_PDEATHSIG, SIGHUP);
+      #endif
+
+      serve(s, ipstr);
+
+      /* the upstream connection lives as long as the client one */
+      if (upfd >= 0)
+      {
+        writen(upfd, "QUIT\r\n", 6);
+        close(upfd);
+      }
+      exit(0);
+    }
+  }
+
+  exit(0);
+}
+
+void sig_chld(int signo)
+{
+  pid_t pid;
+  int stat;
+
+  while ((pid = waitpid(-1, &stat, WNOHANG)) > 0)
+  {
+    /* child terminated; it is not secure to use printf(s) here. Its connection is over, even if killed */
+    stats_reap(pid);
+  }
+  return;
+}
+
+/***************************************************************************
+ * serve_miss() hook of serve(): fetch the file from upstream, or follow the
+ * process that is already fetching it; see the header of this file.
+ ***************************************************************************/
+int proxy_miss(struct conn *c, const char *filename)
+{
+  char partpath[PATH_MAX], lockpath[PATH_MAX];
+  int lockfd, r, flags;
+
+  if (snprintf(partpath, sizeof(partpath), "%s.part", filename) >= (int)sizeof(partpath) ||
+      snprintf(lockpath, sizeof(lockpath), "%s.lock", filename) >= (int)sizeof(lockpath))
+    return MISS_ERR;
+
+  if (mkparents(filename) < 0 || (lockfd = open(lockpath, O_RDWR | O_CREAT, 0644)) < 0)
+  {
+    err_ret("%d\t%s - (%s) error - cannot create the cache entry of {%s}", c->pid, c->host, prog_name, filename);
+    return MISS_ERR;
+  }
+
+  /* the cache file is sent while it grows: never block on the client */
+  flags = fcntl(c->fd, F_GETFL, 0);
+  fcntl(c->fd, F_SETFL, flags | O_NONBLOCK);
+
+  if (flock(lockfd, LOCK_EX | LOCK_NB) == 0)
+  {
+    /* the previous fetch may have completed right after access() in serve() */
+    if (access(filename, R_OK) == 0)
+    {
+      unlink(lockpath);
+      r = MISS_CACHED;
+    }
+    else
+      r = fetch(c, filename, partpath, lockpath, lockfd);
+  }
+  else
+    r = follow(c, filename, partpath, lockfd);
+
+  fcntl(c->fd, F_SETFL, flags);
+  close(lockfd);
+
+  return r;
+}
+
+/********************************************************************************
+ * this process holds the lock: get the file from upstream into name.part, sending
+ * it to the client at the pace of the client. If the client goes away the fetch
+ * is completed anyway, other requests may be following it.
+ ********************************************************************************/
+int fetch(struct conn *c, const char *filename, const char *partpath, const char *lockpath, int lockfd)
+{
+  char buf[CHUNK], hdr[13];
+  uint32_t dim, timestamp, n32;
+  off_t received = 0, sent = 0;
+  struct pollfd pfd[2];
+  struct timespec times[2];
+  int partfd, r, client = 1, n;
+  ssize_t len;
+
+  ftruncate(lockfd, 0);
+
+  if ((partfd = open(partpath, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+  {
+    err_ret("%d\t%s - (%s) error - cannot create %s", c->pid, c->host, prog_name, partpath);
+    unlink(lockpath);
+    return MISS_ERR;
+  }
+
+  if ((r = upstream_get(filename, buf, &dim, &timestamp)) != GETFILE_OK)
+  {
+    /* the followers read the outcome from the lock file */
+    if (r == GETFILE_ERR)
+      pwrite(lockfd, "-ERR\r\n", 6, 0);
+    unlink(partpath);
+    unlink(lockpath);
+    close(partfd);
+    return MISS_ERR;
+  }
+
+  log_msg(c->pid, c->host, "file {%s} not cached, fetching %lu bytes from upstream.", filename,
+          (unsigned long)dim);
+
+  memcpy(hdr, "+OK\r\n", 5);
+  n32 = htonl(dim);
+  memcpy(hdr + 5, &n32, 4);
+  n32 = htonl(timestamp);
+  memcpy(hdr + 9, &n32, 4);
+  pwrite(lockfd, hdr, 13, 0);
+
+  if (sendn(c->fd, hdr, 13, dim > 0 ? MSG_MORE : 0) != 13)
+    client = 0;
+
+  tw_add(&c->tw, &c->progress, tw_now_ms() + SEND_TIMEOUT);
+
+  while (received < dim)
+  {
+    pfd[0].fd = upfd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = c->fd;
+    pfd[1].events = POLLOUT;
+
+    if ((n = poll(pfd, client && sent < received ? 2 : 1, UPSTREAM_TIMEOUT)) < 0 && INTERRUPTED_BY_SIGNAL)
+      continue;
+    if (n <= 0)
+      break; /* upstream stalled */
+
+    if (pfd[0].revents != 0)
+    {
+      if ((len = read(upfd, buf, dim - received < CHUNK ? dim - received : CHUNK)) < 0 && INTERRUPTED_BY_SIGNAL)
+        continue;
+      if (len <= 0 || writen(partfd, buf, len) != len)
+        break;
+      received += len;
+    }
+
+    /* a client that does not keep up with MIN_SEND_RATE is dropped, the fetch goes on */
+    if (client && sent < received)
+    {
+      tw_advance(&c->tw, tw_now_ms());
+      if (c->expired != NULL || push(c, partfd, &sent, received) < 0)
+        client = 0;
+    }
+  }
+
+  if (received < dim)
+  {
+    err_msg("%d\t%s - (%s) error - upstream transfer of {%s} interrupted", c->pid, c->host, prog_name, filename);
+    close(upfd);
+    upfd = -1;
+    unlink(partpath);
+    unlink(lockpath);
+    close(partfd);
+    tw_del(&c->tw, &c->progress);
+    return MISS_BROKEN;
+  }
+
+  /* same timestamp of the upstream copy, serve() sends the one of the cached file */
+  times[0].tv_sec = times[1].tv_sec = timestamp;
+  times[0].tv_nsec = times[1].tv_nsec = 0;
+  futimens(partfd, times);
+
+  /* publish the file, then release the followers (they keep name.part open) */
+  if (rename(partpath, filename) < 0)
+  {
+    err_ret("%d\t%s - (%s) error - cannot store {%s} in the cache", c->pid, c->host, prog_name, filename);
+    unlink(partpath);
+  }
+  unlink(lockpath);
+  flock(lockfd, LOCK_UN);
+
+  r = client && push_all(c, partfd, &sent, dim) == 0 ? MISS_SENT : MISS_BROKEN;
+  close(partfd);
+  tw_del(&c->tw, &c->progress);
+
+  return r;
+}
+
+/******************************************************************************
+ * another process holds the lock: wait for the upstream response in the lock
+ * file, then send name.part as it grows, until it is complete or the fetching
+ * process releases the lock without completing it.
+ ******************************************************************************/
+int follow(struct conn *c, const char *filename, const char *partpath, int lockfd)
+{
+  char hdr[13];
+  uint32_t dim;
+  off_t sent = 0;
+  struct stat sb;
+  int partfd, done, r;
+  ssize_t n;
+
+  for (;;)
+  {
+    n = pread(lockfd, hdr, 13, 0);
+    if (n >= 6 && strncmp(hdr, "-ERR\r\n", 6) == 0)
+      return MISS_ERR;
+    if (n == 13)
+      break;
+
+    /* released without a response: the fetch failed, or the file is in the cache now */
+    if (flock(lockfd, LOCK_SH | LOCK_NB) == 0)
+      return access(filename, R_OK) == 0 ? MISS_CACHED : MISS_ERR;
+
+    usleep(FOLLOW_POLL * 1000);
+  }
+
+  /* the part file has been renamed if the fetch completed meanwhile */
+  if ((partfd = open(partpath, O_RDONLY)) < 0 && (partfd = open(filename, O_RDONLY)) < 0)
+    return MISS_ERR;
+
+  log_msg(c->pid, c->host, "file {%s} being fetched by another process, following it.", filename);
+
+  memcpy(&dim, hdr + 5, 4);
+  dim = ntohl(dim);
+
+  if (sendn(c->fd, hdr, 13, dim > 0 ? MSG_MORE : 0) != 13)
+  {
+    close(partfd);
+    return MISS_BROKEN;
+  }
+
+  tw_add(&c->tw, &c->progress, tw_now_ms() + SEND_TIMEOUT);
+
+  r = MISS_BROKEN;
+  for (;;)
+  {
+    /* look at the lock before the size, so a complete file is never mistaken for an interrupted one */
+    done = flock(lockfd, LOCK_SH | LOCK_NB) == 0;
+
+    if (fstat(partfd, &sb) < 0)
+      break;
+
+    if (sb.st_size >= dim)
+    {
+      r = push_all(c, partfd, &sent, dim) == 0 ? MISS_SENT : MISS_BROKEN;
+      break;
+    }
+    if (done)
+      break; /* the fetch was interrupted */
+
+    tw_advance(&c->tw, tw_now_ms());
+    if (c->expired != NULL || push(c, partfd, &sent, sb.st_size) < 0)
+      break;
+
+    usleep(FOLLOW_POLL * 1000);
+  }
+
+  close(partfd);
+  tw_del(&c->tw, &c->progress);
+
+  return r;
+}
+
+/* GET on the upstream connection, opened (or opened again, if it was found broken) when needed */
+int upstream_get(const char *filename, char *buf, uint32_t *dim, uint32_t *timestamp)
+{
+  struct timeval tval;
+  int attempt, reused, r = GETFILE_BROKEN;
+
+  for (attempt = 0; attempt < 2; attempt++)
+  {
+    if (!(reused = upfd >= 0))
+    {
+      if ((upfd = tcp_connect_race(up_host, up_port, NULL)) < 0)
+      {
+        err_ret("(%s) error - connect to %s %s failed", prog_name, up_host, up_port);
+        return GETFILE_BROKEN;
+      }
+
+      tval.tv_sec = UPSTREAM_TIMEOUT / 1000;
+      tval.tv_usec = 0;
+      setsockopt(upfd, SOL_SOCKET, SO_RCVTIMEO, &tval, sizeof(tval));
+    }
+
+    if ((r = sendget(upfd, filename, buf)) == GETFILE_OK && (r = recvhdr(upfd, buf, dim, timestamp)) == GETFILE_OK)
+      return GETFILE_OK;
+
+    /* after -ERR the server closes the connection, after a failure the stream is out of sync */
+    close(upfd);
+    upfd = -1;
+    if (r == GETFILE_ERR || !reused)
+      break;
+  }
+
+  return r;
+}
+
+/* send the bytes [*sent, avail) of fd that the client can take now; -1 if the client is gone */
+int push(struct conn *c, int fd, off_t *sent, off_t avail)
+{
+  ssize_t n;
+
+  while (*sent < avail)
+  {
+    if ((n = sendfile(c->fd, fd, sent, avail - *sent)) > 0)
+      tw_add(&c->tw, &c->progress, tw_now_ms() + SEND_TIMEOUT);
+    else if (n < 0 && (errno == EAGAIN || INTERRUPTED_BY_SIGNAL))
+      return 0;
+    else
+      return -1;
+  }
+
+  return 0;
+}
+
+/* send the rest of a complete file, under the send progress deadline */
+int push_all(struct conn *c, int fd, off_t *sent, off_t dim)
+{
+  while (*sent < dim)
+  {
+    if (push(c, fd, sent, dim) < 0)
+      return -1;
+    if (*sent < dim && conn_wait(c, POLLOUT) <= 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+/* create the directories of a cached file in a subdirectory */
+int mkparents(const char *path)
+{
+  char dir[PATH_MAX], *p;
+
+  snprintf(dir, sizeof(dir), "%s", path);
+  for (p = strchr(dir, '/'); p != NULL; p = strchr(p + 1, '/'))
+  {
+    *p = '\0';
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+      return -1;
+    *p = '/';
+  }
+
+  return 0;
+}
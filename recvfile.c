@@ -8,6 +8,14 @@ author: Luigi Ferrettino (S254300)
 
 */
 
+#define _GNU_SOURCE /* copy_file_range() */
+
+#include <fcntl.h>
+#include <endian.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h> /* FICLONE */
+
 #include "errlib.h"
 #include "recvfile.h"
 
@@ -102,3 +110,305 @@ ssize_t Recvfile(int s, char *filename, uint32_t dim, char *buf, uint32_t timest
 
   return received;
 }
+
+/*************************************************************************
+ * non-fatal building blocks for programs that keep the connection (and
+ * themselves) alive across failures: sendget() sends "GET filename",
+ * recvget() reads the response and stores the content in "outfd". The
+ * reads never go past the end of the file, so requests can be pipelined.
+ *************************************************************************/
+int sendget(int s, const char *filename, char *buf)
+{
+  if (strlen(filename) > MAXBUFLEN - 7)
+    return GETFILE_ERR;
+
+  snprintf(buf, MAXBUFLEN, "GET %s\r\n", filename);
+  if (writen(s, buf, strlen(buf)) < 0)
+    return GETFILE_BROKEN;
+
+  return GETFILE_OK;
+}
+
+/* PUT: command, dimension and timestamp, then the content of fd with sendfile(); the reply is read with recvhdr() */
+int sendput(int s, const char *filename, int fd, char *buf, uint32_t dim, uint32_t timestamp)
+{
+  off_t offset = 0;
+  ssize_t n;
+  size_t len;
+  uint32_t n32;
+
+  if (strlen(filename) > MAXBUFLEN - 15)
+    return GETFILE_ERR;
+
+  len = snprintf(buf, MAXBUFLEN, "PUT %s\r\n", filename);
+  n32 = htonl(dim);
+  memcpy(buf + len, &n32, 4);
+  n32 = htonl(timestamp);
+  memcpy(buf + len + 4, &n32, 4);
+  len += 8;
+
+  /* MSG_MORE: the command leaves together with the first bytes of the content */
+  if (sendn(s, buf, len, MSG_MORE) != len)
+    return GETFILE_BROKEN;
+
+  while (offset < dim)
+  {
+    if ((n = sendfile(s, fd, &offset, dim - offset)) < 0 && INTERRUPTED_BY_SIGNAL)
+      continue;
+    if (n <= 0)
+      return GETFILE_BROKEN;
+  }
+
+  return GETFILE_OK;
+}
+
+/* only the "+OK" (or "-ERR") part of the response, for callers that read the content by themselves */
+int recvhdr(int s, char *buf, uint32_t *dim, uint32_t *timestamp)
+{
+  if (readn(s, buf, 5) != 5)
+    return GETFILE_BROKEN;
+
+  if (strncmp(buf, "-ERR\r", 5) == 0)
+  {
+    readn(s, buf, 1); /* the '\n' */
+    return GETFILE_ERR;
+  }
+  if (strncmp(buf, "+OK\r\n", 5) != 0)
+    return GETFILE_BROKEN;
+
+  if (readn(s, dim, 4) != 4 || readn(s, timestamp, 4) != 4)
+    return GETFILE_BROKEN;
+  *dim = ntohl(*dim);
+  *timestamp = ntohl(*timestamp);
+
+  return GETFILE_OK;
+}
+
+int recvget(int s, int outfd, char *buf, uint32_t *dim, uint32_t *timestamp)
+{
+  ssize_t len;
+  uint32_t remain_data;
+  int r;
+
+  if ((r = recvhdr(s, buf, dim, timestamp)) != GETFILE_OK)
+    return r;
+
+  for (remain_data = *dim; remain_data > 0; remain_data -= len)
+  {
+    if ((len = read(s, buf, remain_data < MAXBUFLEN ? remain_data : MAXBUFLEN)) < 0 && INTERRUPTED_BY_SIGNAL)
+    {
+      len = 0;
+      continue;
+    }
+    if (len <= 0 || writen(outfd, buf, len) != len)
+      return GETFILE_BROKEN;
+  }
+
+  return GETFILE_OK;
+}
+
+/*****************************************************************************
+ * KEEP on a connection just opened: GETFILE_OK if the server accepted it, so
+ * a "-ERR" is followed by a 4 byte error code (V2_ENOENT, V2_EINVAL) and the
+ * connection goes on; GETFILE_ERR if it does not know it (and closed).
+ *****************************************************************************/
+int sendkeep(int s)
+{
+  char buf[6];
+
+  if (writen(s, "KEEP\r\n", 6) != 6 || readn(s, buf, 5) != 5)
+    return GETFILE_BROKEN;
+
+  if (strncmp(buf, "-ERR\r", 5) == 0)
+  {
+    readn(s, buf, 1); /* the '\n' */
+    return GETFILE_ERR;
+  }
+
+  return strncmp(buf, "+OK\r\n", 5) == 0 ? GETFILE_OK : GETFILE_BROKEN;
+}
+
+/**************************************************************************
+ * protocol 2 (see proto2.h): HELLO on a connection just opened, *caps gets
+ * the capabilities both sides support. GETFILE_ERR if the server speaks
+ * protocol 1 only: it replied "-ERR" and closed the connection.
+ **************************************************************************/
+int hello2(int s, uint32_t *caps)
+{
+  unsigned char frame[V2_HDRLEN + 8];
+  struct v2_frame f;
+  uint32_t n32;
+
+  f.opcode = V2_HELLO;
+  f.flags = 0;
+  f.id = 0;
+  f.length = 8;
+  v2_pack(frame, &f);
+  n32 = htonl(V2_VERSION);
+  memcpy(frame + V2_HDRLEN, &n32, 4);
+  n32 = htonl(V2_CAPS);
+  memcpy(frame + V2_HDRLEN + 4, &n32, 4);
+
+  if (writen(s, frame, sizeof(frame)) != sizeof(frame) || readn(s, frame, 5) != 5)
+    return GETFILE_BROKEN;
+  if (memcmp(frame, "-ERR\r", 5) == 0)
+    return GETFILE_ERR;
+
+  if (readn(s, frame + 5, sizeof(frame) - 5) != sizeof(frame) - 5 || v2_unpack(frame, &f) < 0 ||
+      f.opcode != V2_HELLO || f.length != 8)
+    return GETFILE_BROKEN;
+  memcpy(&n32, frame + V2_HDRLEN + 4, 4);
+  *caps = ntohl(n32);
+
+  return GETFILE_OK;
+}
+
+/* GET frame of protocol 2 (flags: see V2_CAP_MUX), the response carries the same id */
+int sendget2(int s, uint32_t id, uint8_t flags, const char *filename)
+{
+  unsigned char frame[V2_HDRLEN];
+  struct v2_frame f;
+  size_t len = strlen(filename);
+
+  f.opcode = V2_GET;
+  f.flags = flags;
+  f.id = id;
+  f.length = len;
+  v2_pack(frame, &f);
+
+  if (sendn(s, frame, V2_HDRLEN, MSG_MORE) != V2_HDRLEN || writen(s, filename, len) != len)
+    return GETFILE_BROKEN;
+
+  return GETFILE_OK;
+}
+
+/*****************************************************************************
+ * response to a GET of protocol 2, up to the content: GETFILE_OK with its
+ * dimension and timestamp, GETFILE_ERR with the error code in *dim (the
+ * connection goes on), GETFILE_BROKEN. The request id goes in *id.
+ *****************************************************************************/
+int recvhdr2(int s, uint32_t *id, uint64_t *dim, uint32_t *timestamp)
+{
+  unsigned char frame[V2_HDRLEN + 8];
+  struct v2_frame f;
+  uint64_t mtime;
+  uint32_t code;
+
+  if (readn(s, frame, V2_HDRLEN) != V2_HDRLEN || v2_unpack(frame, &f) < 0)
+    return GETFILE_BROKEN;
+  *id = f.id;
+
+  if (f.opcode == V2_ERROR && f.length == 4)
+  {
+    if (readn(s, &code, 4) != 4)
+      return GETFILE_BROKEN;
+    *dim = ntohl(code);
+    return GETFILE_ERR;
+  }
+  if (f.opcode != V2_FILE || f.length < 8 || readn(s, &mtime, 8) != 8)
+    return GETFILE_BROKEN;
+
+  *dim = f.length - 8;
+  *timestamp = be64toh(mtime);
+
+  return GETFILE_OK;
+}
+
+int sendquit2(int s)
+{
+  unsigned char frame[V2_HDRLEN];
+  struct v2_frame f;
+
+  f.opcode = V2_QUIT;
+  f.flags = 0;
+  f.id = 0;
+  f.length = 0;
+  v2_pack(frame, &f);
+
+  return writen(s, frame, V2_HDRLEN) == V2_HDRLEN ? GETFILE_OK : GETFILE_BROKEN;
+}
+
+int getfile(int s, const char *filename, int outfd, char *buf, uint32_t *dim, uint32_t *timestamp)
+{
+  int r;
+
+  if ((r = sendget(s, filename, buf)) != GETFILE_OK)
+    return r;
+
+  return recvget(s, outfd, buf, dim, timestamp);
+}
+
+/**************************************************************************
+ * local counterpart of recvfile(): the server passed the open file "fd",
+ * so the content never goes through the socket. The copy is a reflink if
+ * the filesystem supports it, otherwise copy_file_range() (in kernel),
+ * otherwise a plain read/write loop.
+ **************************************************************************/
+ssize_t copyfile(int fd, char *filename, uint32_t dim, uint32_t timestamp)
+{
+  int out;
+  ssize_t n = 0;
+  uint32_t remain_data = dim;
+  loff_t offset = 0;
+  const char *how = "copied";
+  char buf[MAXBUFLEN];
+
+  /* if the filename is a path, delete all the path and replace it with only the filename */
+  if (strstr(filename, "/") != NULL)
+    filename = (strrchr(filename, '/')) + 1;
+
+  if ((out = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+    err_sys("(%s) error - open() failed", prog_name);
+
+#ifdef FICLONE
+  /* same filesystem with shared extents (btrfs, xfs): nothing to copy at all */
+  if (ioctl(out, FICLONE, fd) == 0)
+  {
+    remain_data = 0;
+    how = "reflinked";
+  }
+#endif
+
+  while (remain_data > 0 && (n = copy_file_range(fd, &offset, out, NULL, remain_data, 0)) > 0)
+    remain_data -= n;
+
+  /* copy_file_range() not available for these files, go through user space */
+  if (remain_data > 0 && n < 0)
+  {
+    while (remain_data > 0 && (n = pread(fd, buf, remain_data < MAXBUFLEN ? remain_data : MAXBUFLEN, offset)) > 0)
+    {
+      if (writen(out, buf, n) != n)
+        break;
+      offset += n;
+      remain_data -= n;
+    }
+  }
+
+  close(out);
+
+  if (remain_data == 0)
+  {
+    printf("{%s} %s\n|- bytes: %lu\n|- timestamp: %lu\n", filename, how, (unsigned long)dim, (unsigned long)timestamp);
+    fflush(stdout);
+  }
+
+  return dim - remain_data;
+}
+
+/* uppercase version of copyfile(), same cleanup of Recvfile() for incomplete files */
+ssize_t Copyfile(int fd, char *filename, uint32_t dim, uint32_t timestamp)
+{
+  ssize_t copied;
+
+  if ((copied = copyfile(fd, filename, dim, timestamp)) < dim)
+  {
+    char *name = strrchr(filename, '/') != NULL ? strrchr(filename, '/') + 1 : filename;
+
+    if (remove(name) == 0)
+      err_quit("\n(%s) error - copyfile() failed, corrupted file deleted.", prog_name);
+    else
+      err_quit("\n(%s) error - copyfile() failed, corrupted file not deleted.", prog_name);
+  }
+
+  return copied;
+}
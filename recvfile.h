@@ -30,6 +30,7 @@
 #include <inttypes.h>
 
 #include "sockwrap.h"
+#include "proto2.h"
 
 /***************************************************************************** 
 * after some tests, we can archieve ~300MB/s with a buffer of 2048 bytes 
@@ -38,8 +39,37 @@
 ******************************************************************************/
 #define MAXBUFLEN 2048
 
+/* results of getfile() / recvget() */
+#define GETFILE_OK 0      /* file received */
+#define GETFILE_ERR -1    /* "-ERR" from the server, that closes the connection */
+#define GETFILE_BROKEN -2 /* connection broken or invalid response, the file is incomplete */
+
 ssize_t recvfile(int s, char *filename, uint32_t dim, char *buf, uint32_t timestamp);
 
 ssize_t Recvfile(int s, char *filename, uint32_t dim, char *buf, uint32_t timestamp);
 
+int sendget(int s, const char *filename, char *buf);
+
+int sendput(int s, const char *filename, int fd, char *buf, uint32_t dim, uint32_t timestamp);
+
+int recvhdr(int s, char *buf, uint32_t *dim, uint32_t *timestamp);
+
+int recvget(int s, int outfd, char *buf, uint32_t *dim, uint32_t *timestamp);
+
+int getfile(int s, const char *filename, int outfd, char *buf, uint32_t *dim, uint32_t *timestamp);
+
+int sendkeep(int s);
+
+int hello2(int s, uint32_t *caps);
+
+int sendget2(int s, uint32_t id, uint8_t flags, const char *filename);
+
+int recvhdr2(int s, uint32_t *id, uint64_t *dim, uint32_t *timestamp);
+
+int sendquit2(int s);
+
+ssize_t copyfile(int fd, char *filename, uint32_t dim, uint32_t timestamp);
+
+ssize_t Copyfile(int fd, char *filename, uint32_t dim, uint32_t timestamp);
+
 #endif
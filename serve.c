@@ -8,10 +8,44 @@ author: Luigi Ferrettino (S254300)
 
 */
 
+#define _GNU_SOURCE /* splice(), fallocate(), readahead() */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#include <linux/pkt_sched.h>
+
 #include "serve.h"
 
 /* GLOBAL VARIABLES */
 extern char *prog_name;
+static int root_fd = -1; /* working directory, every name is resolved beneath it */
+int (*serve_miss)(struct conn *c, const char *filename) = NULL; /* see serve.h */
+int put_policy = PUT_DISABLED;                                  /* see serve.h */
+struct pack *serve_pack = NULL;                                 /* see serve.h */
+struct meta *serve_meta = NULL;                                 /* see serve.h */
+
+/* PROTOTYPES */
+static void conn_expire(struct tw_timer *t, void *arg);
+static void conn_timeout_msg(struct conn *c);
+static int serve_list(struct conn *c, const char *dir);
+static int serve_stats(struct conn *c);
+static int serve_put(struct conn *c, const char *filename);
+static int outside(const char *path);
+static int open_beneath(const char *name, struct stat *sb);
+static int openat_beneath(const char *name, int flags);
+static void learn(const char *name, int fd, const struct stat *sb, int known, const struct meta_entry *cached);
+static void prefetch_next(struct conn *c);
+static void conn_pace(struct conn *c, size_t len);
+static void serve_v2(struct conn *c, unsigned char *hdr);
+static int serve_get2(struct conn *c, uint32_t id, const char *filename);
+static int resolve2(struct conn *c, const char *filename, int *fd, off_t *start, struct stat *sb, int *owned);
+static void serve_mux(struct conn *c);
+static int send_error2(struct conn *c, uint32_t id, uint32_t code);
+static int send_err(struct conn *c, uint32_t code);
+static int list_dir(FILE *out, int dirfd, char *path, size_t len);
 
 /****************************************
  * serve the connected socket according
@@ -22,11 +56,23 @@ void serve(int connfd, char *host)
 {
     char *c;                       /* char pointer allocated dinamically with 2 elements (+1 end of string) */
     char buf[BUFFLEN];             /* buffer used for storing temporary bytes */
-    char filename[30];             /* name of the file requested */
+    char filename[NAMELEN];        /* name of the file requested */
     uint32_t dimension, timestamp; /* dimension and last modified timestamp of the filename (if it exist) */
-    FILE *stream_socket_r;         /* file stream to read and send throught socket */
+    int filefd;                    /* file to send throught socket */
+    struct stat sb;                /* its dimension and timestamp */
     char *hostipv4;                /* additional pointer to host */
     int pid = (int)getpid();       /* store the PID of this process */
+    struct conn conn;              /* connection state and deadlines */
+    struct sockaddr_storage ss;    /* local address, to know the transport */
+    socklen_t sslen = sizeof(ss);
+    int passfd;                    /* the request is an OPEN: pass the descriptor, not the content */
+    int miss;                      /* result of serve_miss() */
+    int listed;                    /* result of serve_list() or serve_put() */
+    char name[NAMELEN];            /* directory listed or file uploaded */
+    struct pack_entry packed;      /* position of a file in the packed archive */
+    int known;                     /* result of meta_lookup() */
+    struct meta_entry indexed;     /* size and timestamp of a file in the metadata index */
+    uint64_t t_cmd = 0, t_phase = 0; /* start of the command, of the current phase (see hist.h) */
 
     /* translates IPv4-mapped IPv6 string addresses to IPv4 string */
     if ((hostipv4 = strstr(host, "::ffff:")) != NULL)
@@ -36,6 +82,21 @@ void serve(int connfd, char *host)
         memset(hostipv4, 0, strlen(hostipv4));
     }
 
+    conn.fd = connfd;
+    conn.host = host;
+    conn.pid = pid;
+    conn.local = getsockname(connfd, (SA *)&ss, &sslen) == 0 && ss.ss_family == AF_UNIX;
+    conn.expired = NULL;
+    conn.prefetched = 0;
+    conn.keep = 0;
+    tw_init(&conn.tw, tw_now_ms());
+    tw_timer_init(&conn.idle, conn_expire, &conn);
+    tw_timer_init(&conn.header, conn_expire, &conn);
+    tw_timer_init(&conn.progress, conn_expire, &conn);
+    hist_bind(pid);
+    stats_open(connfd, host);
+    shape_open(connfd);
+
     /*********************************************** 
      * during the connection we don't know how many 
      * files are requested by the client, so we need 
@@ -46,16 +107,34 @@ void serve(int connfd, char *host)
         /* initialise the buffer */
         memset(buf, 0, BUFFLEN);
 
+        /******************************************************
+         * wait for the next command under the idle deadline;
+         * once it starts arriving, the whole command line must
+         * be received within the header deadline.
+         ******************************************************/
+        tw_add(&conn.tw, &conn.idle, tw_now_ms() + IDLE_TIMEOUT);
+        if (conn_wait(&conn, POLLIN) <= 0)
+        {
+            conn_timeout_msg(&conn);
+            break;
+        }
+        tw_del(&conn.tw, &conn.idle);
+        tw_add(&conn.tw, &conn.header, tw_now_ms() + HEADER_TIMEOUT);
+        conn.prefetched = 0;
+        HIST_CLOCK(t_cmd);
+
         /************************************************
          * read the first 4 bytes, not even more because 
          * we could have, has the protocol says, the name 
          * of the file that has a variable lenght 
+         * (nothing at all: the client has closed)
          ************************************************/
-        if (Readn_timeo(connfd, buf, 4, host) < 0)
+        if (Readn_timeo(&conn, buf, 4) <= 0)
             break;
 
-        /* check the buffer, if is "GET ", go on to store the filename */
-        if (strncmp(buf, "GET ", 4) == 0)
+        /* check the buffer, if is "GET " (or "OPEN" for local clients), go on to store the filename */
+        passfd = conn.local && strncmp(buf, "OPEN", 4) == 0;
+        if (strncmp(buf, "GET ", 4) == 0 || passfd)
         {
             /**********************************************************************************
             * since we don't know the lenght of the file name, we must read byte by byte from 
@@ -63,183 +142,468 @@ void serve(int connfd, char *host)
             * version since the buffered could have some problems on the future read/recv.
             ***********************************************************************************/
 
-            /* reset the buffer */
-            memset(buf, 0, BUFFLEN);
-
-            ssize_t filenamelenght = readline_unbuffered(connfd, buf, BUFFLEN);
+            /* the name goes straight in its own buffer, long enough for nested paths */
+            ssize_t filenamelenght = readline_timeo(&conn, filename, NAMELEN);
 
             /* check for errors */
             if (filenamelenght < 0)
             {
-                err_msg("%d\t%s - (%s) error - readline_unbuffered() failed.", pid, host, prog_name);
+                if (conn.expired != NULL)
+                    conn_timeout_msg(&conn);
+                else
+                    err_msg("%d\t%s - (%s) error - readline_timeo() failed.", pid, host, prog_name);
+                stats_request(STATS_ILLEGAL);
                 strncpy(buf, "-ERR\r\n", 6);
                 if (writen(connfd, buf, 6) != 6)
                     err_ret("%d\t%s - (%s) error - writen failed", pid, host, prog_name);
                 break;
             }
 
-            /* make sure that the last 2 bytes respect the prtocol */
-            if ((buf[filenamelenght - 2] == '\r') && (buf[filenamelenght - 1] == '\n'))
+            /* make sure that the last 2 bytes respect the prtocol (the space after "OPEN" is still in the buffer) */
+            if (filenamelenght >= 2 && (filename[filenamelenght - 2] == '\r') && (filename[filenamelenght - 1] == '\n') &&
+                (!passfd || filename[0] == ' '))
             {
 
                 /* remove the last 2 bytes to have only the file name */
-                buf[filenamelenght - 2] = '\0';
+                filename[filenamelenght - 2] = '\0';
+
+                /* the command is complete, from now on only the send progress is checked */
+                tw_del(&conn.tw, &conn.header);
+                HIST_RECORD(HIST_PARSE, t_cmd);
 
-                /* save the file name in the filename variable */
-                strcpy(filename, buf);
+                /* drop the space after "OPEN" */
+                if (passfd)
+                    memmove(filename, filename + 1, filenamelenght - 2);
 
-                printf("%d\t%s - file {%s} requested.\n", pid, host, filename);
-                fflush(stdout);
+                log_msg(pid, host, "file {%s} requested.", filename);
 
                 memset(buf, 0, BUFFLEN);
+                HIST_CLOCK(t_phase);
 
                 /***************************************************************************************************** 
-                * due to security reasons there's necessity to deny accesses outside the working directory by checking 
-                * the "../" string in the filename; since filenames in Unix can't contains those characters, this is a 
-                * simple and safe mode to do it properly. Despite the "../", it's possible to access on subdirectories 
-                * included in the workspace directory, whitch is a good thing.
+                * due to security reasons there's necessity to deny accesses outside the working directory: absolute
+                * names and ".." components are refused here already, since the archive, the index and the proxy hook
+                * do not go through the filesystem; symbolic links leading outside are stopped by open_beneath().
+                * Subdirectories of the workspace directory are accessible, whitch is a good thing.
                 ******************************************************************************************************/
-                if (strstr(filename, "../") != NULL)
+                if (outside(filename))
                 {
-                    err_msg("%d\t%s - (%s) error - requested a file not in the working directory, closing..", pid, host, prog_name);
-                    strncpy(buf, "-ERR\r\n", 6);
-                    if (writen(connfd, buf, 6) != 6)
-                        err_ret("%d\t%s - (%s) error - writen failed", pid, host, prog_name);
-                    break;
+                    err_msg("%d\t%s - (%s) error - requested a file not in the working directory%s", pid, host, prog_name,
+                            conn.keep ? "." : ", closing..");
+                    if (send_err(&conn, V2_EINVAL) < 0)
+                        break;
+                    continue;
                 }
 
-                /* now we need to know if the file exists and if it's readable with the access() function */
-                if (access(filename, R_OK) != -1)
+                /*************************************************************************************
+                 * a name of the packed archive is answered from its blob: no open(), no stat(), a
+                 * single descriptor for all the names. The archive comes first, the files second.
+                 *************************************************************************************/
+                if (serve_pack != NULL && !passfd && pack_lookup(serve_pack, filename, &packed) == 0)
                 {
-                    /* the file exists, retrieve the dimension and the modified timestamp and convert it in network byte order */
-                    if ((dimension = get_file_size(filename)) < 0)
+                    stats_cache(STATS_ARCHIVE, 1);
+                    HIST_RECORD(HIST_LOOKUP, t_phase);
+                    HIST_CLOCK(t_phase);
+                    dimension = htonl(packed.length);
+                    timestamp = htonl(packed.mtime);
+                    memcpy(buf, "+OK\r\n", 5);
+                    memcpy(buf + 5, &dimension, 4);
+                    memcpy(buf + 9, &timestamp, 4);
+
+                    if (sendn(connfd, buf, 13, packed.length > 0 ? MSG_MORE : 0) != 13)
                     {
-                        err_msg("%d\t%s - (%s) error - stat dimension failed, closing..", pid, host, prog_name);
-                        strncpy(buf, "-ERR\r\n", 6);
-                        if (writen(connfd, buf, 6) != 6)
-                            err_ret("%d\t%s - (%s) error - writen failed", pid, host, prog_name);
+                        err_ret("%d\t%s - (%s) error - writen failed", pid, host, prog_name);
                         break;
                     }
-                    if ((timestamp = get_file_timestamp(filename)) < 0)
+                    HIST_RECORD(HIST_HEADER, t_phase);
+                    HIST_CLOCK(t_phase);
+
+                    if (conn_sendfile(&conn, packed.fd, packed.offset, packed.length) == packed.length)
                     {
-                        err_msg("%d\t%s - (%s) error - stat timestamp failed, closing..", pid, host, prog_name);
-                        strncpy(buf, "-ERR\r\n", 6);
-                        if (writen(connfd, buf, 6) != 6)
-                            err_ret("%d\t%s - (%s) error - writen failed", pid, host, prog_name);
+                        HIST_RECORD(HIST_SEND, t_phase);
+                        HIST_RECORD(HIST_TOTAL, t_cmd);
+                        stats_request(STATS_OK);
+                        log_msg(pid, host, "file {%s} sent from the archive.", filename);
+                        continue;
+                    }
+
+                    if (conn.expired != NULL)
+                        conn_timeout_msg(&conn);
+                    else
+                        err_msg("%d\t%s - (%s) error - sendfile failed, disconnected.", pid, host, prog_name);
+                    fflush(stdout);
+                    stats_request(STATS_BROKEN);
+                    stats_close();
+                    Close(connfd);
+                    return;
+                }
+
+                /***************************************************************************************
+                 * the metadata index knows which files are not there without asking the filesystem; when it
+                 * cannot tell, the name is looked up as usual. Without an index, what another worker learnt in
+                 * the last moments (see cache.h) tells a missing file at once. A file found by either is still
+                 * described by the fstat() of its descriptor, they may lag behind a writer (see learn()).
+                 ***************************************************************************************/
+                if (serve_pack != NULL && !passfd)
+                    stats_cache(STATS_ARCHIVE, 0);
+
+                known = META_UNKNOWN;
+                if (serve_meta != NULL && !passfd)
+                {
+                    known = meta_lookup(serve_meta, filename, &indexed);
+                    stats_cache(STATS_INDEX, known != META_UNKNOWN);
+                }
+                else if (!passfd)
+                    known = cache_lookup(filename, &indexed);
+
+                if (known == META_MISSING && serve_miss == NULL)
+                {
+                    err_msg("%d\t%s - file {%s} not found%s", pid, host, filename, conn.keep ? "." : ", closing..");
+                    if (send_err(&conn, V2_ENOENT) < 0)
                         break;
+                    continue;
+                }
+
+                /*******************************************************************************************
+                 * one openat2() beneath the working directory both checks the name and opens the file, fstat()
+                 * on the descriptor gives dimension and timestamp of the very file that is going to be sent
+                 *******************************************************************************************/
+                HIST_RECORD(HIST_LOOKUP, t_phase);
+                HIST_CLOCK(t_phase);
+                filefd = known == META_MISSING ? -1 : open_beneath(filename, &sb);
+                HIST_RECORD(HIST_OPEN, t_phase);
+                if (serve_meta == NULL && !passfd)
+                    learn(filename, filefd, &sb, known, &indexed);
+
+                /* a proxy fetches the missing file from upstream, usually streaming it to the client at once */
+                if (serve_miss != NULL && !passfd)
+                    stats_cache(STATS_PROXY, filefd >= 0);
+                if (filefd < 0 && serve_miss != NULL && !passfd)
+                {
+                    if ((miss = serve_miss(&conn, filename)) == MISS_SENT)
+                    {
+                        stats_request(STATS_OK);
+                        log_msg(pid, host, "file {%s} sent.", filename);
+                        continue;
+                    }
+                    else if (miss == MISS_ERR)
+                    {
+                        err_msg("%d\t%s - file {%s} not available%s", pid, host, filename, conn.keep ? "." : ", closing..");
+                        if (send_err(&conn, V2_ENOENT) < 0)
+                            break;
+                        continue;
+                    }
+                    else if (miss == MISS_BROKEN)
+                    {
+                        /* the response is incomplete */
+                        if (conn.expired != NULL)
+                            conn_timeout_msg(&conn);
+                        else
+                            err_msg("%d\t%s - (%s) error - file {%s} interrupted, disconnected.", pid, host, prog_name, filename);
+                        fflush(stdout);
+                        stats_request(STATS_BROKEN);
+                        stats_close();
+                        Close(connfd);
+                        return;
                     }
 
-                    dimension = htonl(dimension);
-                    timestamp = htonl(timestamp);
+                    /* cached in the working directory by now */
+                    filefd = open_beneath(filename, &sb);
+                }
+
+                /* now we need to know if the file exists and if it's readable */
+                if (filefd >= 0)
+                {
+                    /* the file exists, convert the dimension and the modified timestamp in network byte order */
+                    dimension = htonl(sb.st_size);
+                    timestamp = htonl(sb.st_mtime);
 
                     /* reset the buffer */
                     memset(buf, 0, BUFFLEN);
 
-                    /* open the file in read mode */
-                    if ((stream_socket_r = fopen(filename, "r")) == NULL)
+                    /*********************************************************************************
+                     * local client: the same response is sent, but with the open file descriptor
+                     * attached (SCM_RIGHTS) instead of the content; the client copies (or reflinks,
+                     * or maps) the file by itself, without any byte going through the socket.
+                     *********************************************************************************/
+                    if (passfd)
                     {
-                        err_ret("%d\t%s - (%s) error - fopen() failed", pid, host, prog_name);
-                        strncpy(buf, "-ERR\r\n", 6);
-                        if (writen(connfd, buf, 6) != 6)
-                            err_ret("%d\t%s - (%s) error - writen failed", pid, host, prog_name);
-                        break;
+                        memcpy(buf, "+OK\r\n", 5);
+                        memcpy(buf + 5, &dimension, 4);
+                        memcpy(buf + 9, &timestamp, 4);
+
+                        if (write_fd(connfd, buf, 13, filefd) != 13)
+                        {
+                            err_ret("%d\t%s - (%s) error - write_fd failed", pid, host, prog_name);
+                            close(filefd);
+                            break;
+                        }
+                        close(filefd);
+
+                        stats_request(STATS_OK);
+                        log_msg(pid, host, "file {%s} passed.", filename);
+                        continue;
                     }
 
                     /* start preparing the response according to the protocol */
-                    strncpy(buf, "+OK\r\n", 5);
+                    HIST_CLOCK(t_phase);
+                    memcpy(buf, "+OK\r\n", 5);
+                    memcpy(buf + 5, &dimension, 4);
+                    memcpy(buf + 9, &timestamp, 4);
 
-                    /* write the "+OK\r\n" string followed by dimension and timestamp (the last two in the network byte order) */
-                    if (writen(connfd, buf, 5) != 5)
-                    {
-                        err_ret("%d\t%s - (%s) error - writen failed", pid, host, prog_name);
-                        break;
-                    }
-                    if (writen(connfd, &dimension, 4) != 4)
-                    {
-                        err_ret("%d\t%s - (%s) error - writen failed", pid, host, prog_name);
-                        break;
-                    }
-                    if (writen(connfd, &timestamp, 4) != 4)
+                    /*********************************************************************************************
+                     * write the "+OK\r\n" string followed by dimension and timestamp (the last two in the network
+                     * byte order) with a single send(): separate small writes would wait for the delayed ACK of the
+                     * client because of Nagle. MSG_MORE lets the header leave together with the file content; not
+                     * for an empty file, the header would wait corked for the 200 ms flush with nothing to follow.
+                     *********************************************************************************************/
+                    if (sendn(connfd, buf, 13, dimension != 0 ? MSG_MORE : 0) != 13)
                     {
                         err_ret("%d\t%s - (%s) error - writen failed", pid, host, prog_name);
+                        close(filefd);
                         break;
                     }
+                    HIST_RECORD(HIST_HEADER, t_phase);
+                    HIST_CLOCK(t_phase);
 
                     /****************************************************************************************************************
                      * after the timestamp, we need to send the file. sendfile() copies data between one file descriptor and another. 
                      * Because this copying is done within the kernel, sendfile() is more efficient than the combination of read() 
                      * and write(), which would require transferring data to and from user space.
+                     * conn_sendfile() sends it in slices, reaping the client if it does not keep up with MIN_SEND_RATE.
                      ****************************************************************************************************************/
-                    uint32_t bytesent = sendfile(connfd, fileno(stream_socket_r), NULL, ntohl(dimension));
+                    uint32_t bytesent = conn_sendfile(&conn, filefd, 0, ntohl(dimension));
 
-                    /* rewind the FILE pointer and then close it */
-                    rewind(stream_socket_r);
-                    fclose(stream_socket_r);
+                    close(filefd);
 
                     /* check the bytesent for error handling */
                     if (bytesent == ntohl(dimension))
                     {
-                        printf("%d\t%s - file {%s} sent.\n", pid, host, filename);
-                        fflush(stdout);
+                        HIST_RECORD(HIST_SEND, t_phase);
+                        HIST_RECORD(HIST_TOTAL, t_cmd);
+                        stats_request(STATS_OK);
+                        log_msg(pid, host, "file {%s} sent.", filename);
                     }
                     else if (bytesent < ntohl(dimension))
                     {
-                        /* the client is unexpectedly disconnected, the file sent is incomplete */
-                        err_msg("%d\t%s - (%s) error - sendfile failed, disconnected.", pid, host, prog_name);
+                        /* the client is unexpectedly disconnected (or too slow), the file sent is incomplete */
+                        if (conn.expired != NULL)
+                            conn_timeout_msg(&conn);
+                        else
+                            err_msg("%d\t%s - (%s) error - sendfile failed, disconnected.", pid, host, prog_name);
                         fflush(stdout);
+                        stats_request(STATS_BROKEN);
+                        stats_close();
                         Close(connfd);
                         return;
                     }
                 }
                 else
                 {
-                    /* the file does't exists, send the "-ERR\r\n" command and break the while */
-                    err_msg("%d\t%s - file {%s} not found, closing..", pid, host, filename);
-                    strncpy(buf, "-ERR\r\n", 6);
-                    if (writen(connfd, buf, 6) != 6)
-                        err_ret("%d\t%s - (%s) error - writen failed", pid, host, prog_name);
-                    break;
+                    /* the file does't exists, send the "-ERR\r\n" command and break the while (unless KEEP) */
+                    err_msg("%d\t%s - file {%s} not found%s", pid, host, filename, conn.keep ? "." : ", closing..");
+                    if (send_err(&conn, V2_ENOENT) < 0)
+                        break;
                 }
             }
             else
             {
                 /* the request isn't valid, send the "-ERR\r\n" command and break the while */
                 err_msg("%d\t%s - (%s) error - illegal command, closing..", pid, host, prog_name);
+                stats_request(STATS_ILLEGAL);
+                strncpy(buf, "-ERR\r\n", 6);
+                if (writen(connfd, buf, 6) != 6)
+                    err_ret("%d\t%s - (%s) error - writen failed", pid, host, prog_name);
+                break;
+            }
+        }
+        else if (strncmp(buf, "LIST", 4) == 0)
+        {
+            /* |L|I|S|T|CR|LF| for the whole working directory, or |L|I|S|T| |...directory...|CR|LF| */
+            ssize_t linelen = readline_timeo(&conn, name, NAMELEN);
+            char *dir = name + 1;
+
+            tw_del(&conn.tw, &conn.header);
+
+            if (linelen < 2 || name[linelen - 2] != '\r' || name[linelen - 1] != '\n' || (linelen > 2 && name[0] != ' '))
+            {
+                if (conn.expired != NULL)
+                    conn_timeout_msg(&conn);
+                else
+                    err_msg("%d\t%s - (%s) error - illegal command, closing..", pid, host, prog_name);
+                stats_request(STATS_ILLEGAL);
+                strncpy(buf, "-ERR\r\n", 6);
+                if (writen(connfd, buf, 6) != 6)
+                    err_ret("%d\t%s - (%s) error - writen failed", pid, host, prog_name);
+                break;
+            }
+            name[linelen - 2] = '\0';
+            if (linelen == 2 || *dir == '\0')
+                dir = ".";
+
+            log_msg(pid, host, "listing of {%s} requested.", dir);
+
+            /* same rule of GET: nothing outside the working directory */
+            if (outside(dir) || (listed = serve_list(&conn, dir)) == -1)
+            {
+                err_msg("%d\t%s - (%s) error - cannot list {%s}%s", pid, host, prog_name, dir,
+                        conn.keep ? "." : ", closing..");
+                if (send_err(&conn, V2_ENOENT) < 0)
+                    break;
+                continue;
+            }
+            else if (listed < 0)
+            {
+                if (conn.expired != NULL)
+                    conn_timeout_msg(&conn);
+                else
+                    err_msg("%d\t%s - (%s) error - sendfile failed, disconnected.", pid, host, prog_name);
+                stats_request(STATS_BROKEN);
+                break;
+            }
+
+            stats_request(STATS_OK);
+            log_msg(pid, host, "listing of {%s} sent.", dir);
+        }
+        else if (strncmp(buf, "PUT ", 4) == 0)
+        {
+            /* |P|U|T| |...filename...|CR|LF|B1|B2|B3|B4|T1|T2|T3|T4|File content......... */
+            ssize_t linelen = readline_timeo(&conn, name, NAMELEN);
+
+            if (linelen < 3 || name[linelen - 2] != '\r' || name[linelen - 1] != '\n')
+            {
+                if (conn.expired != NULL)
+                    conn_timeout_msg(&conn);
+                else
+                    err_msg("%d\t%s - (%s) error - illegal command, closing..", pid, host, prog_name);
+                stats_request(STATS_ILLEGAL);
+                strncpy(buf, "-ERR\r\n", 6);
+                if (writen(connfd, buf, 6) != 6)
+                    err_ret("%d\t%s - (%s) error - writen failed", pid, host, prog_name);
+                break;
+            }
+            name[linelen - 2] = '\0';
+
+            log_msg(pid, host, "upload of {%s} requested.", name);
+
+            if ((listed = serve_put(&conn, name)) == -1)
+            {
+                err_msg("%d\t%s - (%s) error - upload of {%s} refused, closing..", pid, host, prog_name, name);
+                stats_request(STATS_INVALID);
+                strncpy(buf, "-ERR\r\n", 6);
+                if (writen(connfd, buf, 6) != 6)
+                    err_ret("%d\t%s - (%s) error - writen failed", pid, host, prog_name);
+                break;
+            }
+            else if (listed < 0)
+            {
+                if (conn.expired != NULL)
+                    conn_timeout_msg(&conn);
+                else
+                    err_msg("%d\t%s - (%s) error - upload of {%s} interrupted, disconnected.", pid, host, prog_name, name);
+                stats_request(STATS_BROKEN);
+                break;
+            }
+
+            stats_request(STATS_OK);
+            log_msg(pid, host, "file {%s} stored.", name);
+        }
+        else if (strncmp(buf, "STAT", 4) == 0)
+        {
+            /* |S|T|A|T|S|CR|LF|: the counters of the server, answered like a LIST */
+            if (Readn_timeo(&conn, buf, 3) < 0)
+                break;
+
+            tw_del(&conn.tw, &conn.header);
+
+            if (strncmp(buf, "S\r\n", 3) != 0)
+            {
+                err_msg("%d\t%s - (%s) error - illegal command, closing..", pid, host, prog_name);
+                stats_request(STATS_ILLEGAL);
+                strncpy(buf, "-ERR\r\n", 6);
+                if (writen(connfd, buf, 6) != 6)
+                    err_ret("%d\t%s - (%s) error - writen failed", pid, host, prog_name);
+                break;
+            }
+
+            if ((listed = serve_stats(&conn)) == -1)
+            {
+                err_msg("%d\t%s - (%s) error - statistics not available%s", pid, host, prog_name,
+                        conn.keep ? "." : ", closing..");
+                if (send_err(&conn, V2_ENOENT) < 0)
+                    break;
+                continue;
+            }
+            else if (listed < 0)
+            {
+                err_msg("%d\t%s - (%s) error - writen failed, disconnected.", pid, host, prog_name);
+                break;
+            }
+        }
+        else if (strncmp(buf, "KEEP", 4) == 0)
+        {
+            /* |K|E|E|P|CR|LF|: from now on a request that cannot be served does not end the connection */
+            if (Readn_timeo(&conn, buf, 2) < 0)
+                break;
+
+            tw_del(&conn.tw, &conn.header);
+
+            if (strncmp(buf, "\r\n", 2) != 0)
+            {
+                err_msg("%d\t%s - (%s) error - illegal command, closing..", pid, host, prog_name);
+                stats_request(STATS_ILLEGAL);
                 strncpy(buf, "-ERR\r\n", 6);
                 if (writen(connfd, buf, 6) != 6)
                     err_ret("%d\t%s - (%s) error - writen failed", pid, host, prog_name);
                 break;
             }
+
+            conn.keep = 1;
+            if (writen(connfd, "+OK\r\n", 5) != 5)
+            {
+                err_ret("%d\t%s - (%s) error - writen failed", pid, host, prog_name);
+                break;
+            }
         }
         else if (strncmp(buf, "QUIT", 4) == 0)
         {
             /* the client could have finished requesting the files, go on and check */
             memset(buf, 0, BUFFLEN);
 
-            if (Readn_timeo(connfd, buf, 2, host) < 0)
+            if (Readn_timeo(&conn, buf, 2) < 0)
                 break;
 
+            tw_del(&conn.tw, &conn.header);
+
             if (strncmp(buf, "\r\n", 2) == 0)
             {
                 /* the client has finished requesting files, break the while */
-                printf("%d\t%s - client served\n", pid, host);
-                fflush(stdout);
+                log_msg(pid, host, "client served");
                 break;
             }
             else
             {
                 /* bad request */
                 err_msg("%d\t%s - (%s) error - illegal command, closing..", pid, host, prog_name);
+                stats_request(STATS_ILLEGAL);
                 strncpy(buf, "-ERR\r\n", 6);
                 if (writen(connfd, buf, 6) != 6)
                     err_ret("%d\t%s - (%s) error - writen failed", pid, host, prog_name);
                 break;
             }
         }
+        else if ((unsigned char)buf[0] == V2_MAGIC && (unsigned char)buf[1] == V2_VERSION && buf[2] == V2_HELLO &&
+                 serve_miss == NULL)
+        {
+            /* protocol 2 until the end of the connection (not offered by a proxy: its hook answers in protocol 1) */
+            serve_v2(&conn, (unsigned char *)buf);
+            break;
+        }
         else
         {
             /* the request isn't valid, send the "-ERR\r\n" command and break the while */
             err_msg("%d\t%s - (%s) error - illegal command, closing..", pid, host, prog_name);
+            stats_request(STATS_ILLEGAL);
             strncpy(buf, "-ERR\r\n", 6);
             if (writen(connfd, buf, 6) != 6)
                 err_ret("%d\t%s - (%s) error - writen failed", pid, host, prog_name);
@@ -248,46 +612,1306 @@ void serve(int connfd, char *host)
     }
 
     /* after every break, close the socket and return to the main (accepting) */
+    stats_close();
     Close(connfd);
 
     return;
 }
 
-/* use the stat() function to retrieve the dimension */
-unsigned get_file_size(const char *file_name)
+/******************************************************************************
+ * protocol 2 (see proto2.h): "hdr" holds the first 4 bytes of the HELLO frame.
+ * Every request is a header decoded at fixed offsets plus a payload of known
+ * length: no scanning for CR LF, and an error does not end the connection.
+ ******************************************************************************/
+static void serve_v2(struct conn *c, unsigned char *hdr)
+{
+    unsigned char frame[V2_HDRLEN + 8];
+    char filename[NAMELEN];
+    struct v2_frame f;
+    uint32_t version, caps;
+
+    /* the rest of the HELLO, version and capabilities of the client */
+    if (Readn_timeo(c, frame + 4, V2_HDRLEN - 4) != V2_HDRLEN - 4)
+        return;
+    memcpy(frame, hdr, 4);
+    if (v2_unpack(frame, &f) < 0 || f.length != 8 || Readn_timeo(c, frame, 8) != 8)
+    {
+        err_msg("%d\t%s - (%s) error - malformed HELLO, closing..", c->pid, c->host, prog_name);
+        return;
+    }
+    tw_del(&c->tw, &c->header);
+    memcpy(&version, frame, 4);
+    memcpy(&caps, frame + 4, 4);
+
+    f.opcode = V2_HELLO;
+    f.flags = 0;
+    f.length = 8;
+    v2_pack(frame, &f);
+    version = htonl(V2_VERSION);
+    caps = htonl(ntohl(caps) & V2_CAPS);
+    memcpy(frame + V2_HDRLEN, &version, 4);
+    memcpy(frame + V2_HDRLEN + 4, &caps, 4);
+    if (writen(c->fd, frame, V2_HDRLEN + 8) != V2_HDRLEN + 8)
+    {
+        err_ret("%d\t%s - (%s) error - writen failed", c->pid, c->host, prog_name);
+        return;
+    }
+
+    log_msg(c->pid, c->host, "protocol 2 negotiated%s.", ntohl(caps) & V2_CAP_MUX ? ", multiplexed" : "");
+
+    if (ntohl(caps) & V2_CAP_MUX)
+    {
+        serve_mux(c);
+        return;
+    }
+
+    for (;;)
+    {
+        /* same deadlines of protocol 1 */
+        tw_add(&c->tw, &c->idle, tw_now_ms() + IDLE_TIMEOUT);
+        if (conn_wait(c, POLLIN) <= 0)
+        {
+            conn_timeout_msg(c);
+            return;
+        }
+        tw_del(&c->tw, &c->idle);
+        tw_add(&c->tw, &c->header, tw_now_ms() + HEADER_TIMEOUT);
+        c->prefetched = 0;
+
+        if (Readn_timeo(c, frame, V2_HDRLEN) != V2_HDRLEN)
+            return;
+
+        /* a bad header means the framing is lost: nothing after it can be trusted */
+        if (v2_unpack(frame, &f) < 0)
+        {
+            err_msg("%d\t%s - (%s) error - invalid frame, closing..", c->pid, c->host, prog_name);
+            stats_request(STATS_ILLEGAL);
+            return;
+        }
+
+        if (f.opcode == V2_QUIT)
+        {
+            log_msg(c->pid, c->host, "client served");
+            return;
+        }
+
+        /* the payload is read anyway, so a refused request leaves the next one in place */
+        if (f.length >= NAMELEN || Readn_timeo(c, filename, f.length) != (ssize_t)f.length)
+        {
+            err_msg("%d\t%s - (%s) error - request too long or interrupted, closing..", c->pid, c->host, prog_name);
+            stats_request(STATS_ILLEGAL);
+            return;
+        }
+        tw_del(&c->tw, &c->header);
+        filename[f.length] = '\0';
+
+        if (f.opcode != V2_GET || f.flags != 0 || f.length == 0 || strlen(filename) != f.length)
+        {
+            err_msg("%d\t%s - (%s) error - illegal request %u", c->pid, c->host, prog_name, f.opcode);
+            if (send_error2(c, f.id, V2_EINVAL) < 0)
+                return;
+            continue;
+        }
+
+        log_msg(c->pid, c->host, "file {%s} requested.", filename);
+
+        if (serve_get2(c, f.id, filename) < 0)
+            return;
+    }
+}
+
+/*******************************************************************************
+ * same resolution of protocol 1: archive, index (or shared cache), then the working directory.
+ * 0 with the file to send in *fd from *start, *sb with dimension and timestamp
+ * and *owned if *fd must be closed afterwards (not a blob); a V2_E* otherwise.
+ *******************************************************************************/
+static int resolve2(struct conn *c, const char *filename, int *fd, off_t *start, struct stat *sb, int *owned)
+{
+    struct pack_entry packed;
+    struct meta_entry indexed;
+    int known = META_UNKNOWN;
+
+    if (outside(filename))
+    {
+        err_msg("%d\t%s - (%s) error - requested a file not in the working directory", c->pid, c->host, prog_name);
+        return V2_EINVAL;
+    }
+
+    if (serve_pack != NULL && pack_lookup(serve_pack, filename, &packed) == 0)
+    {
+        stats_cache(STATS_ARCHIVE, 1);
+        *fd = packed.fd;
+        *start = packed.offset;
+        *owned = 0;
+        sb->st_size = packed.length;
+        sb->st_mtime = packed.mtime;
+        return 0;
+    }
+
+    if (serve_pack != NULL)
+        stats_cache(STATS_ARCHIVE, 0);
+
+    if (serve_meta != NULL)
+    {
+        known = meta_lookup(serve_meta, filename, &indexed);
+        stats_cache(STATS_INDEX, known != META_UNKNOWN);
+    }
+    else
+        known = cache_lookup(filename, &indexed);
+    *fd = known == META_MISSING ? -1 : open_beneath(filename, sb);
+    if (serve_meta == NULL)
+        learn(filename, *fd, sb, known, &indexed);
+    if (*fd < 0)
+    {
+        err_msg("%d\t%s - file {%s} not found.", c->pid, c->host, filename);
+        return V2_ENOENT;
+    }
+    *start = 0;
+    *owned = 1;
+
+    return 0;
+}
+
+/* FILE frame for "filename", or an ERROR frame; -1 if the connection cannot go on */
+static int serve_get2(struct conn *c, uint32_t id, const char *filename)
 {
+    unsigned char frame[V2_HDRLEN + 8];
+    struct v2_frame f;
     struct stat sb;
-    if (stat(file_name, &sb) != 0)
+    uint64_t mtime;
+    off_t start, sent;
+    int filefd, owned, err;
+
+    if ((err = resolve2(c, filename, &filefd, &start, &sb, &owned)) != 0)
+        return send_error2(c, id, err);
+
+    f.opcode = V2_FILE;
+    f.flags = 0;
+    f.id = id;
+    f.length = 8 + (uint64_t)sb.st_size;
+    v2_pack(frame, &f);
+    mtime = htobe64((uint64_t)sb.st_mtime);
+    memcpy(frame + V2_HDRLEN, &mtime, 8);
+
+    /* header and timestamp leave together with the content, as in protocol 1 (corked only if there is some) */
+    if (sendn(c->fd, frame, V2_HDRLEN + 8, sb.st_size > 0 ? MSG_MORE : 0) != V2_HDRLEN + 8)
+    {
+        err_ret("%d\t%s - (%s) error - writen failed", c->pid, c->host, prog_name);
+        if (owned)
+            close(filefd);
+        return -1;
+    }
+
+    sent = conn_sendfile(c, filefd, start, sb.st_size);
+    if (owned)
+        close(filefd);
+
+    if (sent != sb.st_size)
+    {
+        if (c->expired != NULL)
+            conn_timeout_msg(c);
+        else
+            err_msg("%d\t%s - (%s) error - sendfile failed, disconnected.", c->pid, c->host, prog_name);
+        stats_request(STATS_BROKEN);
         return -1;
+    }
 
-    return sb.st_size;
+    stats_request(STATS_OK);
+    log_msg(c->pid, c->host, "file {%s} sent.", filename);
+
+    return 0;
 }
 
-/* use the stat() function to retrieve the "last modified" timestamp */
-unsigned get_file_timestamp(const char *file_name)
+/* a response in flight on a multiplexed connection */
+struct stream
 {
-    struct stat sb;
-    if (stat(file_name, &sb) != 0)
+    uint32_t id;
+    int fd, owned;    /* see resolve2() */
+    off_t offset;     /* next byte to send */
+    off_t end;
+    int weight;       /* chunks per turn */
+    int urgency;      /* V2_URGENCY() of the GET */
+    uint64_t arrived; /* tw_now_ms() of the GET */
+    uint64_t served;  /* tw_now_ms() of its last chunk (of the GET, before the first one) */
+    int started;      /* its content started going out... */
+    uint64_t queued;  /* ...this many milliseconds after the GET */
+    char *name;
+};
+
+/* queueing delays of a multiplexed connection: from the GET to the first byte of the content */
+struct qdelay
+{
+    unsigned long files;
+    uint64_t total, max;
+};
+
+/* socket priority of the DATA frames of each urgency: the queueing discipline orders the connections too */
+static const int sched_prio[4] = {TC_PRIO_BESTEFFORT, TC_PRIO_INTERACTIVE_BULK, TC_PRIO_INTERACTIVE,
+                                  TC_PRIO_INTERACTIVE};
+
+/******************************************************************************
+ * the stream that gets the next turn: the most urgent, then the one with the
+ * least left to send (shortest remaining first). Every millisecond without a
+ * chunk counts as SCHED_AGING bytes less to send, so a big file is not starved
+ * by the small ones that keep coming: it gets a turn at least every
+ * size / SCHED_AGING milliseconds.
+ ******************************************************************************/
+static int sched_pick(const struct stream *st, int nst, uint64_t now)
+{
+    int64_t score, best = INT64_MAX;
+    int i, pick = 0;
+
+    for (i = 0; i < nst; i++)
+    {
+        score = (int64_t)(st[i].end - st[i].offset) - (int64_t)st[i].urgency * SCHED_URGENCY -
+                (int64_t)(now - st[i].served) * SCHED_AGING;
+        if (score < best)
+        {
+            best = score;
+            pick = i;
+        }
+    }
+
+    return pick;
+}
+
+/* the content of the stream starts going out now */
+static void sched_started(struct stream *s, struct qdelay *q, uint64_t now)
+{
+    uint64_t delay = now - s->arrived;
+
+    s->started = 1;
+    s->queued = delay;
+    q->files++;
+    q->total += delay;
+    if (delay > q->max)
+        q->max = delay;
+}
+
+/* the non-blocking socket is full (or empty), or a signal came: try again later */
+static int would_block(void)
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK || INTERRUPTED_BY_SIGNAL;
+}
+
+/* queue a frame of control (FILE, ERROR) with a payload of "len" bytes; -1 if the queue is full */
+static int mux_queue(unsigned char *q, size_t *qlen, size_t cap, uint8_t opcode, uint32_t id, const void *payload,
+                     size_t len)
+{
+    struct v2_frame f;
+
+    if (*qlen + V2_HDRLEN + len > cap)
         return -1;
 
-    return sb.st_mtime;
+    f.opcode = opcode;
+    f.flags = 0;
+    f.id = id;
+    f.length = len;
+    v2_pack(q + *qlen, &f);
+    memcpy(q + *qlen + V2_HDRLEN, payload, len);
+    *qlen += V2_HDRLEN + len;
+
+    return 0;
 }
 
-/* modified Readn to handle socket timeout on input during reading */
-ssize_t Readn_timeo(int fd, void *ptr, size_t nbytes, char *hostname)
+/*****************************************************************************************
+ * protocol 2 with V2_CAP_MUX (see proto2.h): requests are read while responses go out,
+ * on a non-blocking socket. Between two DATA frames, the queued control frames go first,
+ * then the next chunk of the current file; every file keeps the connection for its weight
+ * in chunks, then sched_pick() chooses the next one. A DATA frame, once started, is
+ * always completed: the framing must not break. After QUIT the files in flight are
+ * completed before closing. The queueing delays are logged with the files and summed
+ * up when the client is served.
+ *****************************************************************************************/
+static void serve_mux(struct conn *c)
 {
+    struct stream st[V2_MAX_STREAMS];
+    unsigned char in[V2_HDRLEN + NAMELEN];                    /* requests received, not handled yet */
+    unsigned char ctl[V2_MAX_STREAMS * (V2_HDRLEN + 16) * 2]; /* control frames to send */
+    unsigned char dhdr[V2_HDRLEN];                            /* header of the current DATA frame */
+    size_t inlen = 0, ctllen = 0, dhdrsent = V2_HDRLEN;
+    off_t chunk = 0, mark = 0, written = 0;                  /* bytes of the current DATA frame left */
+    size_t slice;                                             /* of it, allowed by the bandwidth limits */
+    int nst = 0, cur = 0, turn = 0, quit = 0, broken = 0, prio = 0, flags, i, err;
+    struct qdelay q = {0, 0, 0};
+    uint64_t now;
+    struct v2_frame f;
+    struct stat sb;
     ssize_t n;
+    char name[NAMELEN];
+    uint64_t info[2];
+
+    flags = fcntl(c->fd, F_GETFL, 0);
+    fcntl(c->fd, F_SETFL, flags | O_NONBLOCK);
 
-    if ((n = read(fd, ptr, nbytes)) < 0)
+    for (;;)
     {
-        int error = errno;
-        if (error == EWOULDBLOCK)
+        int busy = nst > 0 || ctllen > 0 || chunk > 0;
+
+        if (quit && !busy)
         {
-            err_msg("%d\t%s - (%s) error - Timeout waiting for data: closing connection..", getpid(), hostname, prog_name);
+            log_msg(c->pid, c->host, "client served");
+            if (q.files > 0)
+                log_msg(c->pid, c->host, "queueing delay of %lu files: mean %lu ms, max %lu ms", q.files,
+                        (unsigned long)(q.total / q.files), (unsigned long)q.max);
+            break;
         }
+
+        /* nothing to send: idle (or request) deadline; sending: progress deadline */
+        if (!busy && inlen == 0)
+            tw_add(&c->tw, &c->idle, tw_now_ms() + IDLE_TIMEOUT);
         else
-            err_ret("%d\t%s - (%s) error - readn() failed", getpid(), hostname, prog_name);
-    }
+            tw_del(&c->tw, &c->idle);
+        if (busy && !tw_pending(&c->progress))
+        {
+            mark = written;
+            tw_add(&c->tw, &c->progress, tw_now_ms() + SEND_TIMEOUT);
+        }
+        else if (!busy)
+            tw_del(&c->tw, &c->progress);
 
-    return n;
+        if (conn_wait(c, (quit || nst == V2_MAX_STREAMS ? 0 : POLLIN) | (busy ? POLLOUT : 0)) <= 0)
+        {
+            conn_timeout_msg(c);
+            break;
+        }
+
+        /* requests, while there is room for their responses */
+        if (!quit && nst < V2_MAX_STREAMS && ctllen + 2 * (V2_HDRLEN + 16) <= sizeof(ctl))
+        {
+            if ((n = recv(c->fd, in + inlen, sizeof(in) - inlen, MSG_DONTWAIT)) == 0 || (n < 0 && !would_block()))
+            {
+                if (n < 0)
+                    err_ret("%d\t%s - (%s) error - recv() failed", c->pid, c->host, prog_name);
+                break;
+            }
+            if (n > 0)
+            {
+                if (inlen == 0)
+                    tw_add(&c->tw, &c->header, tw_now_ms() + HEADER_TIMEOUT);
+                inlen += n;
+            }
+        }
+
+        while (!quit && inlen >= V2_HDRLEN && nst < V2_MAX_STREAMS && ctllen + 2 * (V2_HDRLEN + 16) <= sizeof(ctl))
+        {
+            if (v2_unpack(in, &f) < 0 || f.length >= NAMELEN)
+            {
+                err_msg("%d\t%s - (%s) error - invalid frame, closing..", c->pid, c->host, prog_name);
+                goto out;
+            }
+            if (inlen < V2_HDRLEN + f.length)
+                break;
+
+            memcpy(name, in + V2_HDRLEN, f.length);
+            name[f.length] = '\0';
+            if (f.opcode == V2_QUIT)
+                quit = 1;
+            else if (f.opcode != V2_GET || (f.flags & ~(V2_WEIGHT_MASK | V2_URGENCY_MASK)) != 0 || f.length == 0 || strlen(name) != f.length)
+            {
+                err_msg("%d\t%s - (%s) error - illegal request %u", c->pid, c->host, prog_name, f.opcode);
+                stats_request(STATS_INVALID);
+                err = htonl(V2_EINVAL);
+                mux_queue(ctl, &ctllen, sizeof(ctl), V2_ERROR, f.id, &err, 4);
+            }
+            else
+            {
+                log_msg(c->pid, c->host, "file {%s} requested.", name);
+
+                st[nst].id = f.id;
+                if ((err = resolve2(c, name, &st[nst].fd, &st[nst].offset, &sb, &st[nst].owned)) != 0)
+                {
+                    stats_request(err == V2_ENOENT ? STATS_NOT_FOUND : STATS_INVALID);
+                    err = htonl(err);
+                    mux_queue(ctl, &ctllen, sizeof(ctl), V2_ERROR, f.id, &err, 4);
+                }
+                else
+                {
+                    info[0] = htobe64((uint64_t)sb.st_mtime);
+                    info[1] = htobe64((uint64_t)sb.st_size);
+                    mux_queue(ctl, &ctllen, sizeof(ctl), V2_FILE, f.id, info, 16);
+                    st[nst].end = st[nst].offset + sb.st_size;
+                    st[nst].weight = V2_WEIGHT(f.flags);
+                    st[nst].urgency = V2_URGENCY(f.flags);
+                    st[nst].arrived = st[nst].served = tw_now_ms();
+                    st[nst].started = 0;
+                    if ((st[nst].name = strdup(name)) == NULL)
+                        err_quit("(%s) error - out of memory", prog_name);
+                    nst++;
+                }
+            }
+
+            memmove(in, in + V2_HDRLEN + f.length, inlen - V2_HDRLEN - f.length);
+            inlen -= V2_HDRLEN + f.length;
+            if (inlen == 0)
+                tw_del(&c->tw, &c->header);
+        }
+        if (inlen == sizeof(in))
+        {
+            err_msg("%d\t%s - (%s) error - request too long, closing..", c->pid, c->host, prog_name);
+            break;
+        }
+
+        /* responses, until the socket is full */
+        for (;;)
+        {
+            if (chunk == 0 && dhdrsent == V2_HDRLEN)
+            {
+                /* between two DATA frames: control first, then the next chunk */
+                if (ctllen > 0)
+                {
+                    if ((n = send(c->fd, ctl, ctllen, MSG_DONTWAIT)) < 0)
+                    {
+                        broken = !would_block();
+                        break;
+                    }
+                    memmove(ctl, ctl + n, ctllen - n);
+                    ctllen -= n;
+                    written += n;
+                    continue;
+                }
+
+                /* files completed (the empty ones need no DATA at all) */
+                now = tw_now_ms();
+                for (i = 0; i < nst; i++)
+                    if (st[i].offset == st[i].end)
+                    {
+                        if (!st[i].started)
+                            sched_started(&st[i], &q, now);
+                        stats_request(STATS_OK);
+                        log_msg(c->pid, c->host, "file {%s} sent, queued %lu ms.", st[i].name,
+                                (unsigned long)st[i].queued);
+                        if (st[i].owned)
+                            close(st[i].fd);
+                        free(st[i].name);
+                        st[i] = st[--nst];
+                        if (cur == i)
+                            turn = 0; /* the next one starts its turn */
+                        else if (cur == nst)
+                            cur = i; /* moved */
+                        i--;
+                    }
+                if (nst == 0)
+                    break;
+
+                if (turn == 0 || turn == st[cur].weight)
+                {
+                    cur = sched_pick(st, nst, now);
+                    turn = 0;
+                    if (sched_prio[st[cur].urgency] != prio)
+                    {
+                        prio = sched_prio[st[cur].urgency];
+                        setsockopt(c->fd, SOL_SOCKET, SO_PRIORITY, &prio, sizeof(prio));
+                    }
+                }
+                turn++;
+                if (!st[cur].started)
+                    sched_started(&st[cur], &q, now);
+                st[cur].served = now;
+
+                chunk = st[cur].end - st[cur].offset < V2_CHUNK ? st[cur].end - st[cur].offset : V2_CHUNK;
+                f.opcode = V2_DATA;
+                f.flags = 0;
+                f.id = st[cur].id;
+                f.length = chunk;
+                v2_pack(dhdr, &f);
+                dhdrsent = 0;
+            }
+
+            if (dhdrsent < V2_HDRLEN)
+            {
+                if ((n = send(c->fd, dhdr + dhdrsent, V2_HDRLEN - dhdrsent, MSG_DONTWAIT | MSG_MORE)) < 0)
+                {
+                    broken = !would_block();
+                    break;
+                }
+                dhdrsent += n;
+                written += n;
+                continue;
+            }
+
+            /* a file truncated meanwhile cannot complete its frame */
+            slice = shape_slice(chunk);
+            conn_pace(c, slice);
+            if ((n = sendfile(c->fd, st[cur].fd, &st[cur].offset, slice)) < (ssize_t)slice)
+                shape_refund(n > 0 ? slice - n : slice);
+            if (n <= 0)
+            {
+                broken = n == 0 || !would_block();
+                break;
+            }
+            chunk -= n;
+            written += n;
+            stats_sent(n);
+        }
+        if (broken)
+        {
+            err_msg("%d\t%s - (%s) error - sendfile failed, disconnected.", c->pid, c->host, prog_name);
+            break;
+        }
+
+        /* MIN_SEND_RATE on the whole connection */
+        if (written - mark >= (off_t)MIN_SEND_RATE * SEND_TIMEOUT / 1000)
+        {
+            mark = written;
+            tw_add(&c->tw, &c->progress, tw_now_ms() + SEND_TIMEOUT);
+        }
+        stats_tcp(0);
+    }
+
+out:
+    /* the files still in flight are not going to complete */
+    if (nst > 0)
+        stats_sendfile_error(c->expired != NULL);
+    for (i = 0; i < nst; i++)
+    {
+        stats_request(STATS_BROKEN);
+        if (st[i].owned)
+            close(st[i].fd);
+        free(st[i].name);
+    }
+    tw_del(&c->tw, &c->progress);
+    tw_del(&c->tw, &c->header);
+    fcntl(c->fd, F_SETFL, flags);
+}
+
+static int send_error2(struct conn *c, uint32_t id, uint32_t code)
+{
+    unsigned char frame[V2_HDRLEN + 4];
+    struct v2_frame f;
+
+    stats_request(code == V2_ENOENT ? STATS_NOT_FOUND : STATS_INVALID);
+    f.opcode = V2_ERROR;
+    f.flags = 0;
+    f.id = id;
+    f.length = 4;
+    v2_pack(frame, &f);
+    code = htonl(code);
+    memcpy(frame + V2_HDRLEN, &code, 4);
+
+    if (writen(c->fd, frame, V2_HDRLEN + 4) != V2_HDRLEN + 4)
+    {
+        err_ret("%d\t%s - (%s) error - writen failed", c->pid, c->host, prog_name);
+        return -1;
+    }
+
+    return 0;
+}
+
+/****************************************************************************
+ * "-ERR" for a request that cannot be served. With KEEP the reply is
+ *
+ *   |-|E|R|R|CR|LF|C1|C2|C3|C4|
+ *
+ * with the error code of protocol 2 (V2_ENOENT, V2_EINVAL) in network byte
+ * order, and the connection goes on: 0. Otherwise it must be closed: -1.
+ ****************************************************************************/
+static int send_err(struct conn *c, uint32_t code)
+{
+    char buf[10];
+
+    stats_request(code == V2_ENOENT ? STATS_NOT_FOUND : STATS_INVALID);
+    memcpy(buf, "-ERR\r\n", 6);
+    code = htonl(code);
+    memcpy(buf + 6, &code, 4);
+
+    if (writen(c->fd, buf, c->keep ? 10 : 6) != (c->keep ? 10 : 6))
+    {
+        err_ret("%d\t%s - (%s) error - writen failed", c->pid, c->host, prog_name);
+        return -1;
+    }
+
+    return c->keep ? 0 : -1;
+}
+
+/* use the stat() function to retrieve the dimension */
+unsigned get_file_size(const char *file_name)
+{
+    struct stat sb;
+    if (stat(file_name, &sb) != 0)
+        return -1;
+
+    return sb.st_size;
+}
+
+/* use the stat() function to retrieve the "last modified" timestamp */
+unsigned get_file_timestamp(const char *file_name)
+{
+    struct stat sb;
+    if (stat(file_name, &sb) != 0)
+        return -1;
+
+    return sb.st_mtime;
+}
+
+/****************************************************************************
+ * LIST: the regular files under "dir", recursively, one per line as
+ *
+ *   <size> <timestamp> <name>\n
+ *
+ * where name is the one to use in a GET. The listing is sent like a file,
+ * after "+OK", its dimension and the timestamp of the directory. The walk
+ * goes through descriptors from openat_beneath(), so no symbolic link takes
+ * it out of the working directory. Returns 0, -1 if the directory cannot be
+ * listed (nothing sent), -2 if the send failed.
+ ****************************************************************************/
+static int serve_list(struct conn *c, const char *dir)
+{
+    FILE *list_out;
+    struct stat sb;
+    uint32_t dimension, timestamp;
+    char hdr[13], path[PATH_MAX];
+    off_t size;
+    int r = 0, fd;
+
+    if (strlen(dir) >= sizeof(path) || (fd = openat_beneath(dir, O_RDONLY | O_DIRECTORY)) < 0)
+        return -1;
+    if (fstat(fd, &sb) < 0 || (list_out = tmpfile()) == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+
+    strcpy(path, dir);
+    if (list_dir(list_out, fd, path, strlen(path)) < 0 || fflush(list_out) != 0)
+    {
+        fclose(list_out);
+        return -1;
+    }
+    size = ftello(list_out);
+
+    dimension = htonl((uint32_t)size);
+    timestamp = htonl((uint32_t)sb.st_mtime);
+    memcpy(hdr, "+OK\r\n", 5);
+    memcpy(hdr + 5, &dimension, 4);
+    memcpy(hdr + 9, &timestamp, 4);
+
+    if (sendn(c->fd, hdr, 13, size > 0 ? MSG_MORE : 0) != 13 || conn_sendfile(c, fileno(list_out), 0, size) != size)
+        r = -2;
+
+    fclose(list_out);
+    return r;
+}
+
+/****************************************************************************
+ * STATS: the counters of the server (see stats.c) in the Prometheus text
+ * format, sent like a file after "+OK", its dimension and the current time.
+ * Returns 0, -1 if not available (nothing sent), -2 if the send failed.
+ ****************************************************************************/
+static int serve_stats(struct conn *c)
+{
+    uint32_t dimension, timestamp;
+    char hdr[13], *text = NULL;
+    size_t size = 0;
+    FILE *fp;
+    int r = 0;
+
+    if ((fp = open_memstream(&text, &size)) == NULL)
+        return -1;
+    r = stats_write(fp);
+    if (fclose(fp) != 0 || r < 0)
+    {
+        free(text);
+        return -1;
+    }
+
+    dimension = htonl((uint32_t)size);
+    timestamp = htonl((uint32_t)time(NULL));
+    memcpy(hdr, "+OK\r\n", 5);
+    memcpy(hdr + 5, &dimension, 4);
+    memcpy(hdr + 9, &timestamp, 4);
+
+    if (sendn(c->fd, hdr, 13, size > 0 ? MSG_MORE : 0) != 13 || writen(c->fd, text, size) != (ssize_t)size)
+        r = -2;
+
+    free(text);
+    return r;
+}
+
+/**********************************************************************************
+ * PUT: receive the content into a temporary file next to "filename", preallocated
+ * so that a full disk is found before the transfer (and the file is not fragmented),
+ * sync it according to put_policy and rename it in place; the reply is the "+OK"
+ * message of a GET, without the content. The directory is resolved beneath the
+ * working directory as the GETs are (a symbolic link cannot lead the upload out of
+ * the tree) and everything else is done relative to it: creation, rename, fsync().
+ * Returns 0, -1 if refused (nothing stored, "-ERR" to send), -2 if the connection failed.
+ **********************************************************************************/
+static int serve_put(struct conn *c, const char *filename)
+{
+    static unsigned serial; /* of the temporary names of this process */
+    char tmp[PATH_MAX], dir[PATH_MAX], hdr[13], *slash;
+    const char *base;
+    uint32_t dimension, timestamp;
+    struct timespec times[2];
+    int fd = -1, dirfd, tries;
+
+    /* size and timestamp are still part of the command */
+    if (Readn_timeo(c, hdr, 8) != 8)
+        return -2;
+    tw_del(&c->tw, &c->header);
+
+    memcpy(&dimension, hdr, 4);
+    memcpy(&timestamp, hdr + 4, 4);
+    dimension = ntohl(dimension);
+    timestamp = ntohl(timestamp);
+
+    if (put_policy == PUT_DISABLED || outside(filename) || filename[0] == '\0' ||
+        filename[strlen(filename) - 1] == '/' || snprintf(dir, sizeof(dir), "%s", filename) >= (int)sizeof(dir))
+        return -1;
+
+    /* "a/b/c": directory "a/b", name "c" */
+    if ((slash = strrchr(dir, '/')) != NULL)
+    {
+        *slash = '\0';
+        base = filename + (slash - dir) + 1;
+    }
+    else
+        base = filename;
+    if ((dirfd = openat_beneath(slash != NULL ? dir : ".", O_RDONLY | O_DIRECTORY)) < 0)
+        return -1;
+
+    for (tries = 0; fd < 0 && tries < 16; tries++)
+    {
+        if (snprintf(tmp, sizeof(tmp), "%s.put-%d-%u", base, c->pid, serial++) >= (int)sizeof(tmp))
+            break;
+        if ((fd = openat(dirfd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC | O_NOFOLLOW, 0644)) < 0 && errno != EEXIST)
+            break;
+    }
+    if (fd < 0)
+    {
+        close(dirfd);
+        return -1;
+    }
+
+    if (dimension > 0 && fallocate(fd, 0, 0, dimension) < 0 && errno != EOPNOTSUPP)
+    {
+        err_ret("%d\t%s - (%s) error - cannot reserve %lu bytes for {%s}", c->pid, c->host, prog_name,
+                (unsigned long)dimension, filename);
+        unlinkat(dirfd, tmp, 0);
+        close(fd);
+        close(dirfd);
+        return -1;
+    }
+
+    if (conn_splice(c, fd, dimension) != dimension)
+    {
+        unlinkat(dirfd, tmp, 0);
+        close(fd);
+        close(dirfd);
+        return -2;
+    }
+
+    times[0].tv_sec = times[1].tv_sec = timestamp;
+    times[0].tv_nsec = times[1].tv_nsec = 0;
+    futimens(fd, times);
+
+    /* the name itself is replaced, were it a symbolic link */
+    if ((put_policy == PUT_DATA && fdatasync(fd) < 0) || (put_policy == PUT_FULL && fsync(fd) < 0) ||
+        renameat(dirfd, tmp, dirfd, base) < 0)
+    {
+        err_ret("%d\t%s - (%s) error - cannot store {%s}", c->pid, c->host, prog_name, filename);
+        unlinkat(dirfd, tmp, 0);
+        close(fd);
+        close(dirfd);
+        return -1;
+    }
+    close(fd);
+
+    /* the other workers must not answer from what they knew of the old file */
+    cache_forget(filename);
+
+    /* the new name is durable only once the directory is */
+    if (put_policy == PUT_FULL)
+        fsync(dirfd);
+    close(dirfd);
+
+    dimension = htonl(dimension);
+    timestamp = htonl(timestamp);
+    memcpy(hdr, "+OK\r\n", 5);
+    memcpy(hdr + 5, &dimension, 4);
+    memcpy(hdr + 9, &timestamp, 4);
+
+    return writen(c->fd, hdr, 13) == 13 ? 0 : -2;
+}
+
+/* the path is absolute or goes up with "..": not in the working directory */
+static int outside(const char *path)
+{
+    size_t len = strlen(path);
+
+    return path[0] == '/' || strcmp(path, "..") == 0 || strncmp(path, "../", 3) == 0 || strstr(path, "/../") != NULL ||
+           (len >= 3 && strcmp(path + len - 3, "/..") == 0);
+}
+
+/*****************************************************************************
+ * open "name" for reading beneath the working directory, with the descriptor
+ * opened once per process: openat2() with RESOLVE_BENEATH refuses absolute
+ * names, ".." and symbolic links that would leave the tree, in the same path
+ * walk that opens the file; then fstat() on the descriptor, in *sb. Only
+ * regular files are served. Returns the descriptor, -1 on error.
+ *****************************************************************************/
+static int open_beneath(const char *name, struct stat *sb)
+{
+    int fd;
+
+    if ((fd = openat_beneath(name, O_RDONLY | O_NOCTTY)) < 0)
+        return fd;
+
+    /* the protocol has 32 bit dimensions */
+    if (fstat(fd, sb) < 0 || !S_ISREG(sb->st_mode) || sb->st_size > UINT32_MAX)
+    {
+        close(fd);
+        errno = EINVAL; /* there, but not to be served: not ENOENT */
+        return -1;
+    }
+
+    return fd;
+}
+
+/*****************************************************************************
+ * after open_beneath(): what the filesystem said about "name" is kept in the
+ * shared cache for the other workers. A file the cache found (known) is held
+ * to the fstat() of the descriptor just opened, no path walk: if it has been
+ * replaced or changed meanwhile the entry is refreshed. A file the cache
+ * found, and that is gone, is recorded as missing.
+ *****************************************************************************/
+static void learn(const char *name, int fd, const struct stat *sb, int known, const struct meta_entry *cached)
+{
+    if (fd >= 0 && known == META_FOUND &&
+        ((uint64_t)sb->st_ino != cached->ino || (uint64_t)sb->st_size != cached->size || (uint32_t)sb->st_mtime != cached->mtime))
+        known = META_UNKNOWN;
+
+    if (fd >= 0 && known == META_UNKNOWN)
+        cache_put(name, sb);
+    else if (fd < 0 && known != META_MISSING && errno == ENOENT)
+        cache_put(name, NULL);
+}
+
+/* the openat2() of open_beneath(), with the given flags (O_CLOEXEC added); also for directories */
+static int openat_beneath(const char *name, int flags)
+{
+    struct open_how how;
+    int fd;
+
+    if (root_fd < 0 && (root_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return -1;
+
+    memset(&how, 0, sizeof(how));
+    how.flags = flags | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+    /* kernels before 5.6: the lexical check of outside() is all there is */
+    if ((fd = syscall(SYS_openat2, root_fd, name, &how, sizeof(how))) < 0 && errno == ENOSYS)
+        fd = outside(name) ? -1 : openat(root_fd, name, flags | O_CLOEXEC);
+
+    return fd;
+}
+
+/******************************************************************************
+ * the regular files beneath the directory open on "dirfd" (closed here) go in
+ * the listing "out", named from "path" (len bytes, a buffer of PATH_MAX). The
+ * subdirectories are opened relative to their parent without following links,
+ * a directory that cannot be read is skipped. Returns 0, -1 on error.
+ ******************************************************************************/
+static int list_dir(FILE *out, int dirfd, char *path, size_t len)
+{
+    DIR *d;
+    struct dirent *de;
+    struct stat sb;
+    size_t n;
+    int fd, r = 0;
+
+    if ((d = fdopendir(dirfd)) == NULL)
+    {
+        close(dirfd);
+        return -1;
+    }
+
+    while (r == 0 && (de = readdir(d)) != NULL)
+    {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+
+        /* a name with a newline could not be told apart from the next entry, a longer one asked with a GET */
+        n = strlen(de->d_name);
+        if (strchr(de->d_name, '\n') != NULL || len + 1 + n >= PATH_MAX)
+            continue;
+        path[len] = '/';
+        memcpy(path + len + 1, de->d_name, n + 1);
+
+        if (fstatat(dirfd, de->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0)
+            continue; /* gone meanwhile */
+
+        if (S_ISDIR(sb.st_mode))
+        {
+            if ((fd = openat(dirfd, de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) >= 0)
+                r = list_dir(out, fd, path, len + 1 + n);
+        }
+        else if (S_ISREG(sb.st_mode))
+            fprintf(out, "%lu %lu %s\n", (unsigned long)sb.st_size, (unsigned long)sb.st_mtime,
+                    strncmp(path, "./", 2) == 0 ? path + 2 : path);
+    }
+
+    path[len] = '\0';
+    closedir(d);
+    return r;
+}
+
+/* timer wheel callback: remember which deadline of the connection fired */
+static void conn_expire(struct tw_timer *t, void *arg)
+{
+    struct conn *c = arg;
+
+    if (c->expired == NULL)
+        c->expired = t;
+}
+
+/* log the deadline that caused the connection to be closed */
+static void conn_timeout_msg(struct conn *c)
+{
+    const char *what;
+
+    if (c->expired == &c->idle)
+        what = "idle";
+    else if (c->expired == &c->header)
+        what = "request";
+    else if (c->expired == &c->progress)
+        what = "transfer progress";
+    else
+        return;
+
+    err_msg("%d\t%s - (%s) error - %s timeout: closing connection..", c->pid, c->host, prog_name, what);
+}
+
+/**************************************************************************
+ * wait until the socket is ready for "events" or one of the deadlines of
+ * the connection expires; returns 1 if ready, 0 on expiry, -1 on error
+ **************************************************************************/
+int conn_wait(struct conn *c, short events)
+{
+    struct pollfd pfd;
+    int n;
+
+    pfd.fd = c->fd;
+    pfd.events = events;
+
+    for (;;)
+    {
+        tw_advance(&c->tw, tw_now_ms());
+        if (c->expired != NULL)
+            return 0;
+
+        pfd.revents = 0;
+        if ((n = poll(&pfd, 1, tw_next_timeout(&c->tw, tw_now_ms()))) > 0)
+            return 1;
+        if (n < 0 && !INTERRUPTED_BY_SIGNAL)
+            return -1;
+    }
+}
+
+/* modified Readn to handle the connection deadlines on input during reading */
+ssize_t Readn_timeo(struct conn *c, void *ptr, size_t nbytes)
+{
+    ssize_t n;
+    size_t nleft = nbytes;
+    char *p = ptr;
+
+    while (nleft > 0)
+    {
+        if ((n = conn_wait(c, POLLIN)) <= 0)
+        {
+            if (n == 0)
+                conn_timeout_msg(c);
+            else
+                err_ret("%d\t%s - (%s) error - poll() failed", c->pid, c->host, prog_name);
+            return -1;
+        }
+
+        if ((n = recv(c->fd, p, nleft, MSG_DONTWAIT)) < 0)
+        {
+            if (errno == EWOULDBLOCK || INTERRUPTED_BY_SIGNAL)
+                continue;
+            err_ret("%d\t%s - (%s) error - readn() failed", c->pid, c->host, prog_name);
+            return -1;
+        }
+        else if (n == 0)
+            break; /* EOF */
+
+        nleft -= n;
+        p += n;
+    }
+
+    return nbytes - nleft;
+}
+
+/* readline_unbuffered() that waits for every byte under the connection deadlines */
+ssize_t readline_timeo(struct conn *c, void *vptr, size_t maxlen)
+{
+    int n, rc;
+    char ch, *ptr;
+
+    ptr = vptr;
+    for (n = 1; n < maxlen; n++)
+    {
+    again:
+        if ((rc = recv(c->fd, &ch, 1, MSG_DONTWAIT)) == 1)
+        {
+            *ptr++ = ch;
+            if (ch == '\n')
+                break; /* newline is stored, like fgets() */
+        }
+        else if (rc == 0)
+        {
+            if (n == 1)
+                return 0; /* EOF, no data read */
+            else
+                break; /* EOF, some data was read */
+        }
+        else if (errno == EWOULDBLOCK || INTERRUPTED_BY_SIGNAL)
+        {
+            if (conn_wait(c, POLLIN) <= 0)
+                return -1;
+            goto again;
+        }
+        else
+            return -1; /* error, errno set by recv() */
+    }
+    *ptr = 0; /* null terminate like fgets() */
+    return n;
+}
+
+/*****************************************************************************
+ * sendfile() in slices on a non-blocking socket, "count" bytes from "start"
+ * of filefd: the progress deadline is pushed forward every time MIN_SEND_RATE
+ * * SEND_TIMEOUT bytes go out, so a stalled (or too slow) client is reaped
+ * instead of holding the process. Returns the number of bytes sent.
+ *
+ * The page cache is managed per transfer: READAHEAD_WINDOW bytes are kept
+ * read ahead of the cursor, so a cold file does not stall every slice on a
+ * synchronous read; a transfer of DROP_BEHIND_SIZE bytes or more is read
+ * sequentially once, so what has been sent is dropped instead of evicting
+ * the small hot files. Once the first slice is out, the next pipelined
+ * request is prefetched too.
+ *****************************************************************************/
+off_t conn_sendfile(struct conn *c, int filefd, off_t start, off_t count)
+{
+    off_t offset = start, mark = start, end = start + count;
+    off_t ahead = start, dropped = start;
+    int bulk = count >= DROP_BEHIND_SIZE;
+    ssize_t n;
+    int flags;
+
+    flags = fcntl(c->fd, F_GETFL, 0);
+    fcntl(c->fd, F_SETFL, flags | O_NONBLOCK);
+
+    tw_add(&c->tw, &c->progress, tw_now_ms() + SEND_TIMEOUT);
+
+    if (bulk)
+        posix_fadvise(filefd, start, count, POSIX_FADV_SEQUENTIAL);
+
+    while (offset < end)
+    {
+        size_t slice = end - offset < SEND_SLICE ? end - offset : SEND_SLICE;
+
+        /* the next window is requested when half of the previous one has been sent */
+        if (ahead < end && ahead - offset < READAHEAD_WINDOW / 2)
+        {
+            off_t len = end - ahead < READAHEAD_WINDOW ? end - ahead : READAHEAD_WINDOW;
+
+            readahead(filefd, ahead, len);
+            ahead += len;
+        }
+
+        /* the bandwidth limits (see shape.h) decide how much goes, and when */
+        slice = shape_slice(slice);
+        conn_pace(c, slice);
+        if ((n = sendfile(c->fd, filefd, &offset, slice)) < (ssize_t)slice)
+            shape_refund(n > 0 ? slice - n : slice);
+
+        if (n > 0)
+        {
+            if (offset - mark >= (off_t)MIN_SEND_RATE * SEND_TIMEOUT / 1000)
+            {
+                mark = offset;
+                tw_add(&c->tw, &c->progress, tw_now_ms() + SEND_TIMEOUT);
+            }
+
+            /* pages still queued in the socket are busy, the kernel keeps them */
+            if (bulk && offset - dropped >= READAHEAD_WINDOW)
+            {
+                posix_fadvise(filefd, dropped, offset - dropped, POSIX_FADV_DONTNEED);
+                dropped = offset;
+            }
+
+            if (!c->prefetched)
+                prefetch_next(c);
+            stats_tcp(0);
+        }
+        else if (n == 0)
+            break; /* the file has been truncated meanwhile */
+        else if (errno == EAGAIN || INTERRUPTED_BY_SIGNAL)
+        {
+            if (conn_wait(c, POLLOUT) <= 0)
+                break;
+        }
+        else
+            break;
+    }
+
+    tw_del(&c->tw, &c->progress);
+    fcntl(c->fd, F_SETFL, flags);
+
+    stats_sent(offset - start);
+    if (offset < end)
+        stats_sendfile_error(c->expired != NULL);
+
+    if (bulk && offset > dropped)
+        posix_fadvise(filefd, dropped, offset - dropped, POSIX_FADV_DONTNEED);
+
+    return offset - start;
+}
+
+/**************************************************************************
+ * wait for the bandwidth limits to let "len" more bytes go: the wait is
+ * the server's, not the client's, so the progress deadline starts again
+ **************************************************************************/
+static void conn_pace(struct conn *c, size_t len)
+{
+    uint64_t wait;
+
+    if ((wait = shape_take(len)) == 0)
+        return;
+
+    shape_sleep(wait);
+    if (tw_pending(&c->progress))
+        tw_add(&c->tw, &c->progress, tw_now_ms() + SEND_TIMEOUT);
+}
+
+/******************************************************************************
+ * a pipelining client has sent the next GET while this response is going out:
+ * peek at it (the request stays in the socket) and start reading the first
+ * READAHEAD_WINDOW bytes of that file, so it is in the page cache when served.
+ * Tried again after every slice until the whole request line has arrived.
+ ******************************************************************************/
+static void prefetch_next(struct conn *c)
+{
+    char line[NAMELEN + V2_HDRLEN], *name, *crlf;
+    struct pack_entry packed;
+    struct meta_entry indexed;
+    struct v2_frame f;
+    struct stat sb;
+    ssize_t n;
+    int fd;
+
+    if ((n = recv(c->fd, line, sizeof(line) - 1, MSG_PEEK | MSG_DONTWAIT)) <= 0)
+        return;
+    line[n] = '\0';
+
+    if ((unsigned char)line[0] == V2_MAGIC)
+    {
+        /* protocol 2: the name is the payload of a GET frame */
+        if (n < V2_HDRLEN)
+            return;
+        if (v2_unpack((unsigned char *)line, &f) < 0 || f.opcode != V2_GET || f.length >= NAMELEN)
+        {
+            c->prefetched = 1;
+            return;
+        }
+        if (n < V2_HDRLEN + (ssize_t)f.length)
+            return;
+        name = line + V2_HDRLEN;
+        name[f.length] = '\0';
+    }
+    else
+    {
+        if (n >= 4 && strncmp(line, "GET ", 4) != 0)
+        {
+            c->prefetched = 1; /* not a GET */
+            return;
+        }
+        if ((crlf = strstr(line, "\r\n")) == NULL)
+        {
+            c->prefetched = n == sizeof(line) - 1; /* too long to be served anyway */
+            return;
+        }
+        *crlf = '\0';
+        name = line + 4;
+    }
+    c->prefetched = 1;
+
+    /* the same order of serve() */
+    if (outside(name))
+        return;
+    if (serve_pack != NULL && pack_lookup(serve_pack, name, &packed) == 0)
+    {
+        readahead(packed.fd, packed.offset, packed.length < READAHEAD_WINDOW ? packed.length : READAHEAD_WINDOW);
+        return;
+    }
+    if (serve_meta != NULL && meta_lookup(serve_meta, name, &indexed) == META_MISSING)
+        return;
+    if ((fd = open_beneath(name, &sb)) < 0)
+        return;
+    readahead(fd, 0, sb.st_size < READAHEAD_WINDOW ? sb.st_size : READAHEAD_WINDOW);
+    close(fd);
+}
+
+/*****************************************************************************
+ * receiving counterpart of conn_sendfile(): "count" bytes from the socket to
+ * filefd with splice() through a pipe, so the content never goes through user
+ * space either; same progress deadline. Returns the number of bytes stored.
+ *****************************************************************************/
+off_t conn_splice(struct conn *c, int filefd, off_t count)
+{
+    off_t done = 0, mark = 0;
+    ssize_t n, m;
+    int p[2], flags;
+
+    if (pipe(p) < 0)
+        return 0;
+    fcntl(p[1], F_SETPIPE_SZ, RECV_SLICE);
+
+    flags = fcntl(c->fd, F_GETFL, 0);
+    fcntl(c->fd, F_SETFL, flags | O_NONBLOCK);
+
+    tw_add(&c->tw, &c->progress, tw_now_ms() + SEND_TIMEOUT);
+
+    while (done < count)
+    {
+        size_t slice = count - done < RECV_SLICE ? count - done : RECV_SLICE;
+
+        if ((n = splice(c->fd, NULL, p[1], NULL, slice, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) > 0)
+        {
+            /* the pipe is emptied at once: it is only a buffer between the socket and the file */
+            while (n > 0 && (m = splice(p[0], NULL, filefd, NULL, n, SPLICE_F_MOVE)) > 0)
+            {
+                n -= m;
+                done += m;
+            }
+            if (n > 0)
+                break;
+
+            if (done - mark >= (off_t)MIN_SEND_RATE * SEND_TIMEOUT / 1000)
+            {
+                mark = done;
+                tw_add(&c->tw, &c->progress, tw_now_ms() + SEND_TIMEOUT);
+            }
+        }
+        else if (n == 0)
+            break; /* EOF, the upload is incomplete */
+        else if (errno == EAGAIN || INTERRUPTED_BY_SIGNAL)
+        {
+            if (conn_wait(c, POLLIN) <= 0)
+                break;
+        }
+        else
+            break;
+    }
+
+    tw_del(&c->tw, &c->progress);
+    fcntl(c->fd, F_SETFL, flags);
+    close(p[0]);
+    close(p[1]);
+
+    return done;
 }
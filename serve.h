@@ -25,18 +25,101 @@
 #include <errno.h>
 #include <string.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
 
 #include "errlib.h"
 #include "sockwrap.h"
+#include "timewheel.h"
+#include "pack.h"
+#include "meta.h"
+#include "cache.h"
+#include "shape.h"
+#include "proto2.h"
+#include "hist.h"
+#include "stats.h"
+#include "log.h"
 
 #define BUFFLEN 64
+#define NAMELEN PATH_MAX /* longest command line carrying a name, CR LF included */
+
+/*********************************************************************
+ * connection deadlines (milliseconds), tracked by a timer wheel in
+ * serve() instead of a fixed SO_RCVTIMEO on the connected socket
+ *********************************************************************/
+#define IDLE_TIMEOUT 55000   /* waiting for the next command */
+#define HEADER_TIMEOUT 10000 /* receiving a whole command once it started */
+#define SEND_TIMEOUT 10000   /* window in which MIN_SEND_RATE must be kept */
+#define MIN_SEND_RATE 1024   /* bytes/s, slower transfers are reaped */
+#define SEND_SLICE 262144    /* maximum bytes for a single sendfile() */
+#define RECV_SLICE 262144    /* pipe size, so maximum bytes for a single splice() of an upload */
+
+/* page cache policy of the files sent (see conn_sendfile()) */
+#define READAHEAD_WINDOW 4194304  /* bytes read ahead of the send cursor, and of the next pipelined file */
+#define DROP_BEHIND_SIZE 67108864 /* transfers this big are dropped from the page cache once sent */
+
+/*****************************************************************************
+ * scheduling of the files in flight on a multiplexed connection (see
+ * sched_pick() in serve.c): a level of urgency is worth SCHED_URGENCY bytes
+ * less to send, a millisecond without a turn SCHED_AGING bytes less
+ *****************************************************************************/
+#define SCHED_URGENCY 1073741824
+#define SCHED_AGING 1048576
+
+/* what to wait for before an uploaded file (PUT) is renamed in place and acknowledged */
+#define PUT_DISABLED 0 /* uploads refused with "-ERR" */
+#define PUT_NOSYNC 1   /* nothing, the page cache is written back by the kernel */
+#define PUT_DATA 2     /* fdatasync() of the file */
+#define PUT_FULL 3     /* fsync() of the file, and of the directory after the rename */
+
+/* state of a connection being served */
+struct conn
+{
+    int fd;                            /* connected socket */
+    char *host;                        /* printable address of the client */
+    int pid;                           /* PID of the serving process */
+    int local;                         /* Unix domain connection, OPEN allowed */
+    struct timewheel tw;               /* deadlines of this connection */
+    struct tw_timer idle;              /* waiting for a command */
+    struct tw_timer header;            /* reading a command */
+    struct tw_timer progress;          /* sending (or receiving) a file */
+    struct tw_timer *expired;          /* deadline that fired, NULL if none */
+    int prefetched;                    /* the next pipelined request has been looked at */
+    int keep;                          /* KEEP negotiated: "-ERR" carries a code, the connection goes on */
+};
+
+/*****************************************************************
+ * results of serve_miss(), the hook called by serve() for a file
+ * that is not in the working directory (NULL in the servers, set
+ * by the proxy to fetch it from upstream)
+ *****************************************************************/
+#define MISS_CACHED 0  /* the file is in the working directory now, serve it as usual */
+#define MISS_SENT 1    /* the whole response has been sent */
+#define MISS_ERR -1    /* not available: reply "-ERR" and close */
+#define MISS_BROKEN -2 /* the response was interrupted, just close */
+
+extern int (*serve_miss)(struct conn *c, const char *filename);
+
+extern int put_policy; /* PUT_*, set by the server */
+
+extern struct pack *serve_pack; /* packed archive opened by the server (see pack.h), NULL if none */
+
+extern struct meta *serve_meta; /* metadata index of the working directory (see meta.h), NULL if none */
 
 void serve(int connfd, char *host);
 
+int conn_wait(struct conn *c, short events);
+
+off_t conn_sendfile(struct conn *c, int filefd, off_t start, off_t count);
+
+off_t conn_splice(struct conn *c, int filefd, off_t count);
+
+ssize_t readline_timeo(struct conn *c, void *vptr, size_t maxlen);
+
 unsigned get_file_size(const char *file_name);
 
 unsigned get_file_timestamp(const char *file_name);
 
-ssize_t Readn_timeo(int fd, void *ptr, size_t nbytes, char *hostname);
+ssize_t Readn_timeo(struct conn *c, void *ptr, size_t nbytes);
 
 #endif
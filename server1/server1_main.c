@@ -28,6 +28,52 @@
   * 
   * (6 characters) and then it closes the connection with the client.
   * 
+  * A client that sends |K|E|E|P|CR|LF| gets "+OK\r\n" back and from then on a GET (or LIST) that cannot be
+  * served does not close the connection: "-ERR\r\n" is followed by a 4 byte error code in network byte order
+  * (the codes of protocol 2, see proto2.h). Malformed commands, and a refused PUT whose content is on its way,
+  * still close it.
+  * 
+  *                                                   LISTING
+  * 
+  * |L|I|S|T| |...directory...|CR|LF|   (or just |L|I|S|T|CR|LF| for the working directory)
+  * 
+  * is answered like a GET, with a text "file" listing the regular files under the directory, one per line as
+  * "<size> <timestamp> <name>\n" (name ready for a GET); client1 -M uses it to mirror a directory.
+  * 
+  *                                                   PROTOCOL 2
+  * 
+  * A client that sends a HELLO frame as its first message (see proto2.h) gets a HELLO back and from then on
+  * talks in binary frames: a 16 byte header (magic, version, opcode, flags, request id, 64-bit length) and a
+  * payload, decoded at fixed offsets. GET carries the name, FILE the timestamp and the content, ERROR a code
+  * without closing the connection. A server that does not speak it replies "-ERR" to the HELLO.
+  * With the multiplexing capability many GETs can be in flight: FILE carries dimension and timestamp, the content
+  * comes in DATA frames tagged with the request id, interleaved across the files in flight: the most urgent
+  * (flags of the GET) first, then the shortest, with the ones waiting for long promoted so none starves. The
+  * queueing delay of every file (GET to first byte) is logged, and its mean and maximum when the client is served.
+  * 
+  *                                                   TIMING
+  * 
+  * Every GET is timed per phase (parse, lookup, open, header, send, and the total) into log-linear histograms
+  * shared by all the workers; on SIGUSR1 the server prints samples, mean, p50, p99, p999 and maximum of each
+  * phase, and STATS reports them too. Built with -DNO_HIST the timing is not compiled in.
+  * 
+  *                                                   STATISTICS
+  * 
+  * |S|T|A|T|S|CR|LF|
+  * 
+  * is answered like a GET, with a text "file" in the Prometheus exposition format: connections accepted and
+  * active, bytes sent, requests by outcome, transfers not completed, hits and misses of the archive, of the index
+  * and of the proxy cache, and for every connection being served its TCP_INFO (RTT, congestion window,
+  * retransmissions). The counters live in memory shared by all the workers; client1 -S prints them.
+  * 
+  *                                                   LOGGING
+  * 
+  * The messages of the workers are not printed by them: each process formats its records into a ring of its own in
+  * shared memory, without system calls or locks, and a separate process drains all the rings every few milliseconds
+  * with one write per batch, so the lines of different connections are never mixed. A process logging faster than
+  * LOG_RATE records per second, or faster than the rings are drained, loses records; the drops are counted, reported
+  * on standard error and in STATS.
+  * 
   * 
   * [ author: Luigi Ferrettino (S254300) ]
   *********************************************************************************************************************/
@@ -50,7 +96,6 @@ int main(int argc, char *argv[])
   struct sockaddr_storage ss;   /* opaque storage for socket addresses */
   socklen_t len;                /* size of the opeque storage */
   char ipstr[INET6_ADDRSTRLEN]; /* string that contains the IPv6 (or IPv4-MAPPED) conversion */
-  struct timeval timeout;       /* time variable to be used with conncetion timeout */
 
   /* store the program name from argv */
   prog_name = argv[0];
@@ -59,6 +104,9 @@ int main(int argc, char *argv[])
   if (argc != 2)
     err_quit("Usage: %s <port>", prog_name);
 
+  /* messages of serve() are written out by a separate process, not on the way of the transfers */
+  Log_init(LOG_FMT_TEXT);
+
   /**********************************************************************
    * tcp_listen by Stevens modified by Luigi Ferrettino in order to have
    * only IPv6 and IPv4-mapped IPv6, so one stack for both protocols.
@@ -72,11 +120,14 @@ int main(int argc, char *argv[])
    ***********************************************************************/
   Signal(SIGPIPE, SIG_IGN);
 
-  printf("ready\n\n");
+  /* counters answered to STATS, shared with the children */
+  Stats_init();
 
-  /* create the timeout */
-  timeout.tv_sec = 55;
-  timeout.tv_usec = 0;
+  /* per-phase timing of the GETs, printed on SIGUSR1 */
+  Hist_init();
+  Signal(SIGUSR1, hist_sig);
+
+  printf("ready\n\n");
 
   printf("PID\tMESSAGE\n");
 
@@ -86,12 +137,9 @@ int main(int argc, char *argv[])
     connfd = Accept(listenfd, (SA *)&ss, &len);
 
     /*********************************************************************************
-   * set the SO_RCVTIMEO option on the connected socket to not wait forever during
-   * operations of read/recv, specifying a timeval structure; then handle it through
-   * the EINWOULDBLOCK errno (like the API says) in the Readn_timeo() function
-   * implemented in recvfile.c
-   *********************************************************************************/
-    Setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout));
+     * no SO_RCVTIMEO on the connected socket: serve() keeps the idle, request and
+     * send progress deadlines of the connection on a timer wheel (see serve.h)
+     *********************************************************************************/
 
     /* get the IP address of the client */
     Getpeername(connfd, (SA *)&ss, &len);
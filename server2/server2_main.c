@@ -28,6 +28,113 @@
   * 
   * (6 characters) and then it closes the connection with the client.
   * 
+  * A client that sends |K|E|E|P|CR|LF| gets "+OK\r\n" back and from then on a GET (or LIST) that cannot be
+  * served does not close the connection: "-ERR\r\n" is followed by a 4 byte error code in network byte order
+  * (the codes of protocol 2, see proto2.h). Malformed commands, and a refused PUT whose content is on its way,
+  * still close it.
+  * 
+  *                                                   LISTING
+  * 
+  * |L|I|S|T| |...directory...|CR|LF|   (or just |L|I|S|T|CR|LF| for the working directory)
+  * 
+  * is answered like a GET, with a text "file" listing the regular files under the directory, one per line as
+  * "<size> <timestamp> <name>\n" (name ready for a GET); client1 -M uses it to mirror a directory.
+  * 
+  *                                                   PROTOCOL 2
+  * 
+  * A client that sends a HELLO frame as its first message (see proto2.h) gets a HELLO back and from then on
+  * talks in binary frames: a 16 byte header (magic, version, opcode, flags, request id, 64-bit length) and a
+  * payload, decoded at fixed offsets. GET carries the name, FILE the timestamp and the content, ERROR a code
+  * without closing the connection. A server that does not speak it replies "-ERR" to the HELLO.
+  * With the multiplexing capability many GETs can be in flight: FILE carries dimension and timestamp, the content
+  * comes in DATA frames tagged with the request id, interleaved across the files in flight: the most urgent
+  * (flags of the GET) first, then the shortest, with the ones waiting for long promoted so none starves. The
+  * queueing delay of every file (GET to first byte) is logged, and its mean and maximum when the client is served.
+  * 
+  *                                                   UPGRADE
+  * 
+  * Started with an upgrade socket path (-u), the server listens on that Unix socket too. A new server started on the
+  * same path connects to it and receives the listening sockets (SCM_RIGHTS) instead of creating new ones: the old
+  * server stops accepting, waits for its children to complete their transfers and then exits, so no connection
+  * is refused or dropped during a deploy.
+  * 
+  *                                                   LOCAL CLIENTS
+  * 
+  * With -l the server accepts the same protocol on a Unix domain socket too. There a client can also send:
+  * 
+  * |O|P|E|N| |...filename...|CR|LF|
+  * 
+  * and the server replies with the same "+OK" message of GET, but instead of the file content the open file
+  * descriptor is passed along with the message (SCM_RIGHTS), so the client can copy, reflink or map it directly.
+  * 
+  *                                                   UPLOADS
+  * 
+  * With -w <none|data|full> the server accepts files too:
+  * 
+  * |P|U|T| |...filename...|CR|LF|B1|B2|B3|B4|T1|T2|T3|T4|File content.........
+  * 
+  * with dimension and timestamp as in the GET response. The content is spliced from the socket into a temporary
+  * file, synced as requested (none, fdatasync() or fsync() of file and directory) and renamed in place; then the
+  * server replies with the "+OK" message of a GET, without the content.
+  * 
+  *                                                   PACKED ARCHIVE
+  * 
+  * With -p <archive> (built by packer) the names in the archive are served from its blobs with sendfile(), before
+  * the files of the working directory; the index is mapped once by the parent and shared by all the children.
+  * 
+  *                                                   METADATA INDEX
+  * 
+  * With -i <index file> the server keeps size, timestamp and inode of every file of the working directory in a
+  * memory-mapped hash index, updated by a watcher process through inotify: a GET for a missing file is refused
+  * without a path walk. An existing one is opened without access() and stat(), but the header always tells what the
+  * fstat() of the descriptor says, since the index may lag behind a writer. The index stays on disk, so a restart (or an upgrade)
+  * answers at once from it while the watcher scans the tree again; until the first scan of a new index completes,
+  * and for names behind symbolic links, the filesystem is asked as before.
+  * 
+  *                                                   SHARED CACHE
+  * 
+  * Without an index, what a child learns from the filesystem about a name (size, timestamp and inode of a regular
+  * file, or that there is no such file) goes into a cache of fixed size in memory shared by all the children and
+  * mapped by the server before the first accept, so missing names are refused without even an open() by the
+  * connections served next. A file found is still opened, and its fstat() (no path walk) must agree with the cache
+  * on inode, size and timestamp, otherwise the entry is refreshed and the file sent as it is now. An answer is
+  * trusted for CACHE_VALID milliseconds (-c, 0 disables the cache): a file created by other programs may be refused
+  * for that long; one stored by PUT is seen at once. No descriptor is kept. Slots are written by any child without
+  * locks and read lock-free.
+  * 
+  *                                                   BANDWIDTH
+  * 
+  * With -b <policy file> the content sent is limited per client address and for the whole server by token buckets
+  * in memory shared by all the children (see shape.h for the directives), so a bulk transfer cannot take the link
+  * from the interactive clients; addresses marked "unlimited" are exempt from both limits. The sends are cut into
+  * slices of a few milliseconds at the rate, and a child waits asleep when its slice is ahead of the buckets.
+  * On SIGHUP the file is read again and the new limits apply to the transfers in progress too; local clients
+  * are never limited.
+  * 
+  *                                                   TIMING
+  * 
+  * Every GET is timed per phase (parse, lookup, open, header, send, and the total) into log-linear histograms
+  * shared by all the workers; on SIGUSR1 the server prints samples, mean, p50, p99, p999 and maximum of each
+  * phase, and STATS reports them too. Built with -DNO_HIST the timing is not compiled in.
+  * 
+  *                                                   STATISTICS
+  * 
+  * |S|T|A|T|S|CR|LF|
+  * 
+  * is answered like a GET, with a text "file" in the Prometheus exposition format: connections accepted and
+  * active, bytes sent, requests by outcome, transfers not completed, slices delayed by the bandwidth limits, hits
+  * and misses of the archive, of the index, of the proxy cache and of the shared cache, and for every connection being served its TCP_INFO (RTT, congestion
+  * window, retransmissions). The counters live in memory shared by all the workers; client1 -S prints them.
+  * 
+  *                                                   LOGGING
+  * 
+  * The messages of the workers are not printed by them: each process formats its records into a ring of its own in
+  * shared memory, without system calls or locks, and a separate process drains all the rings every few milliseconds
+  * with one write per batch, so the lines of different connections are never mixed. A process logging faster than
+  * LOG_RATE records per second, or faster than the rings are drained, loses records; the drops are counted, reported
+  * on standard error and in STATS.
+  * With -j every record is a JSON object per line (ts, pid, level, host, msg).
+  * 
   * 
   * [ author: Luigi Ferrettino (S254300) ]
   *********************************************************************************************************************/
@@ -35,14 +142,19 @@
 #include <sys/time.h>
 #include <sys/wait.h>
 #include <sys/prctl.h>
+#include <fcntl.h>
 
 #include "../serve.h"
 
 /* GLOBAL VARIABLES */
 char *prog_name;
+int hup_pipe[2] = {-1, -1}; /* SIGHUP wakes up select() through it */
 
 /* PROTOTYPES */
 void sig_chld(int signo);
+void sig_hup(int signo);
+int takeover(const char *path, int *localfd);
+int handover(int ctlfd, int listenfd, int localfd, const char *path);
 
 /****************************************************************************
  * this server is a single-stack IPv6 that serves IPv4 too on a single socket
@@ -57,22 +169,98 @@ int main(int argc, char *argv[])
   socklen_t len;                /* sizeof the sockaddr */
   char ipstr[INET6_ADDRSTRLEN]; /* used to store the client network address */
   pid_t childpid;               /* pid of child process */
-  struct timeval timeout;
+  char *upgrade_path = NULL;    /* Unix socket used to hand over the listening sockets */
+  char *local_path = NULL;      /* Unix socket for clients on the same host */
+  int ctlfd = -1;               /* listening socket on upgrade_path */
+  int localfd = -1;             /* listening socket on local_path */
+  int opt, maxfd, readyfd;
+  fd_set rset;                  /* sockets to wait on with select() */
+  char *meta_path = NULL;       /* metadata index of the working directory */
+  pid_t watcher = -1;           /* process keeping the index current */
+  int warm;                     /* the index was already complete */
+  int log_format = LOG_FMT_TEXT; /* of the messages */
+  int cache_valid = CACHE_VALID; /* milliseconds an answer of the filesystem is shared, 0 for none */
+  char *policy_path = NULL;     /* bandwidth limits, read again on SIGHUP */
+  char c;
 
   /* for errlib to know the program name */
   prog_name = argv[0];
 
   /* check arguments */
-  if (argc != 2)
-    err_quit("Usage: %s <port>", prog_name);
+  while ((opt = getopt(argc, argv, "u:l:w:p:i:jc:b:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'u':
+      upgrade_path = optarg;
+      break;
+    case 'l':
+      local_path = optarg;
+      break;
+    case 'w':
+      if (strcmp(optarg, "none") == 0)
+        put_policy = PUT_NOSYNC;
+      else if (strcmp(optarg, "data") == 0)
+        put_policy = PUT_DATA;
+      else if (strcmp(optarg, "full") == 0)
+        put_policy = PUT_FULL;
+      else
+        err_quit("(%s) error - -w wants none, data or full", prog_name);
+      break;
+    case 'p':
+      serve_pack = Pack_open(optarg);
+      break;
+    case 'i':
+      meta_path = optarg;
+      break;
+    case 'j':
+      log_format = LOG_FMT_JSON;
+      break;
+    case 'c':
+      cache_valid = atoi(optarg);
+      break;
+    case 'b':
+      policy_path = optarg;
+      break;
+    default:
+      err_quit("Usage: %s [-u <upgrade socket>] [-l <local socket>] [-w <none|data|full>] [-p <archive>] [-i <index file>] [-j] [-c <milliseconds>] [-b <policy file>] <port>", prog_name);
+    }
+  }
+  if (optind != argc - 1)
+    err_quit("Usage: %s [-u <upgrade socket>] [-l <local socket>] [-w <none|data|full>] [-p <archive>] [-i <index file>] [-j] [-c <milliseconds>] [-b <policy file>] <port>", prog_name);
+
+  /* messages of serve() are written out by a separate process, not on the way of the transfers */
+  Log_init(log_format);
 
   len = sizeof(ss);
 
   /**********************************************************************
    * tcp_listen by Stevens modified by Luigi Ferrettino in order to have
    * only IPv6 and IPv4-mapped IPv6, so one stack for both protocols.
+   * If a server is already running on the upgrade socket, its listening
+   * sockets are taken over instead, so the port is never closed.
    **********************************************************************/
-  s = tcp_listen(NULL, argv[1], &len);
+  if (upgrade_path == NULL || (s = takeover(upgrade_path, &localfd)) < 0)
+    s = tcp_listen(NULL, argv[optind], &len);
+
+  /* local clients (a leftover path is from a dead server) */
+  if (local_path != NULL && localfd < 0)
+  {
+    unlink(local_path);
+    localfd = Unix_listen(local_path);
+  }
+  else if (local_path == NULL && localfd >= 0)
+  {
+    Close(localfd); /* handed over, but not wanted anymore */
+    localfd = -1;
+  }
+
+  /* wait for the next binary on the upgrade socket */
+  if (upgrade_path != NULL)
+  {
+    unlink(upgrade_path);
+    ctlfd = Unix_listen(upgrade_path);
+  }
 
   /* signal handler to avoid zombie processes */
   Signal(SIGCHLD, sig_chld);
@@ -83,34 +271,116 @@ int main(int argc, char *argv[])
    ***********************************************************************/
   Signal(SIGPIPE, SIG_IGN);
 
+  /* counters answered to STATS, shared with the children */
+  Stats_init();
+
+  /* per-phase timing of the GETs, shared with the children and printed on SIGUSR1 */
+  Hist_init();
+  Signal(SIGUSR1, hist_sig);
+
   listenfd = s;
 
-  printf("ready\n\n");
+  maxfd = listenfd;
+  if (localfd > maxfd)
+    maxfd = localfd;
+  if (ctlfd > maxfd)
+    maxfd = ctlfd;
+
+  if (serve_pack != NULL)
+    printf("packed archive: %lu files\n", (unsigned long)serve_pack->hdr->nfiles);
 
-  /* create the timeout */
-  timeout.tv_sec = 55;
-  timeout.tv_usec = 0;
+  /* after the takeover: the watcher of the old server must be the one waiting for the lock of the index */
+  if (meta_path != NULL)
+  {
+    serve_meta = Meta_open(meta_path, ".", &warm);
+    watcher = meta_watch(serve_meta, ".");
+    if (warm)
+      printf("metadata index: %lu files (warm)\n", (unsigned long)serve_meta->hdr->used);
+    else
+      printf("metadata index: scanning the working directory\n");
+  }
+
+  /* without an index, the children share what they learn of the files (the index knows better) */
+  else if (cache_valid > 0)
+  {
+    Cache_init(cache_valid);
+    printf("shared cache: %d slots, answers valid for %d ms\n", CACHE_SLOTS, cache_valid);
+  }
+
+  /* bandwidth limits, shared with the children; the watcher is forked already, it does not get the handler */
+  if (policy_path != NULL)
+  {
+    Shape_init();
+    Shape_load(policy_path);
+    if (pipe(hup_pipe) < 0)
+      err_sys("(%s) error - pipe() failed", prog_name);
+    fcntl(hup_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(hup_pipe[1], F_SETFL, O_NONBLOCK);
+    if (hup_pipe[0] > maxfd)
+      maxfd = hup_pipe[0];
+    Signal(SIGHUP, sig_hup);
+    printf("bandwidth policy: %s (SIGHUP to read it again)\n", policy_path);
+  }
+
+  printf("ready\n\n");
 
   printf("PID\tMESSAGE\n");
   fflush(stdout);
 
-  /* infinite loop */
+  /* infinite loop, left only when the listening sockets are handed over */
   for (;;)
   {
-    s = Accept(listenfd, (SA *)&ss, &len);
+    FD_ZERO(&rset);
+    FD_SET(listenfd, &rset);
+    if (localfd >= 0)
+      FD_SET(localfd, &rset);
+    if (ctlfd >= 0)
+      FD_SET(ctlfd, &rset);
+    if (hup_pipe[0] >= 0)
+      FD_SET(hup_pipe[0], &rset);
+    Select(maxfd + 1, &rset, NULL, NULL, NULL);
+
+    /* the children serving already follow the new limits too */
+    if (hup_pipe[0] >= 0 && FD_ISSET(hup_pipe[0], &rset))
+    {
+      while (read(hup_pipe[0], &c, 1) == 1)
+        ;
+      if (shape_load(policy_path) == 0)
+        printf("PARENT\tbandwidth policy %s read again\n", policy_path);
+      else
+        printf("PARENT\tbandwidth policy %s not valid, the previous one is kept\n", policy_path);
+      fflush(stdout);
+      continue;
+    }
+
+    if (ctlfd >= 0 && FD_ISSET(ctlfd, &rset) && handover(ctlfd, listenfd, localfd, upgrade_path))
+      break;
+
+    if (FD_ISSET(listenfd, &rset))
+      readyfd = listenfd;
+    else if (localfd >= 0 && FD_ISSET(localfd, &rset))
+      readyfd = localfd;
+    else
+      continue;
+
+    len = sizeof(ss);
+    s = Accept(readyfd, (SA *)&ss, &len);
+
+    /* deadlines of the connection (idle, request, send progress) are enforced by serve() */
 
-    /* set the timeout on the input socket to not wait forever */
-    Setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout));
-    
     /* get the IP address of the client */
     Getpeername(s, (SA *)&ss, &len);
 
-    /* deal with both IPv6 and IPv4-mapped IPv6 addresses */
+    /* deal with both IPv6 and IPv4-mapped IPv6 addresses, and local clients */
     if (ss.ss_family == AF_INET6)
     {
       struct sockaddr_in6 *s = (struct sockaddr_in6 *)&ss;
       inet_ntop(AF_INET6, &s->sin6_addr, ipstr, sizeof(ipstr));
     }
+    else if (ss.ss_family == AF_UNIX)
+    {
+      strcpy(ipstr, "local");
+    }
     else
     {
       err_msg("PARENT\t(%s) error - client socket family not valid, closing...\n", prog_name);
@@ -132,7 +402,17 @@ int main(int argc, char *argv[])
     else
     {
       /* child process */
-      Close(listenfd);   /* close passive socket (wrapped) */
+      Close(listenfd);   /* close passive sockets (wrapped) */
+      if (localfd >= 0)
+        Close(localfd);
+      if (ctlfd >= 0)
+        Close(ctlfd);
+      if (hup_pipe[0] >= 0)
+      {
+        Close(hup_pipe[0]);
+        Close(hup_pipe[1]);
+        Signal(SIGHUP, SIG_DFL); /* the death of the parent, below */
+      }
 
       /*********************************************************
       * child can ask kernel to deliver SIGHUP (or other signal) 
@@ -149,9 +429,90 @@ int main(int argc, char *argv[])
     }
   }
 
+  /*****************************************************************
+   * the new server is accepting on the same sockets now: stay alive
+   * (children die with the parent because of PR_SET_PDEATHSIG) until
+   * every in-flight transfer is completed.
+   *****************************************************************/
+  printf("PARENT\tlistening sockets handed over, waiting for the children to finish\n");
+  fflush(stdout);
+
+  /* the new server has its own watcher, waiting for this one to release the index */
+  if (watcher > 0)
+    kill(watcher, SIGTERM);
+
+  while (wait(NULL) > 0 || errno == EINTR)
+    ;
+
+  printf("PARENT\tall children done, exiting\n");
   exit(0);
 }
 
+/********************************************************************
+ * get the listening sockets from the server running on "path": the
+ * TCP one is returned ('T'), the local one, if any, goes in *localfd
+ * ('L'). Returns -1 if no server is running there.
+ ********************************************************************/
+int takeover(const char *path, int *localfd)
+{
+  int fd, recvfd, listenfd = -1;
+  char c;
+
+  if ((fd = unix_connect(path)) < 0)
+    return -1;
+
+  /* the old server closes the connection only after releasing the path */
+  while (Read_fd(fd, &c, 1, &recvfd) > 0)
+  {
+    if (recvfd < 0)
+      continue;
+    if (c == 'T')
+      listenfd = recvfd;
+    else if (c == 'L')
+      *localfd = recvfd;
+    else
+      Close(recvfd);
+  }
+  Close(fd);
+
+  if (listenfd < 0)
+    err_quit("(%s) error - no listening socket received on %s", prog_name, path);
+
+  printf("listening sockets taken over on %s\n", path);
+  return listenfd;
+}
+
+/*********************************************************************
+ * pass the listening sockets to the server connected on the upgrade
+ * socket; returns 1 if they were handed over (and closed here), 0 if
+ * the new server went away and this one must go on accepting
+ *********************************************************************/
+int handover(int ctlfd, int listenfd, int localfd, const char *path)
+{
+  int fd;
+  char tcp = 'T', local = 'L';
+
+  if ((fd = accept(ctlfd, NULL, NULL)) < 0)
+    return 0;
+
+  if (write_fd(fd, &tcp, 1, listenfd) != 1 || (localfd >= 0 && write_fd(fd, &local, 1, localfd) != 1))
+  {
+    err_ret("PARENT\t(%s) error - handover failed, still accepting", prog_name);
+    close(fd);
+    return 0;
+  }
+
+  /* release the path first, the new server binds it as soon as we close the connection */
+  unlink(path);
+  Close(ctlfd);
+  Close(listenfd);
+  if (localfd >= 0)
+    Close(localfd);
+  Close(fd);
+
+  return 1;
+}
+
 /* call waitpid */
 void sig_chld(int signo)
 {
@@ -160,7 +521,17 @@ void sig_chld(int signo)
 
   while ((pid = waitpid(-1, &stat, WNOHANG)) > 0)
   {
-    /* child terminated; it is not secure to use printf(s) here. */
+    /* child terminated; it is not secure to use printf(s) here. Its connection is over, even if killed */
+    stats_reap(pid);
   }
   return;
 }
+
+/* reload of the bandwidth policy, done by the main loop */
+void sig_hup(int signo)
+{
+  int saved = errno;
+
+  write(hup_pipe[1], "", 1);
+  errno = saved;
+}
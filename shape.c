@@ -0,0 +1,415 @@
+/*
+
+module: shape.c
+
+purpose: token buckets limiting the bandwidth of each client and of the whole server, shared by the forked workers
+
+author: Luigi Ferrettino (S254300)
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "errlib.h"
+#include "pack.h" /* pack_hash() */
+#include "stats.h"
+#include "shape.h"
+
+extern char *prog_name;
+
+static struct shape_shm *shape = NULL; /* NULL: no limits */
+
+/* state of this worker, for the client it serves */
+static struct in6_addr peer;            /* its address (IPv4-mapped for IPv4) */
+static uint64_t peer_key;               /* its hash, never 0 */
+static int peered = 0;                  /* a network client: the limits apply */
+static struct shape_policy pol;         /* copy of the policy in force */
+static uint32_t pol_seq = 1;            /* seq of the copy (odd: none yet) */
+static struct shape_rate client;        /* limit of the client, from pol */
+static int exempt;                      /* the client is not limited at all */
+static struct shape_client *slot;       /* its bucket in the last shape_take() */
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* the buckets, shared with the processes forked from now on; no limits until shape_load(). -1 on error */
+int shape_init(void)
+{
+    void *map;
+
+    if ((map = mmap(NULL, sizeof(struct shape_shm), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) ==
+        MAP_FAILED)
+        return -1;
+
+    shape = map;
+    return 0;
+}
+
+void Shape_init(void)
+{
+    if (shape_init() < 0)
+        err_sys("(%s) error - cannot map the bandwidth buckets", prog_name);
+}
+
+/* "10m" and the like: bytes with an optional k, m or g; -1 if not a number */
+static int parse_bytes(const char *s, uint64_t *v)
+{
+    char *end;
+
+    if (!isdigit((unsigned char)*s))
+        return -1;
+
+    errno = 0;
+    *v = strtoull(s, &end, 10);
+    switch (tolower((unsigned char)*end))
+    {
+    case 'k':
+        *v *= 1000;
+        end++;
+        break;
+    case 'm':
+        *v *= 1000000;
+        end++;
+        break;
+    case 'g':
+        *v *= 1000000000;
+        end++;
+        break;
+    }
+
+    return errno == 0 && *end == '\0' ? 0 : -1;
+}
+
+/* "<rate> [<burst>]" in *r; -1 if malformed */
+static int parse_rate(char *rate, char *burst, struct shape_rate *r)
+{
+    if (parse_bytes(rate, &r->rate) < 0)
+        return -1;
+    if (burst != NULL)
+        return parse_bytes(burst, &r->burst);
+
+    r->burst = r->rate * SHAPE_BURST / 1000;
+    if (r->burst < SHAPE_MIN_SLICE)
+        r->burst = SHAPE_MIN_SLICE;
+    return 0;
+}
+
+/* "<address>[/<prefix>]" in *rule, IPv4 as IPv4-mapped IPv6; -1 if malformed */
+static int parse_addr(char *s, struct shape_rule *rule)
+{
+    struct in_addr v4;
+    char *slash;
+    uint64_t prefix, max = 128, off = 0;
+
+    if ((slash = strchr(s, '/')) != NULL)
+        *slash++ = '\0';
+
+    if (inet_pton(AF_INET, s, &v4) == 1)
+    {
+        memset(&rule->addr, 0, sizeof(rule->addr));
+        rule->addr.s6_addr[10] = rule->addr.s6_addr[11] = 0xff;
+        memcpy(&rule->addr.s6_addr[12], &v4, 4);
+        max = 32;
+        off = 96;
+    }
+    else if (inet_pton(AF_INET6, s, &rule->addr) != 1)
+        return -1;
+
+    prefix = max;
+    if (slash != NULL && (parse_bytes(slash, &prefix) < 0 || prefix > max))
+        return -1;
+    rule->prefix = off + prefix;
+    return 0;
+}
+
+/* one directive of the policy file, split in its n words; -1 if malformed */
+static int parse_line(char **tok, int n, struct shape_policy *p)
+{
+    struct shape_rule *rule;
+
+    if (strcmp(tok[0], "global") == 0 && (n == 2 || n == 3))
+        return parse_rate(tok[1], n == 3 ? tok[2] : NULL, &p->global);
+
+    if (strcmp(tok[0], "client") != 0 || n < 2)
+        return -1;
+
+    /* a rate has neither dots nor colons, an address has */
+    if (strchr(tok[1], '.') == NULL && strchr(tok[1], ':') == NULL)
+        return n <= 3 ? parse_rate(tok[1], n == 3 ? tok[2] : NULL, &p->client) : -1;
+
+    if (n < 3 || p->nrules == SHAPE_RULES)
+        return -1;
+    rule = &p->rules[p->nrules++];
+    if (parse_addr(tok[1], rule) < 0)
+        return -1;
+    if (strcmp(tok[2], "unlimited") == 0)
+    {
+        rule->unlimited = 1;
+        return n == 3 ? 0 : -1;
+    }
+    return parse_rate(tok[2], n == 4 ? tok[3] : NULL, &rule->r);
+}
+
+/***************************************************************************
+ * read the policy file "path" (see shape.h) and put it in force for every
+ * worker, the ones serving already included; -1 with the reason printed if
+ * it cannot be read or is malformed, the policy in force stays as it was.
+ ***************************************************************************/
+int shape_load(const char *path)
+{
+    struct shape_policy p;
+    char line[256], *tok[5];
+    FILE *fp;
+    int lineno = 0, n, err = 0;
+    uint32_t seq;
+
+    if (shape == NULL)
+        return -1;
+
+    if ((fp = fopen(path, "r")) == NULL)
+    {
+        err_ret("(%s) error - cannot open the bandwidth policy %s", prog_name, path);
+        return -1;
+    }
+
+    memset(&p, 0, sizeof(p));
+    while (!err && fgets(line, sizeof(line), fp) != NULL)
+    {
+        lineno++;
+        if (strchr(line, '#') != NULL)
+            *strchr(line, '#') = '\0';
+        for (n = 0; n < 5 && (tok[n] = strtok(n == 0 ? line : NULL, " \t\r\n")) != NULL; n++)
+            ;
+        if (n > 0)
+            err = n == 5 ? -1 : parse_line(tok, n, &p);
+    }
+    fclose(fp);
+
+    if (err)
+    {
+        err_msg("(%s) error - bandwidth policy %s, line %d: not understood", prog_name, path, lineno);
+        return -1;
+    }
+
+    /* seqlock: the workers copy it again when seq changes */
+    seq = shape->policy.seq;
+    __atomic_store_n(&shape->policy.seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    p.seq = seq + 1;
+    memcpy(&shape->policy, &p, sizeof(p));
+    __atomic_store_n(&shape->policy.seq, seq + 2, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void Shape_load(const char *path)
+{
+    if (shape_load(path) < 0)
+        err_quit("(%s) error - cannot load the bandwidth policy %s", prog_name, path);
+}
+
+/* the connection "fd" is served by this worker from now on: its client is looked up in the policy */
+void shape_open(int fd)
+{
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+
+    peered = 0;
+    pol_seq = 1;
+    slot = NULL;
+    if (shape == NULL || getpeername(fd, (struct sockaddr *)&ss, &len) < 0)
+        return;
+
+    if (ss.ss_family == AF_INET6)
+        peer = ((struct sockaddr_in6 *)&ss)->sin6_addr;
+    else if (ss.ss_family == AF_INET)
+    {
+        memset(&peer, 0, sizeof(peer));
+        peer.s6_addr[10] = peer.s6_addr[11] = 0xff;
+        memcpy(&peer.s6_addr[12], &((struct sockaddr_in *)&ss)->sin_addr, 4);
+    }
+    else
+        return; /* local clients are not limited */
+
+    peer_key = pack_hash((const char *)&peer, sizeof(peer)) | 1;
+    peered = 1;
+}
+
+static int rule_match(const struct shape_rule *rule)
+{
+    uint32_t bytes = rule->prefix / 8, bits = rule->prefix % 8;
+
+    return memcmp(&peer, &rule->addr, bytes) == 0 &&
+           (bits == 0 || ((peer.s6_addr[bytes] ^ rule->addr.s6_addr[bytes]) & (0xff << (8 - bits))) == 0);
+}
+
+/* copy the policy if the server changed it, and find the limit of this client in it; 0 if it has no limits */
+static int policy_sync(void)
+{
+    uint32_t seq, i;
+
+    if (shape == NULL || !peered)
+        return 0;
+
+    if (__atomic_load_n(&shape->policy.seq, __ATOMIC_ACQUIRE) != pol_seq)
+    {
+        do
+        {
+            while ((seq = __atomic_load_n(&shape->policy.seq, __ATOMIC_ACQUIRE)) & 1)
+                ;
+            memcpy(&pol, &shape->policy, sizeof(pol));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while (__atomic_load_n(&shape->policy.seq, __ATOMIC_RELAXED) != seq);
+        pol_seq = seq;
+
+        client = pol.client;
+        exempt = 0;
+        for (i = 0; i < pol.nrules && i < SHAPE_RULES; i++)
+            if (rule_match(&pol.rules[i]))
+            {
+                client = pol.rules[i].r;
+                exempt = pol.rules[i].unlimited;
+                break;
+            }
+    }
+
+    return !exempt && (client.rate > 0 || pol.global.rate > 0);
+}
+
+/*****************************************************************************
+ * the bucket of this client: its own slot anywhere in the probes, otherwise a
+ * free one, or one whose client has been idle long enough. Two workers taking
+ * over slots for the same address at once may hold two of them, but only for
+ * a slice: the next lookups of both find the first one.
+ *****************************************************************************/
+static struct shape_client *client_slot(uint64_t now)
+{
+    struct shape_client *s;
+    uint64_t key;
+    int i;
+
+    for (i = 0; i < SHAPE_PROBES; i++)
+    {
+        s = &shape->clients[(peer_key + i) & (SHAPE_CLIENTS - 1)];
+        if (__atomic_load_n(&s->key, __ATOMIC_ACQUIRE) == peer_key)
+            return s;
+    }
+
+    for (i = 0; i < SHAPE_PROBES; i++)
+    {
+        s = &shape->clients[(peer_key + i) & (SHAPE_CLIENTS - 1)];
+        key = __atomic_load_n(&s->key, __ATOMIC_ACQUIRE);
+        if (key == peer_key)
+            return s;
+        if ((key == 0 || __atomic_load_n(&s->tat, __ATOMIC_RELAXED) < now) &&
+            __atomic_compare_exchange_n(&s->key, &key, peer_key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return s;
+    }
+
+    /* all busy: shared with another address, which is only stricter */
+    return &shape->clients[peer_key & (SHAPE_CLIENTS - 1)];
+}
+
+/* nanoseconds "len" bytes take at "r" */
+static uint64_t cost(const struct shape_rate *r, uint64_t len)
+{
+    return len * 1000000000 / r->rate;
+}
+
+/*********************************************************************************
+ * virtual scheduling: the bucket *tat is moved forward by "len" bytes sent at "t";
+ * returns the nanoseconds to wait from "t" for them to be within the burst
+ *********************************************************************************/
+static uint64_t gcra(uint64_t *tat, uint64_t t, const struct shape_rate *r, uint64_t len)
+{
+    uint64_t old = __atomic_load_n(tat, __ATOMIC_RELAXED), next, burst = cost(r, r->burst);
+
+    do
+        next = (old > t ? old : t) + cost(r, len);
+    while (!__atomic_compare_exchange_n(tat, &old, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return next > t + burst ? next - t - burst : 0;
+}
+
+/* bytes to send at once under the limits of this client, at most "len" */
+size_t shape_slice(size_t len)
+{
+    uint64_t rate = 0, slice;
+
+    if (!policy_sync())
+        return len;
+
+    if (client.rate > 0)
+        rate = client.rate;
+    if (pol.global.rate > 0 && (rate == 0 || pol.global.rate < rate))
+        rate = pol.global.rate;
+
+    slice = rate * SHAPE_TICK / 1000;
+    if (slice < SHAPE_MIN_SLICE)
+        slice = SHAPE_MIN_SLICE;
+    return len < slice ? len : slice;
+}
+
+/*****************************************************************************
+ * "len" bytes are about to be sent to the client: they are taken from its
+ * bucket and then from the global one, at the time the first allows them.
+ * Returns the nanoseconds to wait before sending (see shape_sleep()), 0 if
+ * they can go now.
+ *****************************************************************************/
+uint64_t shape_take(size_t len)
+{
+    uint64_t t, wait = 0;
+
+    slot = NULL;
+    if (!policy_sync())
+        return 0;
+
+    t = now_ns();
+    if (client.rate > 0)
+    {
+        slot = client_slot(t);
+        wait = gcra(&slot->tat, t, &client, len);
+    }
+    if (pol.global.rate > 0)
+        wait += gcra(&shape->tat, t + wait, &pol.global, len);
+
+    if (wait > 0)
+        stats_shaped(wait);
+    return wait;
+}
+
+/* "len" of the bytes taken by the last shape_take() were not sent after all */
+void shape_refund(size_t len)
+{
+    if (len == 0 || !policy_sync())
+        return;
+
+    if (slot != NULL && client.rate > 0)
+        __atomic_fetch_sub(&slot->tat, cost(&client, len), __ATOMIC_RELAXED);
+    if (pol.global.rate > 0)
+        __atomic_fetch_sub(&shape->tat, cost(&pol.global, len), __ATOMIC_RELAXED);
+}
+
+/* the wait asked by shape_take(), signals notwithstanding */
+void shape_sleep(uint64_t ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
@@ -0,0 +1,99 @@
+/*
+
+ module: shape.h
+
+ purpose: definitions of functions in shape.c
+
+ reference: ITU-T I.371, generic cell rate algorithm (virtual scheduling)
+
+ */
+
+#ifndef _SHAPE_H
+
+#define _SHAPE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+/*****************************************************************************
+ * policy file, one directive per line ('#' starts a comment), rates in bytes
+ * per second and bursts in bytes, with an optional k, m or g (powers of 1000):
+ *
+ *   global <rate> [<burst>]                     all the clients together
+ *   client <rate> [<burst>]                     each client address
+ *   client <address>[/<prefix>] <rate> [<burst>] each address in the prefix
+ *   client <address>[/<prefix>] unlimited       neither limit: priority traffic
+ *
+ * no directive, or rate 0, means no limit. The first matching address rule
+ * wins; IPv4 addresses match the IPv4-mapped clients of the servers.
+ *****************************************************************************/
+#define SHAPE_RULES 32       /* address rules of a policy */
+#define SHAPE_CLIENTS 1024   /* client buckets, power of 2 */
+#define SHAPE_PROBES 8       /* slots looked at for the bucket of an address */
+#define SHAPE_BURST 100      /* default burst, milliseconds at the rate */
+#define SHAPE_TICK 10        /* a slice is sent in about this many milliseconds at the rate */
+#define SHAPE_MIN_SLICE 4096 /* bytes, however low the rate */
+
+struct shape_rate
+{
+    uint64_t rate;  /* bytes/s, 0: unlimited */
+    uint64_t burst; /* bytes */
+};
+
+struct shape_rule
+{
+    struct in6_addr addr;
+    uint32_t prefix;      /* bits */
+    uint32_t unlimited;   /* exempt from the global limit too */
+    struct shape_rate r;
+};
+
+/* written only by the server (seqlock), read by the workers when seq changes */
+struct shape_policy
+{
+    uint32_t seq; /* odd while being written */
+    uint32_t nrules;
+    struct shape_rate global, client;
+    struct shape_rule rules[SHAPE_RULES];
+};
+
+/*****************************************************************************
+ * a bucket is its theoretical arrival time: the CLOCK_MONOTONIC nanosecond
+ * at which the bytes admitted so far are paid for at the rate. Bytes may go
+ * out as long as it is not more than the burst ahead of now; a worker moves
+ * it forward with a compare and swap and sleeps if it got that far ahead.
+ *****************************************************************************/
+struct shape_client
+{
+    uint64_t key; /* hash of the address, 0: free */
+    uint64_t tat;
+};
+
+/* in shared memory, inherited by the forked workers */
+struct shape_shm
+{
+    struct shape_policy policy;
+    uint64_t tat; /* global bucket */
+    struct shape_client clients[SHAPE_CLIENTS];
+};
+
+int shape_init(void);
+
+void Shape_init(void);
+
+int shape_load(const char *path);
+
+void Shape_load(const char *path);
+
+void shape_open(int fd);
+
+size_t shape_slice(size_t len);
+
+uint64_t shape_take(size_t len);
+
+void shape_refund(size_t len);
+
+void shape_sleep(uint64_t ns);
+
+#endif
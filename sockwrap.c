@@ -24,12 +24,17 @@
 #include <string.h>
 #include <stdio.h>
 #include <inttypes.h> // SCNu16
+#include <poll.h>
+#include <time.h>
+#include <netinet/tcp.h> // TCP_FASTOPEN
 
 #include "errlib.h"
 #include "sockwrap.h"
 
 extern char *prog_name;
 
+struct connect_stats tcp_connect_stats; /* timings of the last tcp_connect() */
+
 int Socket(int family, int type, int protocol)
 {
 	int n;
@@ -678,42 +683,210 @@ void showAddr(char *str, struct sockaddr_in *a)
 	printf("\n");
 }
 
-/* tcp_connect from Stevens modified by Luigi Ferrettino in order to have a non-blocking connection with a TIMEOUT*/
-int tcp_connect(const char *host, const char *serv)
+/* monotonic clock in milliseconds, for connection timings */
+static long now_ms(void)
 {
-	int sockfd, n, s;
-	struct addrinfo hints, *res, *ressave;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* start a non-blocking connect() to "ai": 0 connected, 1 in progress, -1 failed (errno set) */
+static int connect_start(struct addrinfo *ai, int *sockfdp)
+{
+	int sockfd, flags;
+
+	if ((sockfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+		return (-1);
+
+	flags = fcntl(sockfd, F_GETFL, 0);
+	fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+
+#ifdef TCP_FASTOPEN_CONNECT
+	/* the SYN leaves together with the first request (with the data only if a cookie is cached), and
+	 * connect() returns 0 right away: the first address started wins (see tcp_connect_race()) */
+	if (getenv("TCP_FASTOPEN") != NULL)
+	{
+		const int on = 1;
+		setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on));
+	}
+#endif
+
+	*sockfdp = sockfd;
+	if (connect(sockfd, ai->ai_addr, ai->ai_addrlen) == 0)
+		return (0);
+	if (errno == EINPROGRESS)
+		return (1);
+
+	flags = errno;
+	close(sockfd);
+	errno = flags;
+	return (-1);
+}
+
+/******************************************************************************
+ * "happy eyeballs" connect (RFC 8305): the addresses of "host" are tried with
+ * the families interleaved, a new attempt starts every CONNECT_DELAY ms (or as
+ * soon as one fails) while the previous ones are still in progress, and the
+ * first connection established wins; the others are closed. A blackholed
+ * address costs CONNECT_DELAY instead of the whole TIMEOUT.
+ * With TCP Fast Open (TCP_FASTOPEN environment variable) there is no race:
+ * connect() returns at once and the SYN waits for the first write, so the
+ * first address of the preferred family is taken without knowing whether it
+ * answers, and a blackholed one fails on the request instead.
+ * Returns the connected (blocking) socket, -1 on error with errno set; timings
+ * go in *st if not NULL.
+ ******************************************************************************/
+int tcp_connect_race(const char *host, const char *serv, struct connect_stats *st)
+{
+	int n, i, ncand = 0, next = 0, active = 0, sockfd = -1, error = ETIMEDOUT;
+	int nfirst = 0, nother = 0;
+	struct addrinfo hints, *res, *ressave, *cand[MAXCANDIDATES];
+	struct addrinfo *first[MAXCANDIDATES], *other[MAXCANDIDATES];
+	struct pollfd pfd[MAXCANDIDATES];
+	int owner[MAXCANDIDATES];
+	long start, now, next_start, deadline;
+	struct connect_stats stats;
 
 	bzero(&hints, sizeof(struct addrinfo));
 	hints.ai_family = AF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
 
 	if ((n = getaddrinfo(host, serv, &hints, &res)) != 0)
-		err_quit("tcp_connect error for %s, %s: %s",
-				 host, serv, gai_strerror(n));
+	{
+		err_msg("(%s) tcp_connect error for %s, %s: %s", prog_name, host, serv, gai_strerror(n));
+		errno = EHOSTUNREACH;
+		return (-1);
+	}
 	ressave = res;
 
-	do
+	/* interleave the address families, starting with the preferred one (the first returned) */
+	for (; res != NULL; res = res->ai_next)
 	{
-		sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-		if (sockfd < 0)
-			continue; /* ignore this one */
+		if (res->ai_family == ressave->ai_family && nfirst < MAXCANDIDATES)
+			first[nfirst++] = res;
+		else if (res->ai_family != ressave->ai_family && nother < MAXCANDIDATES)
+			other[nother++] = res;
+	}
+	for (i = 0; ncand < MAXCANDIDATES && (i < nfirst || i < nother); i++)
+	{
+		if (i < nfirst)
+			cand[ncand++] = first[i];
+		if (i < nother && ncand < MAXCANDIDATES)
+			cand[ncand++] = other[i];
+	}
 
-		if ((s = connect_nonb(sockfd, res->ai_addr, res->ai_addrlen, TIMEOUT)) == 0)
-			break; /* success */
-		else if (s == -1)
-			err_sys("(%s) connect error", prog_name);
-		else if (s == -2)
-			err_sys("(%s) connect error", prog_name);
+	bzero(&stats, sizeof(stats));
+	stats.candidates = ncand;
+	stats.fastopen = getenv("TCP_FASTOPEN") != NULL;
 
-		Close(sockfd); /* ignore this one */
-	} while ((res = res->ai_next) != NULL);
+	start = next_start = now_ms();
+	deadline = start + TIMEOUT * 1000;
 
-	if (res == NULL) /* errno set from final connect() */
-		err_sys("(%s) connect error for %s, %s", prog_name, host, serv);
+	while (sockfd < 0)
+	{
+		now = now_ms();
+
+		/* start the next attempt: its turn has come, or nothing else is in progress */
+		if (next < ncand && (now >= next_start || active == 0))
+		{
+			int fd;
+
+			stats.attempts++;
+			if ((n = connect_start(cand[next], &fd)) == 0)
+			{
+				sockfd = fd;
+				stats.family = cand[next]->ai_family;
+			}
+			else if (n == 1)
+			{
+				pfd[active].fd = fd;
+				pfd[active].events = POLLOUT;
+				owner[active++] = next;
+			}
+			else
+				error = errno;
+
+			next++;
+			next_start = now + CONNECT_DELAY;
+			continue;
+		}
+
+		if (active == 0 || now >= deadline)
+			break; /* every address failed, or time is over */
+
+		n = poll(pfd, active, (int)((next < ncand && next_start < deadline ? next_start : deadline) - now));
+		if (n < 0)
+		{
+			if (INTERRUPTED_BY_SIGNAL)
+				continue;
+			error = errno;
+			break;
+		}
+
+		for (i = 0; i < active && sockfd < 0; i++)
+		{
+			int err = 0;
+			socklen_t len = sizeof(err);
+
+			if (pfd[i].revents == 0)
+				continue;
+
+			if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+				err = errno;
+
+			if (err == 0)
+			{
+				sockfd = pfd[i].fd;
+				stats.family = cand[owner[i]]->ai_family;
+				pfd[i] = pfd[--active]; /* not a loser */
+				owner[i] = owner[active];
+			}
+			else
+			{
+				/* this one failed, the next attempt does not need to wait */
+				error = err;
+				close(pfd[i].fd);
+				pfd[i] = pfd[--active];
+				owner[i] = owner[active];
+				next_start = now;
+				i--;
+			}
+		}
+	}
+
+	/* cancel the attempts still in progress */
+	for (i = 0; i < active; i++)
+		close(pfd[i].fd);
 
 	freeaddrinfo(ressave);
 
+	stats.latency_ms = now_ms() - start;
+	if (st != NULL)
+		*st = stats;
+
+	if (sockfd < 0)
+	{
+		errno = error;
+		return (-1);
+	}
+
+	/* back to a blocking socket */
+	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) & ~O_NONBLOCK);
+
+	return (sockfd);
+}
+
+/* tcp_connect from Stevens modified by Luigi Ferrettino in order to have a non-blocking connection with a TIMEOUT
+ * (the addresses are raced by tcp_connect_race(), the timings of the last call are in tcp_connect_stats) */
+int tcp_connect(const char *host, const char *serv)
+{
+	int sockfd;
+
+	if ((sockfd = tcp_connect_race(host, serv, &tcp_connect_stats)) < 0)
+		err_sys("(%s) connect error for %s, %s", prog_name, host, serv);
+
 	return (sockfd);
 }
 /* end tcp_connect */
@@ -745,6 +918,15 @@ int tcp_listen(const char *host, const char *serv, socklen_t *addrlenp)
 		Setsockopt(listenfd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
 		// Setsockopt(listenfd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout));
 
+#ifdef TCP_FASTOPEN
+		/* accept data in the SYN from clients with a Fast Open cookie (see tcp_connect_race()) */
+		if (getenv("TCP_FASTOPEN") != NULL)
+		{
+			const int qlen = atoi(getenv("TCP_FASTOPEN")) > 0 ? atoi(getenv("TCP_FASTOPEN")) : LISTENQ;
+			setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen));
+		}
+#endif
+
 		if (bind(listenfd, res->ai_addr, res->ai_addrlen) == 0)
 			break; /* success */
 
@@ -825,3 +1007,158 @@ done:
 	}
 	return (0);
 }
+
+
+/* listening Unix domain stream socket bound to "path", -1 on error */
+int unix_listen(const char *path)
+{
+	int listenfd;
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+
+	if ((listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return (-1);
+
+	bzero(&addr, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	if (bind(listenfd, (SA *)&addr, sizeof(addr)) < 0 || listen(listenfd, LISTENQ) < 0)
+	{
+		int error = errno;
+		close(listenfd);
+		errno = error;
+		return (-1);
+	}
+
+	return (listenfd);
+}
+
+int Unix_listen(const char *path)
+{
+	int n;
+
+	if ((n = unix_listen(path)) < 0)
+		err_sys("(%s) error - unix_listen() failed for %s", prog_name, path);
+	return n;
+}
+
+/* connected Unix domain stream socket, -1 on error (nobody listening on "path") */
+int unix_connect(const char *path)
+{
+	int sockfd;
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+
+	if ((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return (-1);
+
+	bzero(&addr, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	if (connect(sockfd, (SA *)&addr, sizeof(addr)) < 0)
+	{
+		int error = errno;
+		close(sockfd);
+		errno = error;
+		return (-1);
+	}
+
+	return (sockfd);
+}
+
+/* write_fd from Stevens: send "nbytes" of data together with the descriptor "sendfd" (SCM_RIGHTS) */
+ssize_t write_fd(int fd, void *ptr, size_t nbytes, int sendfd)
+{
+	struct msghdr msg;
+	struct iovec iov[1];
+	union {
+		struct cmsghdr cm;
+		char control[CMSG_SPACE(sizeof(int))];
+	} control_un;
+	struct cmsghdr *cmptr;
+
+	bzero(&msg, sizeof(msg));
+	msg.msg_control = control_un.control;
+	msg.msg_controllen = sizeof(control_un.control);
+
+	cmptr = CMSG_FIRSTHDR(&msg);
+	cmptr->cmsg_len = CMSG_LEN(sizeof(int));
+	cmptr->cmsg_level = SOL_SOCKET;
+	cmptr->cmsg_type = SCM_RIGHTS;
+	memcpy(CMSG_DATA(cmptr), &sendfd, sizeof(int));
+
+	iov[0].iov_base = ptr;
+	iov[0].iov_len = nbytes;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 1;
+
+	return (sendmsg(fd, &msg, MSG_NOSIGNAL));
+}
+
+ssize_t Write_fd(int fd, void *ptr, size_t nbytes, int sendfd)
+{
+	ssize_t n;
+
+	if ((n = write_fd(fd, ptr, nbytes, sendfd)) < 0)
+		err_sys("(%s) error - write_fd() failed", prog_name);
+	return (n);
+}
+
+/* read_fd from Stevens: *recvfd is the descriptor passed with the data, -1 if none was passed */
+ssize_t read_fd(int fd, void *ptr, size_t nbytes, int *recvfd)
+{
+	struct msghdr msg;
+	struct iovec iov[1];
+	ssize_t n;
+	union {
+		struct cmsghdr cm;
+		char control[CMSG_SPACE(sizeof(int))];
+	} control_un;
+	struct cmsghdr *cmptr;
+
+	bzero(&msg, sizeof(msg));
+	msg.msg_control = control_un.control;
+	msg.msg_controllen = sizeof(control_un.control);
+
+	iov[0].iov_base = ptr;
+	iov[0].iov_len = nbytes;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 1;
+
+again:
+	if ((n = recvmsg(fd, &msg, 0)) <= 0)
+	{
+		if (n < 0 && INTERRUPTED_BY_SIGNAL)
+			goto again;
+		return (n);
+	}
+
+	if ((cmptr = CMSG_FIRSTHDR(&msg)) != NULL && cmptr->cmsg_len == CMSG_LEN(sizeof(int)) &&
+		cmptr->cmsg_level == SOL_SOCKET && cmptr->cmsg_type == SCM_RIGHTS)
+		memcpy(recvfd, CMSG_DATA(cmptr), sizeof(int));
+	else
+		*recvfd = -1; /* descriptor was not passed */
+
+	return (n);
+}
+
+ssize_t Read_fd(int fd, void *ptr, size_t nbytes, int *recvfd)
+{
+	ssize_t n;
+
+	if ((n = read_fd(fd, ptr, nbytes, recvfd)) < 0)
+		err_sys("(%s) error - read_fd() failed", prog_name);
+	return (n);
+}
@@ -24,6 +24,8 @@
 
 #define LISTENQ 5
 #define TIMEOUT 15
+#define CONNECT_DELAY 250 /* ms between two connection attempts, RFC 8305 */
+#define MAXCANDIDATES 16  /* addresses raced by tcp_connect_race() */
 
 #define SA struct sockaddr
 
@@ -31,6 +33,18 @@
 
 typedef void Sigfunc(int); /* for signal handlers */
 
+/* connection timings filled by tcp_connect_race() */
+struct connect_stats
+{
+	int candidates; /* addresses returned by getaddrinfo() */
+	int attempts;   /* connection attempts started */
+	int family;     /* address family of the winning attempt */
+	long latency_ms; /* from the first attempt to the established connection */
+	int fastopen;   /* TCP Fast Open requested (TCP_FASTOPEN environment variable) */
+};
+
+extern struct connect_stats tcp_connect_stats;
+
 int Socket(int family, int type, int protocol);
 
 void Bind(int sockfd, const SA *myaddr, socklen_t myaddrlen);
@@ -136,10 +150,26 @@ void showAddr(char *str, struct sockaddr_in *a);
 /* modified by Luigi Ferrettino (details in sockwrap.c) */
 int tcp_connect(const char *host, const char *serv);
 
+int tcp_connect_race(const char *host, const char *serv, struct connect_stats *st);
+
 /* modified by Luigi Ferrettino (details in sockwrap.c) */
 int tcp_listen(const char *host, const char *serv, socklen_t *addrlenp);
 
 /* modified by Luigi Ferrettino (details in sockwrap.c) */
 int connect_nonb(int sockfd, const SA *saptr, socklen_t salen, int nsec);
 
+int unix_listen(const char *path);
+
+int Unix_listen(const char *path);
+
+int unix_connect(const char *path);
+
+ssize_t write_fd(int fd, void *ptr, size_t nbytes, int sendfd);
+
+ssize_t Write_fd(int fd, void *ptr, size_t nbytes, int sendfd);
+
+ssize_t read_fd(int fd, void *ptr, size_t nbytes, int *recvfd);
+
+ssize_t Read_fd(int fd, void *ptr, size_t nbytes, int *recvfd);
+
 #endif
@@ -0,0 +1,334 @@
+/*
+
+module: stats.c
+
+purpose: counters of the server and of its connections, shared by the forked workers and exposed by STATS
+
+author: Luigi Ferrettino (S254300)
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "errlib.h"
+#include "hist.h"
+#include "log.h"
+#include "cache.h"
+#include "stats.h"
+
+extern char *prog_name;
+
+static struct stats_shm *stats = NULL; /* NULL: not counting */
+static struct stats_conn *own = NULL;  /* slot of the connection served by this process, NULL if none */
+static int own_fd = -1;                /* its socket */
+
+static const char *outcome_name[STATS_OUTCOMES] = {"ok", "not_found", "invalid", "illegal", "broken"};
+static const char *cache_name[STATS_CACHES] = {"archive", "index", "proxy", "shared"};
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* the counters, shared with the processes forked from now on; -1 on error */
+int stats_init(void)
+{
+    void *map;
+
+    if ((map = mmap(NULL, sizeof(struct stats_shm), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) ==
+        MAP_FAILED)
+        return -1;
+
+    stats = map;
+    stats->start = time(NULL);
+    return 0;
+}
+
+void Stats_init(void)
+{
+    if (stats_init() < 0)
+        err_sys("(%s) error - cannot map the statistics", prog_name);
+}
+
+/* a connection starts being served by this process: counted, and given a slot if one is free */
+void stats_open(int fd, const char *host)
+{
+    pid_t pid = getpid(), none;
+    int i;
+
+    if (stats == NULL)
+        return;
+
+    __atomic_fetch_add(&stats->accepts, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->active, 1, __ATOMIC_RELAXED);
+
+    own = NULL;
+    own_fd = fd;
+    for (i = 0; i < STATS_CONNS && own == NULL; i++)
+    {
+        none = 0;
+        if (__atomic_compare_exchange_n(&stats->conns[i].pid, &none, pid, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            own = &stats->conns[i];
+    }
+    if (own == NULL)
+        return;
+
+    strncpy(own->host, host, STATS_HOSTLEN - 1);
+    own->host[STATS_HOSTLEN - 1] = '\0';
+    own->since = time(NULL);
+    own->bytes = 0;
+    own->sampled = 0;
+    own->tcp = 0;
+    stats_tcp(1);
+}
+
+/* the connection served by this process is over */
+void stats_close(void)
+{
+    pid_t pid = getpid();
+
+    if (stats == NULL)
+        return;
+
+    /* unless the parent has already released it (see stats_reap()) */
+    if (own == NULL || __atomic_compare_exchange_n(&own->pid, &pid, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        __atomic_fetch_sub(&stats->active, 1, __ATOMIC_RELAXED);
+    own = NULL;
+    own_fd = -1;
+}
+
+/*******************************************************************
+ * the worker "pid" has terminated: its slot is released, if it did
+ * not do it by itself (killed). Only atomics, for a SIGCHLD handler.
+ *******************************************************************/
+void stats_reap(pid_t pid)
+{
+    pid_t owner;
+    int i;
+
+    if (stats == NULL)
+        return;
+
+    for (i = 0; i < STATS_CONNS; i++)
+    {
+        owner = pid;
+        if (__atomic_compare_exchange_n(&stats->conns[i].pid, &owner, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            __atomic_fetch_sub(&stats->active, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void stats_request(int outcome)
+{
+    if (stats != NULL)
+        __atomic_fetch_add(&stats->requests[outcome], 1, __ATOMIC_RELAXED);
+}
+
+void stats_cache(int cache, int hit)
+{
+    if (stats != NULL)
+        __atomic_fetch_add(&stats->cache[cache][hit != 0], 1, __ATOMIC_RELAXED);
+}
+
+void stats_sent(uint64_t bytes)
+{
+    if (stats == NULL)
+        return;
+
+    __atomic_fetch_add(&stats->bytes, bytes, __ATOMIC_RELAXED);
+    if (own != NULL)
+        __atomic_fetch_add(&own->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/* a transfer did not complete: the client stopped reading (timeout) or the send failed */
+void stats_sendfile_error(int timeout)
+{
+    if (stats != NULL)
+        __atomic_fetch_add(timeout ? &stats->sendfile_timeouts : &stats->sendfile_errors, 1, __ATOMIC_RELAXED);
+}
+
+/* a slice waited "ns" nanoseconds for the bandwidth limits */
+void stats_shaped(uint64_t ns)
+{
+    if (stats == NULL)
+        return;
+
+    __atomic_fetch_add(&stats->shaped, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->shaped_ns, ns, __ATOMIC_RELAXED);
+}
+
+/*************************************************************************
+ * sample TCP_INFO of the connection into its slot, at most once every
+ * STATS_TCP_PERIOD milliseconds unless forced: cheap enough to be called
+ * after every slice of a transfer. Nothing for a Unix domain connection.
+ *************************************************************************/
+void stats_tcp(int force)
+{
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    uint64_t now;
+
+    if (own == NULL)
+        return;
+
+    now = now_ms();
+    if (!force && now - own->sampled < STATS_TCP_PERIOD)
+        return;
+    own->sampled = now;
+
+    if (getsockopt(own_fd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0)
+        return;
+
+    own->rtt = ti.tcpi_rtt;
+    own->rttvar = ti.tcpi_rttvar;
+    own->cwnd = ti.tcpi_snd_cwnd;
+    own->unacked = ti.tcpi_unacked;
+    own->retrans = ti.tcpi_total_retrans;
+    own->tcp = 1;
+}
+
+static void metric(FILE *fp, const char *name, const char *type, const char *help)
+{
+    fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/*****************************************************************************
+ * everything in the Prometheus text format: counters of the server, timing
+ * of the phases (see hist.h) as summaries, and one series per connection in
+ * a slot, labelled with its worker and client. Slots of workers that no
+ * longer exist are skipped. Returns -1 if not counting (nothing written).
+ *****************************************************************************/
+int stats_write(FILE *fp)
+{
+    struct hist_summary hs;
+    struct stats_conn conns[STATS_CONNS], *sc;
+    uint64_t full, limited, stores, evictions, expired;
+    int i, n, k;
+
+    if (stats == NULL)
+        return -1;
+
+    /* this worker first: its own TCP_INFO is sampled now */
+    stats_tcp(1);
+
+    metric(fp, "fileserver_start_time_seconds", "gauge", "Start of the server, seconds since the epoch.");
+    fprintf(fp, "fileserver_start_time_seconds %llu\n", (unsigned long long)stats->start);
+
+    metric(fp, "fileserver_connections_accepted_total", "counter", "Connections accepted.");
+    fprintf(fp, "fileserver_connections_accepted_total %llu\n",
+            (unsigned long long)__atomic_load_n(&stats->accepts, __ATOMIC_RELAXED));
+
+    metric(fp, "fileserver_connections_active", "gauge", "Connections being served.");
+    fprintf(fp, "fileserver_connections_active %llu\n",
+            (unsigned long long)__atomic_load_n(&stats->active, __ATOMIC_RELAXED));
+
+    metric(fp, "fileserver_sent_bytes_total", "counter", "File content sent.");
+    fprintf(fp, "fileserver_sent_bytes_total %llu\n", (unsigned long long)__atomic_load_n(&stats->bytes, __ATOMIC_RELAXED));
+
+    metric(fp, "fileserver_requests_total", "counter", "Requests by outcome.");
+    for (k = 0; k < STATS_OUTCOMES; k++)
+        fprintf(fp, "fileserver_requests_total{outcome=\"%s\"} %llu\n", outcome_name[k],
+                (unsigned long long)__atomic_load_n(&stats->requests[k], __ATOMIC_RELAXED));
+
+    metric(fp, "fileserver_sendfile_errors_total", "counter", "Transfers not completed.");
+    fprintf(fp, "fileserver_sendfile_errors_total{reason=\"timeout\"} %llu\n",
+            (unsigned long long)__atomic_load_n(&stats->sendfile_timeouts, __ATOMIC_RELAXED));
+    fprintf(fp, "fileserver_sendfile_errors_total{reason=\"error\"} %llu\n",
+            (unsigned long long)__atomic_load_n(&stats->sendfile_errors, __ATOMIC_RELAXED));
+
+    metric(fp, "fileserver_shaped_slices_total", "counter", "Slices delayed by the bandwidth limits.");
+    fprintf(fp, "fileserver_shaped_slices_total %llu\n", (unsigned long long)__atomic_load_n(&stats->shaped, __ATOMIC_RELAXED));
+    metric(fp, "fileserver_shaped_seconds_total", "counter", "Time the delayed slices waited.");
+    fprintf(fp, "fileserver_shaped_seconds_total %.9f\n", __atomic_load_n(&stats->shaped_ns, __ATOMIC_RELAXED) / 1e9);
+
+    metric(fp, "fileserver_cache_lookups_total", "counter", "Lookups before the filesystem, by cache and result.");
+    for (k = 0; k < STATS_CACHES; k++)
+    {
+        fprintf(fp, "fileserver_cache_lookups_total{cache=\"%s\",result=\"hit\"} %llu\n", cache_name[k],
+                (unsigned long long)__atomic_load_n(&stats->cache[k][1], __ATOMIC_RELAXED));
+        fprintf(fp, "fileserver_cache_lookups_total{cache=\"%s\",result=\"miss\"} %llu\n", cache_name[k],
+                (unsigned long long)__atomic_load_n(&stats->cache[k][0], __ATOMIC_RELAXED));
+    }
+
+    if (cache_counts(&stores, &evictions, &expired) == 0)
+    {
+        metric(fp, "fileserver_shared_cache_stores_total", "counter", "Answers of the filesystem kept for the other workers.");
+        fprintf(fp, "fileserver_shared_cache_stores_total %llu\n", (unsigned long long)stores);
+        metric(fp, "fileserver_shared_cache_evictions_total", "counter", "Valid answers overwritten for lack of room.");
+        fprintf(fp, "fileserver_shared_cache_evictions_total %llu\n", (unsigned long long)evictions);
+        metric(fp, "fileserver_shared_cache_expired_total", "counter", "Answers found too old to be trusted.");
+        fprintf(fp, "fileserver_shared_cache_expired_total %llu\n", (unsigned long long)expired);
+    }
+
+    log_drops(&full, &limited);
+    metric(fp, "fileserver_log_dropped_total", "counter", "Log records dropped.");
+    fprintf(fp, "fileserver_log_dropped_total{reason=\"full\"} %llu\n", (unsigned long long)full);
+    fprintf(fp, "fileserver_log_dropped_total{reason=\"rate\"} %llu\n", (unsigned long long)limited);
+
+    if (hist_summary(HIST_TOTAL, &hs) == 0)
+    {
+        metric(fp, "fileserver_get_phase_seconds", "summary", "Time of a GET by phase (upper bounds of the buckets).");
+        for (k = 0; k < HIST_PHASES; k++)
+        {
+            hist_summary(k, &hs);
+            fprintf(fp, "fileserver_get_phase_seconds{phase=\"%s\",quantile=\"0.5\"} %.9f\n", hist_phase_name[k],
+                    hs.p50 / 1e9);
+            fprintf(fp, "fileserver_get_phase_seconds{phase=\"%s\",quantile=\"0.99\"} %.9f\n", hist_phase_name[k],
+                    hs.p99 / 1e9);
+            fprintf(fp, "fileserver_get_phase_seconds{phase=\"%s\",quantile=\"0.999\"} %.9f\n", hist_phase_name[k],
+                    hs.p999 / 1e9);
+            fprintf(fp, "fileserver_get_phase_seconds_sum{phase=\"%s\"} %.9f\n", hist_phase_name[k], hs.sum / 1e9);
+            fprintf(fp, "fileserver_get_phase_seconds_count{phase=\"%s\"} %llu\n", hist_phase_name[k],
+                    (unsigned long long)hs.count);
+        }
+    }
+
+    /* a copy of the live slots, so every series is written from the same sample */
+    for (i = n = 0; i < STATS_CONNS; i++)
+    {
+        sc = &stats->conns[i];
+        if (__atomic_load_n(&sc->pid, __ATOMIC_ACQUIRE) == 0 || !sc->tcp)
+            continue;
+        memcpy(&conns[n], sc, sizeof(*sc));
+        conns[n].host[STATS_HOSTLEN - 1] = '\0';
+        if (conns[n].pid != 0 && !(kill(conns[n].pid, 0) < 0 && errno == ESRCH))
+            n++;
+    }
+
+#define CONN_SERIES(name, type, help, fmt, value)                                                          \
+    do                                                                                                     \
+    {                                                                                                      \
+        metric(fp, name, type, help);                                                                      \
+        for (i = 0; i < n; i++)                                                                            \
+            fprintf(fp, name "{pid=\"%d\",peer=\"%s\"} " fmt "\n", (int)conns[i].pid, conns[i].host, value); \
+    } while (0)
+
+    CONN_SERIES("fileserver_connection_start_time_seconds", "gauge", "Accept of the connection, seconds since the epoch.",
+                "%llu", (unsigned long long)conns[i].since);
+    CONN_SERIES("fileserver_connection_sent_bytes_total", "counter", "File content sent on the connection.", "%llu",
+                (unsigned long long)conns[i].bytes);
+    CONN_SERIES("fileserver_connection_rtt_seconds", "gauge", "Smoothed round trip time (TCP_INFO).", "%.6f",
+                conns[i].rtt / 1e6);
+    CONN_SERIES("fileserver_connection_rttvar_seconds", "gauge", "Round trip time variation (TCP_INFO).", "%.6f",
+                conns[i].rttvar / 1e6);
+    CONN_SERIES("fileserver_connection_cwnd_segments", "gauge", "Congestion window (TCP_INFO).", "%u", conns[i].cwnd);
+    CONN_SERIES("fileserver_connection_unacked_segments", "gauge", "Segments in flight (TCP_INFO).", "%u",
+                conns[i].unacked);
+    CONN_SERIES("fileserver_connection_retransmits_total", "counter", "Segments retransmitted (TCP_INFO).", "%u",
+                conns[i].retrans);
+
+#undef CONN_SERIES
+
+    return 0;
+}
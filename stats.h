@@ -0,0 +1,90 @@
+/*
+
+ module: stats.h
+
+ purpose: definitions of functions in stats.c
+
+ reference: Prometheus, text-based exposition format
+
+ */
+
+#ifndef _STATS_H
+
+#define _STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* outcome of a request, see stats_request() */
+#define STATS_OK 0        /* file sent (or passed, stored, listed) */
+#define STATS_NOT_FOUND 1 /* "-ERR" or ERROR V2_ENOENT */
+#define STATS_INVALID 2   /* name outside the working directory, ERROR V2_EINVAL */
+#define STATS_ILLEGAL 3   /* malformed command, the connection is closed */
+#define STATS_BROKEN 4    /* the response was interrupted (client gone, too slow, file truncated) */
+#define STATS_OUTCOMES 5
+
+/* caches looked up before the filesystem, see stats_cache() */
+#define STATS_ARCHIVE 0 /* packed archive: the name is in it */
+#define STATS_INDEX 1   /* metadata index: it knows the name (found or missing) */
+#define STATS_PROXY 2   /* proxy cache: the file is in the working directory */
+#define STATS_SHARED 3  /* metadata cache shared by the workers: an answer still valid (see cache.h) */
+#define STATS_CACHES 4
+
+#define STATS_CONNS 256       /* connections with their TCP_INFO exposed, the others are only counted */
+#define STATS_TCP_PERIOD 1000 /* milliseconds between two TCP_INFO samples of a connection */
+#define STATS_HOSTLEN 64
+
+/* a connection being served, owned by the worker "pid" (0: free) */
+struct stats_conn
+{
+    pid_t pid;
+    char host[STATS_HOSTLEN];
+    int tcp;                  /* the TCP_INFO fields are valid */
+    uint64_t since;           /* CLOCK_REALTIME seconds of the accept */
+    uint64_t sampled;         /* CLOCK_MONOTONIC milliseconds of the last TCP_INFO */
+    uint64_t bytes;           /* content sent */
+    uint32_t rtt, rttvar;     /* microseconds */
+    uint32_t cwnd, unacked;   /* segments */
+    uint32_t retrans;         /* segments retransmitted since the accept */
+};
+
+/* in shared memory, inherited by the forked workers; every counter is atomic */
+struct stats_shm
+{
+    uint64_t start;     /* CLOCK_REALTIME seconds */
+    uint64_t accepts;   /* connections served */
+    uint64_t active;    /* being served now */
+    uint64_t bytes;     /* content sent, frame and response headers excluded */
+    uint64_t requests[STATS_OUTCOMES];
+    uint64_t sendfile_timeouts, sendfile_errors;
+    uint64_t shaped, shaped_ns;     /* waits imposed by the bandwidth limits (see shape.h), their total */
+    uint64_t cache[STATS_CACHES][2]; /* misses, hits */
+    struct stats_conn conns[STATS_CONNS];
+};
+
+int stats_init(void);
+
+void Stats_init(void);
+
+void stats_open(int fd, const char *host);
+
+void stats_close(void);
+
+void stats_reap(pid_t pid);
+
+void stats_request(int outcome);
+
+void stats_cache(int cache, int hit);
+
+void stats_sent(uint64_t bytes);
+
+void stats_sendfile_error(int timeout);
+
+void stats_shaped(uint64_t ns);
+
+void stats_tcp(int force);
+
+int stats_write(FILE *fp);
+
+#endif
@@ -0,0 +1,235 @@
+/*
+
+module: timewheel.c
+
+purpose: hierarchical timer wheel used to track connection deadlines
+
+author: Luigi Ferrettino (S254300)
+
+*/
+
+#include <time.h>
+#include <limits.h>
+
+#include "timewheel.h"
+
+/* shift of the given level inside the expiry time */
+#define TW_SHIFT(level) (TW_BITS * (level))
+
+static void list_init(struct tw_list *head)
+{
+    head->next = head->prev = head;
+}
+
+static void list_append(struct tw_list *head, struct tw_list *node)
+{
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+static void list_unlink(struct tw_list *node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->next = node->prev = NULL;
+}
+
+/* monotonic clock in milliseconds, not affected by changes of the wall clock */
+uint64_t tw_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void tw_init(struct timewheel *tw, uint64_t now)
+{
+    int level, i;
+
+    tw->now = now;
+    tw->count = 0;
+    for (level = 0; level < TW_LEVELS; level++)
+        for (i = 0; i < TW_SLOTS; i++)
+            list_init(&tw->slot[level][i]);
+    list_init(&tw->overflow);
+}
+
+void tw_timer_init(struct tw_timer *t, void (*fn)(struct tw_timer *, void *), void *arg)
+{
+    t->link.next = t->link.prev = NULL;
+    t->expires = 0;
+    t->fn = fn;
+    t->arg = arg;
+}
+
+/**************************************************************************
+ * a timer goes in the lowest level whose upper bits agree with the current
+ * time: its digit on that level is then always ahead of the current one, so
+ * it is moved down exactly when the wheel reaches the start of its slot.
+ **************************************************************************/
+static void tw_place(struct timewheel *tw, struct tw_timer *t)
+{
+    uint64_t expires = t->expires < tw->now ? tw->now : t->expires;
+    int level;
+
+    for (level = 0; level < TW_LEVELS; level++)
+        if ((expires >> TW_SHIFT(level + 1)) == (tw->now >> TW_SHIFT(level + 1)))
+            break;
+
+    if (level == TW_LEVELS)
+        list_append(&tw->overflow, &t->link);
+    else
+        list_append(&tw->slot[level][(expires >> TW_SHIFT(level)) & TW_MASK], &t->link);
+}
+
+/* (re)arm a timer; a pending timer is moved, so this is also the "modify" operation */
+void tw_add(struct timewheel *tw, struct tw_timer *t, uint64_t expires)
+{
+    if (tw_pending(t))
+        tw_del(tw, t);
+
+    t->expires = expires;
+    tw_place(tw, t);
+    tw->count++;
+}
+
+void tw_del(struct timewheel *tw, struct tw_timer *t)
+{
+    if (!tw_pending(t))
+        return;
+
+    list_unlink(&t->link);
+    tw->count--;
+}
+
+int tw_pending(const struct tw_timer *t)
+{
+    return t->link.next != NULL;
+}
+
+/* re-place every timer of a slot, they will end up on a lower level */
+static void tw_cascade(struct timewheel *tw, struct tw_list *head)
+{
+    struct tw_list pending;
+
+    if (head->next == head)
+        return;
+
+    /* move the whole slot on a local list first, tw_place() may append to the same slot */
+    pending.next = head->next;
+    pending.prev = head->prev;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    list_init(head);
+
+    while (pending.next != &pending)
+    {
+        struct tw_list *node = pending.next;
+        list_unlink(node);
+        tw_place(tw, (struct tw_timer *)node);
+    }
+}
+
+/*************************************************************************
+ * first tick that has something to do (an expiry or a non empty cascade):
+ * every tick before it can be skipped, and it is the poll() timeout too.
+ *************************************************************************/
+static uint64_t tw_next_tick(const struct timewheel *tw)
+{
+    int level, i;
+
+    /*************************************************************************
+     * a skip may have stopped right on a boundary whose cascade has not run:
+     * that tick comes before any slot of level 0, whose timers were placed
+     * after the skip and so may look earlier than the ones still up there
+     *************************************************************************/
+    if ((tw->now & (((uint64_t)1 << TW_SHIFT(TW_LEVELS)) - 1)) == 0 && tw->overflow.next != &tw->overflow)
+        return tw->now;
+    for (level = 1; level < TW_LEVELS; level++)
+    {
+        const struct tw_list *head = &tw->slot[level][(tw->now >> TW_SHIFT(level)) & TW_MASK];
+
+        if ((tw->now & (((uint64_t)1 << TW_SHIFT(level)) - 1)) != 0)
+            break;
+        if (head->next != head)
+            return tw->now;
+    }
+
+    for (i = tw->now & TW_MASK; i < TW_SLOTS; i++)
+        if (tw->slot[0][i].next != &tw->slot[0][i])
+            return (tw->now & ~(uint64_t)TW_MASK) | i;
+
+    /* the current slot of a level is still due only if its cascade (at tw->now) has not run yet */
+    for (level = 1; level < TW_LEVELS; level++)
+        for (i = ((tw->now >> TW_SHIFT(level)) & TW_MASK) + ((tw->now & (((uint64_t)1 << TW_SHIFT(level)) - 1)) != 0); i < TW_SLOTS; i++)
+            if (tw->slot[level][i].next != &tw->slot[level][i])
+                return ((tw->now >> TW_SHIFT(level + 1)) << TW_SHIFT(level + 1)) | ((uint64_t)i << TW_SHIFT(level));
+
+    /* round up to the next overflow cascade */
+    return ((tw->now + ((uint64_t)1 << TW_SHIFT(TW_LEVELS)) - 1) >> TW_SHIFT(TW_LEVELS)) << TW_SHIFT(TW_LEVELS);
+}
+
+/* process every tick up to "now" (included), calling the expired timers */
+void tw_advance(struct timewheel *tw, uint64_t now)
+{
+    int level;
+
+    while (tw->now <= now)
+    {
+        struct tw_list *head;
+        uint64_t next;
+
+        /* nothing is pending, no need to walk the ticks one by one */
+        if (tw->count == 0)
+        {
+            tw->now = now + 1;
+            break;
+        }
+
+        /* skip the ticks with nothing to do */
+        if ((next = tw_next_tick(tw)) > now)
+        {
+            tw->now = now + 1;
+            break;
+        }
+        tw->now = next;
+
+        /* moving from the top to the bottom, a timer can fall more than one level at once */
+        if ((tw->now & (((uint64_t)1 << TW_SHIFT(TW_LEVELS)) - 1)) == 0)
+            tw_cascade(tw, &tw->overflow);
+        for (level = TW_LEVELS - 1; level > 0; level--)
+            if ((tw->now & (((uint64_t)1 << TW_SHIFT(level)) - 1)) == 0)
+                tw_cascade(tw, &tw->slot[level][(tw->now >> TW_SHIFT(level)) & TW_MASK]);
+
+        head = &tw->slot[0][tw->now & TW_MASK];
+        while (head->next != head)
+        {
+            struct tw_timer *t = (struct tw_timer *)head->next;
+
+            list_unlink(&t->link);
+            tw->count--;
+            t->fn(t, t->arg);
+        }
+
+        tw->now++;
+    }
+}
+
+/* milliseconds from "now" to the next tick that needs processing, -1 if nothing is pending */
+int tw_next_timeout(const struct timewheel *tw, uint64_t now)
+{
+    uint64_t next;
+
+    if (tw->count == 0)
+        return -1;
+
+    next = tw_next_tick(tw);
+    if (next <= now)
+        return 0;
+    if (next - now > INT_MAX)
+        return INT_MAX;
+    return (int)(next - now);
+}
@@ -0,0 +1,64 @@
+/*
+
+ module: timewheel.h
+
+ purpose: definitions of functions in timewheel.c
+
+ reference: Varghese & Lauck, Hashed and Hierarchical Timing Wheels (1987)
+
+ */
+
+#ifndef _TIMEWHEEL_H
+
+#define _TIMEWHEEL_H
+
+#include <stdint.h>
+
+/***************************************************************************
+ * one tick is one millisecond; every level has TW_SLOTS slots and covers
+ * TW_BITS more bits of the expiry time, so TW_LEVELS levels cover 2^30 ms
+ * (~12 days). Anything farther away waits in the overflow list.
+ ***************************************************************************/
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_MASK (TW_SLOTS - 1)
+#define TW_LEVELS 5
+
+struct tw_list
+{
+    struct tw_list *next, *prev;
+};
+
+struct tw_timer
+{
+    struct tw_list link;                         /* MUST be the first member */
+    uint64_t expires;                            /* absolute expiry time (ms) */
+    void (*fn)(struct tw_timer *timer, void *arg); /* called on expiry */
+    void *arg;                                   /* opaque argument for fn */
+};
+
+struct timewheel
+{
+    uint64_t now;                                /* next tick to be processed */
+    unsigned count;                              /* number of pending timers */
+    struct tw_list slot[TW_LEVELS][TW_SLOTS];
+    struct tw_list overflow;
+};
+
+uint64_t tw_now_ms(void);
+
+void tw_init(struct timewheel *tw, uint64_t now);
+
+void tw_timer_init(struct tw_timer *t, void (*fn)(struct tw_timer *, void *), void *arg);
+
+void tw_add(struct timewheel *tw, struct tw_timer *t, uint64_t expires);
+
+void tw_del(struct timewheel *tw, struct tw_timer *t);
+
+int tw_pending(const struct tw_timer *t);
+
+void tw_advance(struct timewheel *tw, uint64_t now);
+
+int tw_next_timeout(const struct timewheel *tw, uint64_t now);
+
+#endif
@@ -0,0 +1,243 @@
+/*********************************************************************************************************************
+  *                                                   TIMER WHEEL CHECK
+  *
+  * Runs the timer wheel of timewheel.c against a plain reference (every timer with its expiry, scanned in full):
+  * random additions, re-arms and deletions at distances from one tick to beyond the overflow, and advances both by
+  * the timeout the wheel asks for and by random jumps, so skips land on cascade boundaries of every level.
+  * After every advance exactly the timers due must have fired, each at most once, and the timeout must never be
+  * later than the earliest expiry:
+  *
+  *   twcheck [-r <rounds>] [-n <timers>] [-s <seed>]
+  *
+  * The first failure is printed with the seed and the round, and the exit status is 1.
+  *
+  *
+  * [ author: Luigi Ferrettino (S254300) ]
+  *********************************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../errlib.h"
+#include "../timewheel.h"
+
+#define TWCHECK_ROUNDS 20000
+#define TWCHECK_TIMERS 512
+
+/* GLOBAL VARIABLES */
+char *prog_name;
+
+/* a timer and what the reference knows of it */
+struct item
+{
+  struct tw_timer t;
+  int armed;        /* pending according to the reference */
+  uint64_t expires; /* according to the reference */
+  int fired;        /* calls of the callback since the last check */
+};
+
+static struct timewheel wheel;
+static struct item *items;
+static int nitems;
+static uint64_t clock_now; /* time of the advance being run */
+static unsigned seed;
+static long round_no;
+
+/* PROTOTYPES */
+void usage(void);
+void fire(struct tw_timer *t, void *arg);
+uint64_t distance(void);
+void fail(const char *what, int i);
+void check_advance(uint64_t now);
+void check_timeout(void);
+void regression(void);
+
+void usage(void)
+{
+  err_quit("Usage: %s [-r <rounds>] [-n <timers>] [-s <seed>]", prog_name);
+}
+
+void fire(struct tw_timer *t, void *arg)
+{
+  struct item *it = arg;
+
+  it->fired++;
+  if (t->expires > clock_now)
+    fail("fired early", it - items);
+}
+
+/* a distance from now covering every level of the wheel, with a bias for the boundaries */
+uint64_t distance(void)
+{
+  int level = rand() % (TW_LEVELS + 2);
+  uint64_t span = (uint64_t)1 << (TW_BITS * level);
+
+  switch (rand() % 4)
+  {
+  case 0:
+    return rand() % TW_SLOTS;
+  case 1:
+    return span - 1 + rand() % 3;
+  default:
+    return ((uint64_t)rand() << 16 ^ rand()) % (span + 1);
+  }
+}
+
+void fail(const char *what, int i)
+{
+  printf("FAIL seed %u round %ld: %s (timer %d, expires %llu, now %llu)\n", seed, round_no, what, i,
+         i >= 0 ? (unsigned long long)items[i].expires : 0ULL, (unsigned long long)clock_now);
+  exit(1);
+}
+
+/* advance the wheel to "now": the timers due, and only them, must have fired once */
+void check_advance(uint64_t now)
+{
+  int i;
+
+  clock_now = now;
+  tw_advance(&wheel, now);
+
+  for (i = 0; i < nitems; i++)
+  {
+    struct item *it = &items[i];
+    int due = it->armed && it->expires <= now;
+
+    if (it->fired > 1)
+      fail("fired twice", i);
+    if (due && !it->fired)
+      fail("lost", i);
+    if (!due && it->fired)
+      fail("fired but not armed", i);
+    if (due)
+      it->armed = 0;
+    if (tw_pending(&it->t) != it->armed)
+      fail("pending state differs", i);
+    it->fired = 0;
+  }
+}
+
+/* the timeout asked by the wheel must not be later than the earliest expiry */
+void check_timeout(void)
+{
+  uint64_t first = UINT64_MAX;
+  int i, timeout;
+
+  for (i = 0; i < nitems; i++)
+    if (items[i].armed && items[i].expires < first)
+      first = items[i].expires;
+
+  timeout = tw_next_timeout(&wheel, clock_now);
+  if (first == UINT64_MAX)
+  {
+    if (timeout != -1)
+      fail("timeout with nothing pending", -1);
+  }
+  else if (timeout < 0 || (first > clock_now && (uint64_t)timeout > first - clock_now))
+    fail("timeout later than the earliest expiry", -1);
+}
+
+/* a skip stopping on a level 1 boundary, then a timer added below it */
+void regression(void)
+{
+  int n = nitems;
+
+  nitems = 2;
+  tw_init(&wheel, 100);
+  clock_now = 100;
+
+  items[0].expires = 322;
+  items[0].armed = 1;
+  tw_add(&wheel, &items[0].t, 322);
+  check_advance(319);
+
+  items[1].expires = 330;
+  items[1].armed = 1;
+  tw_add(&wheel, &items[1].t, 330);
+  check_timeout();
+  check_advance(4500);
+
+  nitems = n;
+}
+
+int main(int argc, char *argv[])
+{
+  long rounds = TWCHECK_ROUNDS;
+  int opt, i, n;
+  uint64_t now;
+
+  prog_name = argv[0];
+  nitems = TWCHECK_TIMERS;
+  seed = getpid();
+
+  while ((opt = getopt(argc, argv, "r:n:s:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'r':
+      rounds = atol(optarg);
+      break;
+    case 'n':
+      nitems = atoi(optarg);
+      break;
+    case 's':
+      seed = strtoul(optarg, NULL, 10);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind != argc || nitems < 2 || rounds < 1)
+    usage();
+
+  if ((items = calloc(nitems, sizeof(*items))) == NULL)
+    err_sys("(%s) error - calloc() failed", prog_name);
+  for (i = 0; i < nitems; i++)
+    tw_timer_init(&items[i].t, fire, &items[i]);
+
+  regression();
+
+  srand(seed);
+  now = (uint64_t)rand() << 8;
+  tw_init(&wheel, now);
+  clock_now = now;
+
+  for (round_no = 0; round_no < rounds; round_no++)
+  {
+    /* a few timers armed, re-armed or deleted */
+    for (n = rand() % 8; n > 0; n--)
+    {
+      struct item *it = &items[rand() % nitems];
+
+      if (rand() % 4 == 0)
+      {
+        tw_del(&wheel, &it->t);
+        it->armed = 0;
+      }
+      else
+      {
+        it->expires = now + distance();
+        it->armed = 1;
+        tw_add(&wheel, &it->t, it->expires);
+
+        /* a tick already processed is not processed again: the timer fires on the next one */
+        if (it->expires < wheel.now)
+          it->expires = wheel.now;
+      }
+    }
+    check_timeout();
+
+    /* as a server waiting in poll(), or woken up earlier or much later */
+    if (rand() % 2 == 0 && (n = tw_next_timeout(&wheel, now)) >= 0)
+      now += n;
+    else
+      now += distance();
+    check_advance(now);
+  }
+
+  printf("OK seed %u: %ld rounds, %d timers\n", seed, rounds, nitems);
+  return 0;
+}